@@ -3,8 +3,12 @@
 #ifndef _FFFS_H_
 #define _FFFS_H_
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "esp_err.h"
-#include "driver/sdmmc_host.h"
+#include "esp_heap_caps.h"
+#include "fffs_bdev.h"
 
 
 #define KILOBYTE 1024
@@ -34,16 +38,229 @@ typedef struct fffs_partition_table//__attribute__((packed))
 
 }fffs_partition_table_t;
 
+#define FFFS_FILTER_BITS 1024     //<Bits of the Bloom filter of a sector
+#define FFFS_FILTER_HASHES 3      //<Bits set per key
+#define FFFS_SUMMARY_PARTIAL 0x01 //<Messages recovered at mount are missing from the summary, so it rules nothing out
+
+/**
+ * Summary of the messages starting in a sector, gathered as they are appended. fffs_scan skips sealed sectors
+ * whose summary rules the query out.
+ */
+typedef struct fffs_sector_summary
+{
+    uint32_t messages;                    //<Messages starting in the sector
+    uint32_t bytes;                       //<Their size as written, before compression
+    int32_t value_min;                    //<Smallest config.value_key of them. Above value_max when none had one
+    int32_t value_max;                    //<Largest config.value_key of them
+    uint8_t flags;                        //<FFFS_SUMMARY_PARTIAL
+    uint8_t filter[FFFS_FILTER_BITS / 8]; //<Bloom filter over config.filter_key
+} fffs_sector_summary_t;
+
+#define FFFS_ERASED_RANGES 2 //<Ranges erased with fffs_erase_range a volume keeps track of besides the low-water mark
+
+/**
+ * Messages from from up to to, excluded, erased with fffs_erase_range.
+ */
+typedef struct fffs_erased_range
+{
+    uint32_t from;
+    uint32_t to;
+} fffs_erased_range_t;
+
 typedef struct //struct __attribute__((packed))
 {
     fffs_partition_table_t partition_sector_table; //<The sector table is made up of the boot_partition table first ....
     uint32_t first_message;
     uint8_t sector_message_index[(SECTOR_SIZE) / BLOCKS_IN_SECTOR]; //<folowed by the meesage offsets in each block in the sector
+    uint32_t head_sector;                          //<Boot block only: a recent sector of the write head. Mount walks forward from it
+    uint32_t volume_id;                            //<Changes with every format so that headers left over from an earlier one are ignored
+    uint8_t compressed_blocks[(SECTOR_SIZE) / 8];  //<Bit k is set when data block k of the sector holds compressed messages
+    uint32_t first_time;                           //<Clock when the sector was opened. No message in the sector is older
+    uint32_t last_time;                            //<Clock of the newest message recorded in the sector
+    fffs_sector_summary_t summary;                 //<Complete once the sector is sealed
+    uint32_t key_blocks;                           //<Boot block only: blocks of the key index at the end of the card
+    uint32_t epoch;                                //<Laps of a message_rotate card completed when the sector was opened. A table from an earlier lap is stale
+    uint32_t low_water;                            //<Messages below it were truncated by fffs_truncate_before. Carried over to every new sector
+    fffs_erased_range_t erased[FFFS_ERASED_RANGES]; //<Ranges erased above low_water. Empty when from equals to
+    uint32_t forward_blocks;                       //<Boot block only: blocks of the forwarding table after the key index
 } fffs_sector_table_t;
 
+/**
+ * Every data block starts with this header. Blocks are not erased before reuse, so a block only counts as
+ * written if both stamps match what the volume expects at that position.
+ * Messages follow the header back to back. The block ends with a trailer of uint16_t end offsets growing
+ * down from the end of the block, entry k at SD_BLOCK_SIZE - 2 * (k + 1), so any message is found in O(1).
+ * A message that does not fit is split: its first fragment fills the block and starts with the uint32_t size of
+ * the whole message, the rest is carried at the start of the following data blocks.
+ * The time stamp only grows, so blocks can be binary searched by time, see fffs_seek_time.
+ * Messages flagged FFFS_MESSAGE_COMPRESSED in the trailer are LZ compressed against the raw content of the
+ * messages before them in the block, up to FFFS_COMPRESS_WINDOW bytes, see fffs_lz.h. Messages flagged
+ * FFFS_MESSAGE_KEYED start with a uint32_t link to the previous message with the same key, left out when read.
+ * Messages flagged FFFS_MESSAGE_COPY were moved there by fffs_replace or fffs_compact and start with the uint32_t
+ * id of the message they hold, ahead of the link. Messages flagged FFFS_MESSAGE_ERASED read as not found.
+ */
+typedef struct fffs_block_header
+{
+    uint32_t volume_id;     //<Generation stamp: volume_id of the format the block was written under
+    uint32_t first_message; //<Sequence stamp: id of the first message that starts in the block
+    uint32_t time;          //<Clock of the last message appended to the block
+    uint8_t count;          //<Messages starting in the block
+    uint8_t flags;          //<FFFS_BLOCK_CONTINUES
+    uint16_t carry;         //<Bytes at the start of the data belonging to the message continued from the block before
+} fffs_block_header_t;
+
+#define FFFS_BLOCK_DATA (sizeof(fffs_block_header_t))            //<Offset of the first message in a block
+#define FFFS_BLOCK_CONTINUES 0x01                               //<The last message of the block continues in the next data block
+#define FFFS_BLOCK_COMPRESSED 0x02                              //<The block holds compressed messages
+#define FFFS_MESSAGE_COMPRESSED 0x8000                          //<Trailer flag of a compressed message, the rest is its end offset
+#define FFFS_MESSAGE_KEYED 0x4000                               //<Trailer flag of a message written with a key, see fffs_key_bucket_t
+#define FFFS_MESSAGE_ERASED 0x2000                              //<Trailer flag of a message dropped by fffs_erase or replaced by fffs_replace
+#define FFFS_MESSAGE_COPY 0x1000                                //<Trailer flag of a copy made by fffs_replace or fffs_compact, see fffs_forward_t
+#define FFFS_MESSAGE_FLAGS (FFFS_MESSAGE_COMPRESSED | FFFS_MESSAGE_KEYED | FFFS_MESSAGE_ERASED | FFFS_MESSAGE_COPY)
+#define FFFS_COMPRESS_WINDOW 2048                               //<Raw bytes of a block compressed messages can refer back to
+#define FFFS_MESSAGE_MAX (SD_BLOCK_SIZE - FFFS_BLOCK_DATA - sizeof(uint16_t)) //<Largest message that fits in one block
+
+#define FFFS_KEY_ENTRIES ((SD_BLOCK_SIZE - 2 * sizeof(uint32_t)) / (sizeof(uint64_t) + sizeof(uint32_t))) //<Keys held by a bucket
+#define FFFS_KEY_PROBES 8 //<Buckets tried from the home bucket of a key before the index counts as full
+#define FFFS_KEY_LINK sizeof(uint32_t) //<Bytes a keyed message takes on top of its content
+#define FFFS_KEY_NONE UINT32_MAX //<Link of the first message with a key
+
+/**
+ * Block of the key index, a hash table at the end of the card holding one entry per key: the id of the newest
+ * message with that key. A key goes to the bucket its hash selects or, once that one is full, to one of the next.
+ * Every keyed message links to the one before it with the same key, so the index stays the size of the key set
+ * however many messages share a key.
+ */
+typedef struct fffs_key_bucket
+{
+    uint32_t volume_id;                        //<Buckets left by an earlier format read as empty
+    uint32_t count;                            //<Entries in use
+    uint64_t keys[FFFS_KEY_ENTRIES];
+    uint32_t message_ids[FFFS_KEY_ENTRIES];    //<Newest message of each key
+} fffs_key_bucket_t;
+
+#define FFFS_COPY_ID sizeof(uint32_t) //<Bytes a copy takes on top of the message it holds
+
+/**
+ * Entry of the forwarding table: message id is held by the copy stored under id copy. A message keeps its id when
+ * fffs_replace or fffs_compact moves it, and reads follow the one entry to the copy.
+ */
+typedef struct fffs_forward
+{
+    uint32_t id;
+    uint32_t copy;
+} fffs_forward_t;
+
+#define FFFS_FORWARD_ENTRIES ((SD_BLOCK_SIZE - 2 * sizeof(uint32_t)) / sizeof(fffs_forward_t)) //<Entries held by a block of the forwarding table
+
+/**
+ * Block of the forwarding table, which follows the key index at the end of the card. Entries are sorted by id and
+ * fill the blocks in order, so the first block that is not full ends the table.
+ */
+typedef struct fffs_forward_block
+{
+    uint32_t volume_id;                        //<Blocks left by an earlier format read as empty
+    uint32_t count;                            //<Entries in use
+    fffs_forward_t entries[FFFS_FORWARD_ENTRIES];
+} fffs_forward_block_t;
+
+#define FFFS_COMPACT_HINTS 8 //<Sectors whose erased and replaced bytes a volume keeps count of for fffs_compact
+
+typedef struct fffs_compact_hint
+{
+    uint32_t sector;             //<Block number of the sector table. UINT32_MAX when the entry is free
+    uint32_t dead;               //<Bytes of the messages erased or replaced in the sector since the mount
+} fffs_compact_hint_t;
+
+typedef struct fffs_config
+{
+    uint32_t commit_messages;    //<Commit the tail block after this many appended messages. 0 commits only when the block is full or flushed
+    uint32_t commit_interval_ms; //<Commit the tail block on the next append once this many ms have passed since the last commit. 0 disables
+    uint32_t checkpoint_blocks;  //<Persist the sector table every time the writer has moved on this many blocks
+    uint32_t index_sectors;      //<Maximum entries of the message index (4 bytes each). Sectors are grouped when the card has more
+    uint32_t index_cache_sectors; //<Sector tables kept in RAM for lookups (one block each)
+    uint32_t index_caps;         //<heap_caps flags for the message index, e.g. MALLOC_CAP_SPIRAM
+    uint32_t batch_blocks;       //<Blocks fffs_write_batch can fill before issuing a multi-block write
+    uint32_t read_ahead_blocks;  //<Blocks a cursor reads with a single command
+    uint32_t head_sectors;       //<Record the write head in the boot block every time the writer has moved on this many sectors
+    uint32_t message_max;        //<Largest message accepted. Above FFFS_MESSAGE_MAX messages span blocks. Read buffers must hold this many bytes
+    bool pack_messages;          //<Split a message that does not fit in the rest of the tail block instead of starting a new block
+    bool compress;               //<Compress messages against the earlier messages of their block
+    uint32_t (*clock)(void);     //<Time stamp of appended messages, e.g. seconds since the epoch. NULL uses time()
+    bool (*value_key)(const void *message, int size, int32_t *value); //<Numeric key summarised per sector by its range. False if the message has none. NULL disables
+    bool (*filter_key)(const void *message, int size, uint32_t *key); //<Key added to the Bloom filter of the sector. False if the message has none. NULL disables
+    uint32_t key_index_blocks;   //<Blocks set aside at the end of the card for the key index when formatting. 0 leaves it out
+    uint32_t key_cache_buckets;  //<Key index buckets kept in RAM (one block each). Changes are written back with the timed commits, on flush and when every bucket cached holds some
+    bool message_rotate;         //<Format the card as a ring: once full, the writer wraps around over the oldest sectors instead of failing
+    uint32_t forward_blocks;     //<Blocks set aside after the key index for the forwarding table when formatting. 0 leaves fffs_replace and fffs_compact out
+} fffs_config_t;
+
+#define FFFS_CONFIG_DEFAULT()                 \
+    {                                         \
+        .commit_messages = 0,                 \
+        .commit_interval_ms = 1000,           \
+        .checkpoint_blocks = 32,              \
+        .index_sectors = 4096,                \
+        .index_cache_sectors = 4,             \
+        .index_caps = MALLOC_CAP_DEFAULT,     \
+        .batch_blocks = 8,                    \
+        .read_ahead_blocks = 16,              \
+        .head_sectors = 16,                   \
+        .message_max = FFFS_MESSAGE_MAX,      \
+        .pack_messages = true,                \
+        .compress = false,                    \
+        .clock = NULL,                        \
+        .value_key = NULL,                    \
+        .filter_key = NULL,                   \
+        .key_index_blocks = 0,                \
+        .key_cache_buckets = 8,               \
+        .message_rotate = false,              \
+        .forward_blocks = 0,                  \
+    }
+
+typedef struct fffs_message
+{
+    const void *data;
+    int size;
+} fffs_message_t;
+
+typedef struct fffs_index_cache
+{
+    uint32_t sector;             //<Block number of the cached sector table. UINT32_MAX when the entry is free
+    uint32_t used;               //<Lookup counter value at the last hit, the least recently used entry is replaced
+    fffs_sector_table_t *table;
+} fffs_index_cache_t;
+
+typedef struct fffs_key_cache
+{
+    uint32_t block;              //<Card block of the cached bucket. UINT32_MAX when the entry is free
+    uint32_t used;               //<Key clock value at the last use, the least recently used entry is replaced
+    bool dirty;                  //<Holds keys not written back yet
+    fffs_key_bucket_t *bucket;
+} fffs_key_cache_t;
+
+/**
+ * Raw content of the messages of a compressed block, rebuilt in order to decode them.
+ */
+typedef struct fffs_window
+{
+    uint8_t *buf;                //<FFFS_COMPRESS_WINDOW bytes, allocated on first use
+    uint32_t block;              //<Card block whose messages are in buf
+    uint32_t first_message;      //<first_message stamp of that block
+    uint16_t pos;                //<Bytes in buf
+    uint16_t next;               //<Messages of the block in buf
+} fffs_window_t;
+
+typedef struct fffs_lock
+{
+    void (*take)(void *ctx);
+    void (*give)(void *ctx);
+    void *ctx;
+} fffs_lock_t;
+
 typedef struct fffs_volume
 {
-    sdmmc_card_t *sd_card;
+    fffs_bdev_t *bdev;
     uint8_t partition_size;
     uint8_t sector_size;
     void *read_buf;
@@ -52,12 +269,85 @@ typedef struct fffs_volume
     uint32_t current_block;
     uint32_t last_block;
     uint32_t block_index;
-    char messages_in_block;
+    uint8_t messages_in_block;
     uint32_t message_id;
-    bool message_rotate;
+    uint32_t volume_id;
+    bool message_rotate;         //<The card is a ring, see fffs_next_block
+    uint32_t epoch;              //<Laps of the ring completed, stamped in every sector table opened
+    uint32_t oldest_sector;      //<Sector holding the oldest messages: the one after current_sector once the ring has wrapped
+    uint32_t oldest_message_id;  //<Messages below it have been written over or truncated. Reads of them fail with ESP_ERR_NOT_FOUND
+    void *stage_buf;             //<DMA buffer of batch_blocks blocks, holding stage_block onwards
+    uint32_t stage_block;        //<Card block of the first stage slot
+    uint16_t stage_slot;         //<Stage slot of the tail. Slots before it are full blocks waiting for the commit
+    uint8_t *stage_counts;       //<Messages in each full stage slot
+    void *tail_buf;              //<RAM copy of last_block inside stage_buf. Appends go here and reach the card on commit
+    void *sent_buf;              //<Second stage buffer when the device has write_start, see fffs_send. NULL otherwise
+    uint32_t sent_block;         //<Card block of the first block in sent_buf
+    uint32_t sent_count;         //<Blocks of sent_buf being written. 0 once the write is done and sent_buf is free
+    uint16_t tail_offset;        //<Offset of the next message in tail_buf
+    uint32_t tail_first_message; //<Id of the first message stored in tail_buf
+    uint32_t tail_dirty;         //<Changes made to tail_buf since the last commit
+    bool tail_split;             //<A message spanning blocks is being appended. Commits keep the lock so it is never seen in part
+    int64_t tail_commit_time;    //<esp_timer time of the last commit in microseconds
+    uint32_t last_time;          //<Clock of the last message appended. Held when the clock goes back so stamps never decrease
+    fffs_sector_table_t *sector_table; //<RAM copy of the table at current_sector. Written to the card at checkpoints
+    bool table_dirty;            //<sector_table has changed since the last checkpoint
+    uint32_t checkpoint_block;   //<last_block when sector_table was last written to the card
+    uint32_t *index_first;       //<first_message of every (1 << index_shift)th sector, UINT32_MAX until the sector has been looked at
+    uint32_t index_entries;
+    uint8_t index_shift;
+    fffs_index_cache_t *index_cache;
+    uint32_t index_clock;
+    uint8_t *lz_window;          //<Raw content of the tail block compressed messages can refer back to. NULL without compression
+    uint16_t *lz_table;          //<Match table over lz_window
+    uint8_t *lz_out;             //<Compressed form of the message being appended
+    int lz_pos;                  //<Bytes in lz_window
+    int lz_hashed;               //<Bytes of lz_window in lz_table
+    fffs_window_t read_window;   //<Decodes compressed messages for fffs_read
+    uint32_t data_blocks;        //<Blocks of the card holding the log. The key index follows them
+    uint32_t key_blocks;         //<Buckets of the key index, 0 without one
+    fffs_key_cache_t *key_cache; //<Allocated on the first keyed write
+    uint8_t *key_record;         //<Link and content of the keyed message being appended
+    uint32_t key_clock;
+    uint32_t forward_blocks;     //<Blocks of the forwarding table, 0 without one
+    fffs_forward_t *forward;     //<Forwarding table, sorted by id. Every change is written to the card at once
+    uint32_t forward_count;
+    uint8_t *copy_record;        //<Id, link and content of the copy being appended
+    uint8_t *compact_buf;        //<DMA buffer of fffs_read_blocks blocks the sector being compacted is read into
+    fffs_compact_hint_t compact_hints[FFFS_COMPACT_HINTS];
+    fffs_config_t config;
+    fffs_lock_t lock;            //<Guards the volume state against readers in other tasks. Left empty when single threaded
 }fffs_volume_t;
 
-fffs_volume_t *fffs_init(sdmmc_card_t *s_card, bool format);
+/**
+ * Read handle with its own DMA buffer. Only the lookup and messages still in RAM need the volume lock,
+ * committed blocks are read from the card without it so readers do not hold up the writer or each other.
+ */
+typedef struct fffs_reader
+{
+    fffs_volume_t *vol;
+    uint8_t *buf;                //<DMA buffer of one block
+    fffs_window_t window;
+} fffs_reader_t;
+
+typedef struct fffs_cursor
+{
+    fffs_volume_t *vol;
+    uint32_t message_id;         //<Id of the message returned by the next call to fffs_cursor_next
+    uint32_t block;              //<Card block holding that message
+    uint8_t *ahead_buf;          //<DMA buffer of read_ahead_blocks blocks
+    uint32_t ahead_block;        //<Card block of the first block in ahead_buf
+    uint32_t ahead_count;        //<Blocks held in ahead_buf
+    fffs_window_t window;        //<Kept across calls so each message of a compressed block is decoded once
+} fffs_cursor_t;
+
+/**
+ * Mounts the volume on bdev. When none can be mounted, because the card was never formatted or could not be read,
+ * the card is formatted if format is set and NULL is returned otherwise.
+ */
+fffs_volume_t *fffs_init(fffs_bdev_t *bdev, bool format);
+
+fffs_volume_t *fffs_init_with_config(fffs_bdev_t *bdev, bool format, const fffs_config_t *config);
 
 esp_err_t fffs_deinit(fffs_volume_t *fffs_vol);
 
@@ -67,10 +357,152 @@ esp_err_t fffs_format(fffs_volume_t *fffs_volume, unsigned char partition_size,
 
 esp_err_t fffs_write(fffs_volume_t *fffs_volume, void *message, int size);
 
+/**
+ * Appends count messages packed into consecutive blocks, written with a single multi-block command per sector.
+ * The messages get the ids first_id to first_id + count - 1. A message of size 0 only takes up an id.
+ */
+esp_err_t fffs_write_batch(fffs_volume_t *fffs_volume, const fffs_message_t *messages, size_t count, uint32_t *first_id);
+
+/**
+ * Appends a message as fffs_write does and records it under key in the key index. The message can be up to
+ * message_max - FFFS_KEY_LINK bytes. Returns ESP_ERR_NOT_SUPPORTED if the card was formatted without a key index
+ * and ESP_ERR_NO_MEM if the buckets of a new key are full, the message being written without it all the same.
+ * The index reaches the card when a bucket leaves the cache and on fffs_flush.
+ */
+esp_err_t fffs_write_key(fffs_volume_t *fffs_volume, void *message, int size, uint64_t key);
+
+esp_err_t fffs_flush(fffs_volume_t *fffs_volume);
+
+/**
+ * Copies message message_num into message, which must hold config.message_max bytes (at least SD_BLOCK_SIZE).
+ */
 esp_err_t fffs_read(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *message, int *size);
 
+/**
+ * Copies message message_num into buf, which holds cap bytes, and sets *size to its size. Returns
+ * ESP_ERR_INVALID_SIZE with *size set to the size of the message, and buf left alone, if it does not fit. A caller
+ * can read into static or pooled storage with one call instead of asking for the size first.
+ */
+esp_err_t fffs_read_into(fffs_volume_t *fffs_vol, size_t message_num, void *buf, size_t cap, int *size);
+
+fffs_reader_t *fffs_reader_create(fffs_volume_t *fffs_vol);
+
+/**
+ * Copies message message_num into message, sized as for fffs_read. Readers can run concurrently
+ * with each other and with the writer once a lock has been installed in the volume (see fffs_rt_Init).
+ */
+esp_err_t fffs_reader_read(fffs_reader_t *reader, uint32_t message_num, uint8_t *message, int *size);
+
+esp_err_t fffs_reader_delete(fffs_reader_t *reader);
+
+/**
+ * Opens a cursor returning messages in order, starting with message from_id. Sealed blocks are fetched
+ * read_ahead_blocks at a time, so a sequential export costs one lookup and one card command per batch.
+ */
+fffs_cursor_t *fffs_cursor_open(fffs_volume_t *fffs_vol, uint32_t from_id);
+
+/**
+ * Copies the next message into message, sized as for fffs_read, and its id into message_id, which may be NULL.
+ * Returns ESP_ERR_NOT_FOUND once the cursor has caught up with the writer. It can be called again later to continue.
+ */
+esp_err_t fffs_cursor_next(fffs_cursor_t *cursor, uint8_t *message, int *size, uint32_t *message_id);
+
+esp_err_t fffs_cursor_close(fffs_cursor_t *cursor);
+
+/**
+ * Conditions of a scan. Sealed sectors are ruled out on their summary, the messages of the others on match.
+ */
+typedef struct fffs_query
+{
+    bool use_value;              //<Only sectors with a value_key in [value_min, value_max]
+    int32_t value_min;
+    int32_t value_max;
+    bool use_filter;             //<Only sectors whose Bloom filter may hold filter_key
+    uint32_t filter_key;
+    bool (*sector)(const fffs_sector_summary_t *summary, void *ctx); //<Further test on the summary of a sealed sector. NULL keeps them all
+    bool (*match)(const void *message, int size, void *ctx);         //<Test on each message read. NULL returns them all
+    void *ctx;
+} fffs_query_t;
+
+typedef struct fffs_scan
+{
+    fffs_cursor_t *cursor;
+    fffs_query_t query;
+    uint32_t limit;              //<Id past the sector the cursor was last let into
+    uint32_t skipped;            //<Sectors ruled out without being read
+} fffs_scan_t;
+
+/**
+ * Opens a scan returning the messages from from_id on that satisfy query. Each sealed sector is first tested on its
+ * summary and skipped whole when it cannot hold a match. The sector being written is always read.
+ */
+fffs_scan_t *fffs_scan_open(fffs_volume_t *fffs_vol, uint32_t from_id, const fffs_query_t *query);
+
+/**
+ * Copies the next matching message as fffs_cursor_next does, with the same ESP_ERR_NOT_FOUND at the write head.
+ */
+esp_err_t fffs_scan_next(fffs_scan_t *scan, uint8_t *message, int *size, uint32_t *message_id);
+
+esp_err_t fffs_scan_close(fffs_scan_t *scan);
+
+/**
+ * Calls found with the id of every message written under key, newest first, until it returns false. The buckets
+ * of key give the newest one and each further id costs the read of one block. Erased messages are passed over.
+ * found is called without the volume lock held. Returns ESP_ERR_NOT_FOUND if no message has the key.
+ */
+esp_err_t fffs_lookup_key(fffs_volume_t *fffs_vol, uint64_t key, bool (*found)(uint32_t message_id, void *ctx), void *ctx);
+
+/**
+ * Finds the first message written at or after time, as given by config.clock, with a binary search over the
+ * sector tables and then the block headers of one sector. Messages are stamped per block, so the id returned is
+ * the first message of the first block holding one at or after time and the few before it in that block may be
+ * older. Returns ESP_ERR_NOT_FOUND, with message_id set to the next id, when every message is older.
+ */
+esp_err_t fffs_seek_time(fffs_volume_t *fffs_vol, uint32_t time, uint32_t *message_id);
+
+/**
+ * Erase flags a message as erased in its block, and wipes it unless the block is compressed. Reads of it then return
+ * ESP_ERR_NOT_FOUND, and cursors and scans skip it. The space it takes is reclaimed by fffs_compact.
+ */
 esp_err_t fffs_erase(fffs_volume_t *fffs_vol, size_t message_num);
 
+/**
+ * Overwrites a message in place with the same number of bytes. Messages spanning blocks or in compressed blocks
+ * return ESP_ERR_NOT_SUPPORTED, see fffs_replace.
+ */
 esp_err_t fffs_update(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *new_message);
 
+/**
+ * Replaces message message_num with size bytes of any length. The message is overwritten in place if it keeps its
+ * size and can be, as by fffs_update. Otherwise the new content is appended as a copy at the write head and the
+ * forwarding table sends later reads of message_num to it, so the message keeps its id and key. Returns
+ * ESP_ERR_NOT_SUPPORTED if the card was formatted without forward_blocks and ESP_ERR_NO_MEM if the table is full.
+ */
+esp_err_t fffs_replace(fffs_volume_t *fffs_vol, uint32_t message_num, const void *message, int size);
+
+/**
+ * Reclaims the space of erased and replaced messages. The sealed sector with the most such bytes since the mount is
+ * compacted if they make up at least min_dead_percent of it: the messages still live in it are copied to the write
+ * head and forwarded, and its data blocks are discarded with the erase command of the device. Copies take ids of
+ * their own that read as not found. moved, which may be NULL, is set to the number of messages copied. Returns
+ * ESP_ERR_NOT_FOUND if no sector qualifies and ESP_ERR_NO_MEM if the forwarding table or, on a ring, the sectors
+ * ahead of the write head ran out. The messages copied until then stay forwarded and the sector is kept.
+ */
+esp_err_t fffs_compact(fffs_volume_t *fffs_vol, uint32_t min_dead_percent, uint32_t *moved);
+
+/**
+ * Drops every message below message_id by raising the low-water mark, which is persisted with the sector table
+ * of the write head. The data blocks left without a message are discarded with the erase command of the device
+ * rather than rewritten, and the messages in the block holding message_id are wiped in place. Reads of dropped
+ * messages then return ESP_ERR_NOT_FOUND, and cursors and scans skip them.
+ */
+esp_err_t fffs_truncate_before(fffs_volume_t *fffs_vol, uint32_t message_id);
+
+/**
+ * Drops the messages from from up to to, excluded, the same way. A range starting at or below the oldest message
+ * raises the low-water mark. Otherwise up to FFFS_ERASED_RANGES ranges are kept, and ESP_ERR_NO_MEM is returned
+ * when a new one cannot be merged with them. Key lookups stop at an erased message.
+ */
+esp_err_t fffs_erase_range(fffs_volume_t *fffs_vol, uint32_t from, uint32_t to);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,92 @@
+#pragma once
+#ifndef _FFFS_BDEV_H_
+#define _FFFS_BDEV_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+typedef struct fffs_bdev fffs_bdev_t;
+
+/**
+ * Block device used by a FFFS volume. All block numbers and counts are expressed in
+ * blocks of block_size bytes. Buffers handed to read/write must be suitable for DMA
+ * on the target (the volume allocates them with MALLOC_CAP_DMA).
+ */
+struct fffs_bdev
+{
+    esp_err_t (*read)(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count);
+    esp_err_t (*write)(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count);
+    esp_err_t (*erase)(fffs_bdev_t *bdev, size_t start_block, size_t block_count); //<Erased blocks read back as zeros
+    esp_err_t (*flush)(fffs_bdev_t *bdev);
+    esp_err_t (*deinit)(fffs_bdev_t *bdev); //<Releases the backend and the fffs_bdev_t itself
+    esp_err_t (*write_start)(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count); //<Optional. Returns once the write is under way, src is left alone until write_wait
+    esp_err_t (*write_wait)(fffs_bdev_t *bdev); //<Optional with write_start. Waits for the write started last and returns its result
+    uint32_t capacity;                      //<Number of blocks on the device
+    uint32_t block_size;                    //<Size of a block in bytes
+    void *ctx;                              //<Backend private data
+};
+
+static inline esp_err_t fffs_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    return bdev->read(bdev, dst, start_block, block_count);
+}
+
+static inline esp_err_t fffs_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    return bdev->write(bdev, src, start_block, block_count);
+}
+
+/**
+ * Starts a write the volume goes on working alongside, see write_start. Devices without it write at once. A
+ * device with write_start carries out later writes, erases and flushes after the write under way.
+ */
+static inline esp_err_t fffs_bdev_write_start(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    return bdev->write_start == NULL ? bdev->write(bdev, src, start_block, block_count) : bdev->write_start(bdev, src, start_block, block_count);
+}
+
+static inline esp_err_t fffs_bdev_write_wait(fffs_bdev_t *bdev)
+{
+    return bdev->write_wait == NULL ? ESP_OK : bdev->write_wait(bdev);
+}
+
+static inline esp_err_t fffs_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    return bdev->erase(bdev, start_block, block_count);
+}
+
+static inline esp_err_t fffs_bdev_flush(fffs_bdev_t *bdev)
+{
+    return bdev->flush == NULL ? ESP_OK : bdev->flush(bdev);
+}
+
+static inline esp_err_t fffs_bdev_delete(fffs_bdev_t *bdev)
+{
+    if (bdev == NULL || bdev->deinit == NULL)
+        return ESP_OK;
+    return bdev->deinit(bdev);
+}
+
+#define FFFS_STRIPE_MAX 4 //<Members of a striped device
+
+/**
+ * Device spreading its blocks round-robin over count members, stripe_blocks at a time, so that a volume mounted on
+ * it keeps one id space over several cards. A multi-block write is split into one write per stripe unit, started
+ * on every member before any is waited for, so members with write_start, such as those of
+ * fffs_rt_bdev_async_create, write side by side. The capacity is count times that of the smallest member, rounded
+ * down to whole units. The members must be passed in the same order on every mount, and are deleted with the
+ * striped device.
+ */
+fffs_bdev_t *fffs_bdev_stripe_create(fffs_bdev_t *const *members, size_t count, uint32_t stripe_blocks);
+
+#if defined(__linux__)
+/**
+ * Host block device backed by a memory mapped image file. If the file is smaller than
+ * capacity blocks it is extended, a capacity of 0 uses the current size of the file.
+ */
+fffs_bdev_t *fffs_bdev_file_open(const char *path, size_t capacity);
+#endif
+
+#endif
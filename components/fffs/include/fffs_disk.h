@@ -6,6 +6,41 @@
 #include "driver/sdmmc_host.h"
 #include "driver/sdspi_host.h"
 
+#include "fffs_bdev.h"
+
+typedef enum
+{
+    SD_CARD_SPI,   //<Card on an SPI bus, through the SDSPI driver
+    SD_CARD_SDMMC, //<Card in a slot of the SDMMC host
+} sd_card_bus_t;
+
+/**
+ * Where a card sits. Each card needs a host of its own: another SPI host, or the other SDMMC slot.
+ */
+typedef struct sd_card_config
+{
+    sd_card_bus_t bus;
+    int slot;      //<SPI host (HSPI_HOST, VSPI_HOST) for SD_CARD_SPI, SDMMC slot (0, 1) for SD_CARD_SDMMC
+    int pin_miso;  //<SD_CARD_SPI only
+    int pin_mosi;  //<SD_CARD_SPI only
+    int pin_clk;   //<SD_CARD_SPI only
+    int pin_cs;    //<SD_CARD_SPI only
+    uint8_t width; //<Data lines for SD_CARD_SDMMC, 1 or 4
+} sd_card_config_t;
+
+#define SD_CARD_CONFIG_DEFAULT() \
+    {                            \
+        .bus = SD_CARD_SPI,      \
+        .slot = HSPI_HOST,       \
+        .pin_miso = 19,          \
+        .pin_mosi = 23,          \
+        .pin_clk = 18,           \
+        .pin_cs = 4,             \
+        .width = 1,              \
+    }
+
 sdmmc_card_t *sd_card_init();
+sdmmc_card_t *sd_card_init_with_config(const sd_card_config_t *config);
 esp_err_t sd_card_deinit(sdmmc_card_t *s_card);
+fffs_bdev_t *sd_card_bdev_create(sdmmc_card_t *s_card);
 #endif
\ No newline at end of file
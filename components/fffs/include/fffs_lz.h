@@ -0,0 +1,30 @@
+#pragma once
+#ifndef _FFFS_LZ_H_
+#define _FFFS_LZ_H_
+
+#include <stdint.h>
+
+/*
+ * LZ77 codec in the LZ4 block format, working on a window that holds the raw content written before the
+ * message. Matches may reach back into that content, so a message is only decoded after everything before it.
+ */
+
+#define FFFS_LZ_HASH_BITS 10
+#define FFFS_LZ_HASH_SIZE (1 << FFFS_LZ_HASH_BITS) //<Entries of the match table, uint16_t each
+#define FFFS_LZ_EMPTY 0xFFFF
+
+void fffs_lz_reset(uint16_t *table);
+
+/**
+ * Compresses window[start, end) to out, matching against window[0, end). Positions from *hashed up to the
+ * message are added to table first. Returns the compressed size, 0 if it would be more than cap bytes.
+ */
+int fffs_lz_compress(const uint8_t *window, int start, int end, uint16_t *table, int *hashed, uint8_t *out, int cap);
+
+/**
+ * Decodes len bytes of src to window at pos, never writing at or past cap. Returns the new end of the window,
+ * -1 if src is damaged.
+ */
+int fffs_lz_decompress(const uint8_t *src, int len, uint8_t *window, int pos, int cap);
+
+#endif
@@ -1,19 +1,154 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
+
+#include <stdatomic.h>
+
 #include "fffs.h"
+#include "fffs_bdev.h"
 #include "esp_err.h"
 #include "esp_log.h"
 
+typedef enum
+{
+    FFFS_OVERFLOW_BLOCK,       //<The producer waits for the writer task to make room
+    FFFS_OVERFLOW_DROP_OLDEST, //<The oldest queued message is dropped. Its id is kept by an empty message
+    FFFS_OVERFLOW_DROP_NEWEST, //<The new message is refused
+} fffs_overflow_policy_t;
+
+typedef struct fffs_rt_async_config
+{
+    uint32_t slots;                //<Messages the ring can hold, rounded up to a power of two
+    uint32_t slot_size;            //<Largest message accepted, at most the message_max of the volume
+    uint32_t batch;                //<Messages handed to fffs_write_batch at a time by the writer task
+    fffs_overflow_policy_t policy; //<What a producer does when the ring is full
+    UBaseType_t priority;          //<Priority of the writer task
+    uint32_t stack_size;           //<Stack of the writer task
+} fffs_rt_async_config_t;
+
+#define FFFS_RT_ASYNC_CONFIG_DEFAULT()         \
+    {                                          \
+        .slots = 64,                           \
+        .slot_size = 128,                      \
+        .batch = 32,                           \
+        .policy = FFFS_OVERFLOW_BLOCK,         \
+        .priority = 5,                         \
+        .stack_size = 4096,                    \
+    }
+
+typedef struct fffs_rt_async_stats
+{
+    uint32_t queued;         //<Messages accepted by fffs_rt_write_async
+    uint32_t written;        //<Messages written by the writer task, including empty ones standing in for dropped messages
+    uint32_t dropped_oldest; //<Queued messages dropped to make room (FFFS_OVERFLOW_DROP_OLDEST)
+    uint32_t dropped_newest; //<Messages refused because the ring was full (FFFS_OVERFLOW_DROP_NEWEST)
+    uint32_t blocked;        //<Calls that had to wait for room (FFFS_OVERFLOW_BLOCK)
+    uint32_t failed;         //<Messages the writer task could not write
+} fffs_rt_async_stats_t;
+
+typedef struct fffs_rt_compact_config
+{
+    uint32_t interval_ms;      //<Time between two rounds of the compaction task
+    uint32_t min_dead_percent; //<Share of a sector erased or replaced before it is compacted, see fffs_compact
+    UBaseType_t priority;      //<Priority of the compaction task, best kept below that of the writers
+    uint32_t stack_size;       //<Stack of the compaction task
+} fffs_rt_compact_config_t;
+
+#define FFFS_RT_COMPACT_CONFIG_DEFAULT() \
+    {                                    \
+        .interval_ms = 10000,            \
+        .min_dead_percent = 25,          \
+        .priority = 2,                   \
+        .stack_size = 4096,              \
+    }
+
+typedef struct fffs_rt_async fffs_rt_async_t;
+typedef struct fffs_rt_subscription fffs_rt_subscription_t;
+typedef struct fffs_rt_compact fffs_rt_compact_t;
+
 typedef struct fffs_head
 {
     fffs_volume_t *vol;
-    SemaphoreHandle_t xSemaphore;
+    SemaphoreHandle_t xSemaphore;      //<Serialises writers
+    SemaphoreHandle_t xStateSemaphore; //<Installed as the volume lock, see fffs_reader_read
+    fffs_rt_async_t *async;            //<Ring and writer task while asynchronous mode is running
+    atomic_uint async_users;           //<Callers using the ring, with a high bit set while it is being stopped
+    fffs_rt_subscription_t *subscriptions; //<Signalled after every write, guarded by xSemaphore
+    fffs_rt_compact_t *compact;        //<Compaction task while it is running
 } fffs_head_t;
 
 
 fffs_head_t *fffs_rt_Init(fffs_volume_t *vol);
 
 uint16_t fffs_rt_read_binary(fffs_head_t *fffs_head, uint32_t message_num, uint8_t *message);
+
+/**
+ * Reads a message into caller storage with one call, see fffs_read_into. Nothing is allocated.
+ */
+esp_err_t fffs_rt_read_into(fffs_head_t *fffs_head, uint32_t message_num, void *buf, size_t cap, int *size);
 esp_err_t fffs_rt_write_binary(fffs_head_t *fffs_head, uint8_t *message, int message_length);
+esp_err_t fffs_rt_write_batch(fffs_head_t *fffs_head, const fffs_message_t *messages, size_t count, uint32_t *first_id);
+esp_err_t fffs_rt_write_key(fffs_head_t *fffs_head, uint8_t *message, int message_length, uint64_t key);
 esp_err_t fffs_rt_erase(fffs_head_t *fffs_head, int message_num);
-esp_err_t fffs_rt_update(fffs_head_t *fffs_head, int message_num, uint8_t *new_message);
\ No newline at end of file
+esp_err_t fffs_rt_update(fffs_head_t *fffs_head, int message_num, uint8_t *new_message);
+
+/**
+ * Replaces a message with content of any size, see fffs_replace. Refused while asynchronous mode is running, as
+ * the copy takes an id of its own.
+ */
+esp_err_t fffs_rt_replace(fffs_head_t *fffs_head, uint32_t message_num, const void *message, int size);
+
+/**
+ * Retention, see fffs_erase_range and fffs_truncate_before. Returns their error codes.
+ */
+esp_err_t fffs_rt_erase_range(fffs_head_t *fffs_head, uint32_t from, uint32_t to);
+esp_err_t fffs_rt_truncate_before(fffs_head_t *fffs_head, uint32_t message_id);
+esp_err_t fffs_rt_flush(fffs_head_t *fffs_head);
+
+/**
+ * Starts asynchronous mode: fffs_rt_write_async copies messages into a lock-free ring and a writer task drains
+ * it with fffs_write_batch. While it runs, the synchronous write functions are refused so that the ids handed
+ * out by fffs_rt_write_async stay valid. fffs_rt_flush waits for the ring to drain. fffs_rt_async_stop refuses
+ * new calls to fffs_rt_write_async, waits for those under way to return and writes out what they queued before
+ * it frees the ring, so producers may still be running when it is called.
+ */
+esp_err_t fffs_rt_async_start(fffs_head_t *fffs_head, const fffs_rt_async_config_t *config);
+esp_err_t fffs_rt_async_stop(fffs_head_t *fffs_head);
+
+/**
+ * Queues a message without touching the card and returns the id it will be stored under. Returns
+ * ESP_ERR_NO_MEM if the ring is full and the policy is FFFS_OVERFLOW_DROP_NEWEST. When the writer task cannot
+ * write a batch, the ids it did not take are filled with empty messages. Should the volume refuse those as well,
+ * the queued messages are counted as failed and ESP_ERR_INVALID_STATE is returned until asynchronous mode is
+ * stopped, rather than hand out ids that would point at other messages.
+ */
+esp_err_t fffs_rt_write_async(fffs_head_t *fffs_head, const void *message, int message_length, uint32_t *message_id);
+esp_err_t fffs_rt_async_get_stats(fffs_head_t *fffs_head, fffs_rt_async_stats_t *stats);
+
+/**
+ * Starts a task that calls fffs_compact every interval_ms with xSemaphore held, so that writers wait for the
+ * sector being compacted rather than race its copies. Rounds are skipped while asynchronous mode is running.
+ */
+esp_err_t fffs_rt_compact_start(fffs_head_t *fffs_head, const fffs_rt_compact_config_t *config);
+esp_err_t fffs_rt_compact_stop(fffs_head_t *fffs_head);
+
+/**
+ * Follows the log from message from_id on, including the messages written after the call. Every write through
+ * the head, synchronous or by the writer task, wakes the subscriptions as soon as its messages can be read.
+ */
+fffs_rt_subscription_t *fffs_rt_subscribe(fffs_head_t *fffs_head, uint32_t from_id);
+
+/**
+ * Copies the next message as fffs_cursor_next does. Once the subscription has caught up with the writer it blocks
+ * for up to wait ticks until more is written, and returns ESP_ERR_TIMEOUT if nothing was.
+ */
+esp_err_t fffs_rt_subscription_next(fffs_rt_subscription_t *subscription, uint8_t *message, int *size, uint32_t *message_id, TickType_t wait);
+esp_err_t fffs_rt_unsubscribe(fffs_rt_subscription_t *subscription);
+
+/**
+ * Wraps bdev in a device whose write_start hands the write to a task of its own and returns. A volume mounted on
+ * it fills its next blocks while the previous ones are written, see fffs_send. Reads, writes, erases and flushes
+ * wait for the write under way first, so bdev never sees two commands at once. Deleting the device deletes bdev as
+ * well.
+ */
+fffs_bdev_t *fffs_rt_bdev_async_create(fffs_bdev_t *bdev, UBaseType_t priority, uint32_t stack_size);
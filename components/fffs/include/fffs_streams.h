@@ -0,0 +1,76 @@
+#pragma once
+#ifndef _FFFS_STREAMS_H_
+#define _FFFS_STREAMS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "esp_err.h"
+#include "fffs.h"
+#include "fffs_bdev.h"
+
+#define FFFS_STREAMS_MAGIC 0xFFFFFFFE5354524DULL //<Magic number of a stream directory
+#define FFFS_STREAM_NAME 16                      //<Bytes of a stream name, including the terminating 0
+
+/**
+ * Extent of the card given to a stream. An entry with an empty name is a free extent left by a deleted stream.
+ */
+typedef struct fffs_stream_entry
+{
+    char name[FFFS_STREAM_NAME];
+    uint32_t start;  //<First block of the extent, a multiple of SECTOR_SIZE
+    uint32_t blocks; //<Blocks of the extent, a multiple of SECTOR_SIZE
+} fffs_stream_entry_t;
+
+#define FFFS_STREAMS_MAX ((SD_BLOCK_SIZE - sizeof(uint64_t) - 2 * sizeof(uint32_t)) / sizeof(fffs_stream_entry_t)) //<Entries of a stream directory
+
+/**
+ * Block 0 of a card holding streams. The first sector is kept for it and the streams are carved out of the blocks
+ * after it, each as a volume of its own.
+ */
+typedef struct fffs_stream_directory
+{
+    uint64_t magic_number;
+    uint32_t count;     //<Entries in use, free extents included
+    uint32_t next_free; //<First block not given to any stream yet
+    fffs_stream_entry_t entries[FFFS_STREAMS_MAX];
+} fffs_stream_directory_t;
+
+typedef struct fffs_streams
+{
+    fffs_bdev_t *bdev;
+    fffs_stream_directory_t *directory;       //<DMA copy of block 0
+    fffs_volume_t *volumes[FFFS_STREAMS_MAX]; //<Open streams, by directory entry
+    fffs_bdev_t *slices[FFFS_STREAMS_MAX];    //<Devices mapping the extent of each open stream
+} fffs_streams_t;
+
+/**
+ * Reads the stream directory of bdev. With format set, a card without one gets an empty directory, which makes
+ * whatever was on the card unreachable. Streams are opened and deleted from one task, each open stream being a
+ * volume with its own lock.
+ */
+fffs_streams_t *fffs_streams_open(fffs_bdev_t *bdev, bool format);
+
+/**
+ * Closes every open stream and frees streams. bdev is left open.
+ */
+esp_err_t fffs_streams_close(fffs_streams_t *streams);
+
+/**
+ * Opens stream name as a volume of its own: its tail block, message ids, sector chain, key index and forwarding
+ * table never touch the blocks of another stream. A stream missing from the directory is created with blocks,
+ * rounded up to whole sectors, taken from a free extent or from the blocks not given out yet, and formatted with
+ * config, which may be NULL for FFFS_CONFIG_DEFAULT. blocks 0 only opens an existing stream. An existing stream is
+ * never formatted: if it cannot be mounted, NULL is returned and its blocks are left as they are. The volume is
+ * closed by fffs_stream_delete or fffs_streams_close, never by fffs_deinit.
+ */
+fffs_volume_t *fffs_stream_open(fffs_streams_t *streams, const char *name, uint32_t blocks, const fffs_config_t *config);
+
+/**
+ * Closes stream name if open and returns its extent to the pool. The extent is discarded with the erase command
+ * of the device, so that a stream created in it later starts empty. If the erase fails its error is returned and
+ * the stream is kept in the directory, closed, with whatever its extent still holds.
+ */
+esp_err_t fffs_stream_delete(fffs_streams_t *streams, const char *name);
+
+#endif
@@ -7,18 +7,19 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "esp_err.h"
 #include "esp_log.h"
-
-#include "driver/sdmmc_host.h"
-#include "driver/sdspi_host.h"
-#include "sdmmc_cmd.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 
 #include "fffs.h"
+#include "fffs_bdev.h"
+#include "fffs_lz.h"
 #include "fffs_utils.h"
-#include "fffs_disk.h"
 
 #define FFFS_CHECK(a, str, goto_tag, ...)                                         \
     do                                                                            \
@@ -32,34 +33,79 @@
 
 static const char *TAG = "FFFS";
 
-static esp_err_t fffs_erase_block(fffs_volume_t *fffs_volume, size_t block, size_t num)
+_Static_assert(sizeof(fffs_sector_table_t) <= SD_BLOCK_SIZE, "A sector table must fit in one block");
+
+static inline void fffs_lock(fffs_volume_t *fffs_vol)
 {
-    FFFS_CHECK(fffs_volume, "Volume is Null.", err);
+    if (fffs_vol->lock.take != NULL)
+        fffs_vol->lock.take(fffs_vol->lock.ctx);
+}
 
-    for (int i = 0; i < SD_BLOCK_SIZE; i++)
-        *((char *)fffs_volume->read_buf + i) = 0;
+static inline void fffs_unlock(fffs_volume_t *fffs_vol)
+{
+    if (fffs_vol->lock.give != NULL)
+        fffs_vol->lock.give(fffs_vol->lock.ctx);
+}
 
-    for (; num > 0; num--)
-    {
-        if (num % 100 == 0)
-            printf(".");
+static void fffs_index_reset(fffs_volume_t *fffs_vol);
+static void fffs_index_set(fffs_volume_t *fffs_vol, uint32_t sector, uint32_t first_message);
+static void fffs_key_reset(fffs_volume_t *fffs_vol);
+static void fffs_key_delete(fffs_volume_t *fffs_vol);
+static esp_err_t fffs_key_flush(fffs_volume_t *fffs_vol);
+static esp_err_t fffs_forward_load(fffs_volume_t *fffs_vol);
+static void fffs_forward_delete(fffs_volume_t *fffs_vol);
+static esp_err_t fffs_message_at(fffs_volume_t *fffs_vol, uint32_t message_num, uint32_t *block, uint32_t *k, uint8_t **buf);
+static esp_err_t fffs_locate(fffs_volume_t *fffs_vol, uint32_t message_num, uint32_t *block, uint32_t *first_message);
+static fffs_sector_table_t *fffs_index_table(fffs_volume_t *fffs_vol, uint32_t sector);
+
+static void fffs_summary_reset(fffs_sector_summary_t *summary)
+{
+    memset(summary, 0, sizeof(fffs_sector_summary_t));
+    summary->value_min = INT32_MAX;
+    summary->value_max = INT32_MIN;
+}
 
-        fflush(stdout);
-        sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, block++, 1);
+/*
+ * Bit i of the FFFS_FILTER_HASHES bits key sets in a Bloom filter, by double hashing one mixed value.
+ */
+static inline uint32_t fffs_filter_bit(uint32_t key, int i)
+{
+    key ^= key >> 16;
+    key *= 0x85EBCA6B;
+    key ^= key >> 13;
+    key *= 0xC2B2AE35;
+    key ^= key >> 16;
+
+    return (key + i * ((key >> 16) | 1)) % FFFS_FILTER_BITS;
+}
+
+static void fffs_filter_add(uint8_t *filter, uint32_t key)
+{
+    for (int i = 0; i < FFFS_FILTER_HASHES; i++)
+    {
+        uint32_t bit = fffs_filter_bit(key, i);
+        filter[bit / 8] |= 1 << (bit % 8);
     }
+}
 
-    return ESP_OK;
+static bool fffs_filter_test(const uint8_t *filter, uint32_t key)
+{
+    for (int i = 0; i < FFFS_FILTER_HASHES; i++)
+    {
+        uint32_t bit = fffs_filter_bit(key, i);
+        if ((filter[bit / 8] & (1 << (bit % 8))) == 0)
+            return false;
+    }
 
-err:
-    return ESP_FAIL;
+    return true;
 }
 
 static esp_err_t fffs_update_partition_block(fffs_volume_t *fffs_volume)
 {
     ESP_LOGI(TAG, "Current partition %d", fffs_volume->current_partition);
-    FFFS_CHECK(sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_partition * (fffs_volume->partition_size * PARTITION_SIZE), 1), "Cannot read partition ", fail);
+    FFFS_CHECK(fffs_bdev_read(fffs_volume->bdev, fffs_volume->read_buf, fffs_volume->current_partition * (fffs_volume->partition_size * PARTITION_SIZE), 1) == ESP_OK, "Cannot read partition ", fail);
     (((fffs_partition_table_t *)fffs_volume->read_buf)->jump_to_next_partition) = true; //This is always TRUE except when formatting the SD card
-    FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_partition * (fffs_volume->partition_size * PARTITION_SIZE), 1), "Cannot write partition", fail);
+    FFFS_CHECK(fffs_bdev_write(fffs_volume->bdev, fffs_volume->read_buf, fffs_volume->current_partition * (fffs_volume->partition_size * PARTITION_SIZE), 1) == ESP_OK, "Cannot write partition", fail);
     fffs_volume->current_partition++;
     return ESP_OK;
 
@@ -67,35 +113,130 @@ fail:
     return ESP_FAIL;
 }
 
+static esp_err_t fffs_checkpoint(fffs_volume_t *fffs_volume)
+{
+    FFFS_CHECK(fffs_bdev_write(fffs_volume->bdev, fffs_volume->sector_table, fffs_volume->current_sector, 1) == ESP_OK, "Cannot write sector ", fail);
+    fffs_volume->table_dirty = false;
+    fffs_volume->checkpoint_block = fffs_volume->last_block;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Records current_sector as the write head in the boot block. Mount starts from there and only has to walk
+ * the sectors opened since, so a stale or lost pointer costs a few reads rather than a wrong mount.
+ */
+static esp_err_t fffs_update_head(fffs_volume_t *fffs_volume)
+{
+    fffs_sector_table_t *boot = fffs_volume->read_buf;
+
+    FFFS_CHECK(fffs_bdev_read(fffs_volume->bdev, boot, 0, 1) == ESP_OK, "Cannot read boot partition", fail);
+    boot->head_sector = fffs_volume->current_sector;
+    FFFS_CHECK(fffs_bdev_write(fffs_volume->bdev, boot, 0, 1) == ESP_OK, "Cannot write boot partition", fail);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Sectors follow each other up to the last one with room for a data block, after which a ring wraps around to
+ * sector 0.
+ */
+static inline uint32_t fffs_next_sector(const fffs_volume_t *fffs_vol, uint32_t sector)
+{
+    return sector + (SECTOR_SIZE) + 1 < fffs_vol->data_blocks ? sector + (SECTOR_SIZE) : 0;
+}
+
+static inline uint32_t fffs_sector_count(const fffs_volume_t *fffs_vol)
+{
+    return (fffs_vol->data_blocks - 2) / (SECTOR_SIZE) + 1;
+}
+
+/*
+ * Sets oldest_sector and oldest_message_id from the write head. Until the ring has wrapped the log starts in
+ * sector 0. After that the sector being written has lost its earlier messages whole, so the oldest ones left are
+ * in the next sector, from the lap before. The low-water mark of the current sector table can only raise it.
+ */
+static esp_err_t fffs_oldest_update(fffs_volume_t *fffs_vol)
+{
+    fffs_sector_table_t *table;
+    uint32_t sector = fffs_next_sector(fffs_vol, fffs_vol->current_sector);
+
+    fffs_vol->oldest_sector = 0;
+    fffs_vol->oldest_message_id = 0;
+    if (fffs_vol->epoch > 0)
+    {
+        table = fffs_index_table(fffs_vol, sector);
+        FFFS_CHECK(table, "Cannot read sector %d", fail, sector);
+
+        fffs_vol->oldest_sector = sector;
+        fffs_vol->oldest_message_id = table->first_message;
+    }
+
+    if (fffs_vol->oldest_message_id < fffs_vol->sector_table->low_water)
+        fffs_vol->oldest_message_id = fffs_vol->sector_table->low_water;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
 static esp_err_t fffs_create_sector_block(fffs_volume_t *fffs_volume)
 {
+    fffs_sector_table_t *new_table = fffs_volume->read_buf;
 
-    /* Update the old sector before creating a new one */
+    /* The new sector header is written before the old one is closed so that a mount never jumps to a sector that does not exist */
+
+    memcpy(new_table, fffs_volume->sector_table, SD_BLOCK_SIZE);
+    new_table->partition_sector_table.jump_to_next_sector = false;
+    new_table->partition_sector_table.partition_id = fffs_volume->current_partition;
+    new_table->partition_sector_table.magic_number = FFFS_MAGIC_NUMBER;
+    new_table->partition_sector_table.last_block = fffs_volume->last_block + 1;
+    new_table->partition_sector_table.message_id = fffs_volume->message_id;
+    new_table->first_message = fffs_volume->message_id;
+    for (int i = 0; i < ((SECTOR_SIZE) / (BLOCKS_IN_SECTOR)); i++)
+    {
+        new_table->sector_message_index[i] = 0;
+    }
+    memset(new_table->compressed_blocks, 0, sizeof(new_table->compressed_blocks));
+    new_table->first_time = fffs_volume->last_time;
+    new_table->last_time = fffs_volume->last_time;
+    new_table->head_sector = fffs_volume->last_block; //Only read from the boot block, which a ring rewrites when it wraps
+    new_table->epoch = fffs_volume->epoch;
+    fffs_summary_reset(&new_table->summary);
 
-    FFFS_CHECK(sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_sector, 1) == ESP_OK, "Cannot read sector ", fail);
+    FFFS_CHECK(fffs_bdev_write(fffs_volume->bdev, new_table, fffs_volume->last_block, 1) == ESP_OK, "Cannot write sector", fail);
 
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->jump_to_next_sector) = true; //This is always TRUE except when formatting the SD card
+    /* Close the old sector */
 
-    FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_sector, 1) == ESP_OK, "Cannot write sector ", fail);
+    fffs_volume->sector_table->partition_sector_table.jump_to_next_sector = true; //This is always TRUE except when formatting the SD card
+    FFFS_CHECK(fffs_checkpoint(fffs_volume) == ESP_OK, "Cannot write sector ", fail);
 
     /* Now we move to the new sector */
 
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->jump_to_next_sector) = false;
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->partition_id) = fffs_volume->current_partition;
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->magic_number) = FFFS_MAGIC_NUMBER;
-    (((fffs_sector_table_t *)fffs_volume->read_buf)->first_message) = fffs_volume->message_id;
-
+    memcpy(fffs_volume->sector_table, new_table, SD_BLOCK_SIZE);
     fffs_volume->current_sector = fffs_volume->last_block;
+    fffs_index_set(fffs_volume, fffs_volume->current_sector, fffs_volume->message_id);
     fffs_volume->messages_in_block = 0;
     fffs_volume->block_index = 0;
-    for (int i = 0; i < ((SECTOR_SIZE) / (BLOCKS_IN_SECTOR)); i++)
+
+    for (uint32_t i = 0; i < fffs_volume->config.index_cache_sectors; i++)
     {
-        ((fffs_sector_table_t *)fffs_volume->read_buf)->sector_message_index[i] = 0;
+        if (fffs_volume->index_cache[i].sector == fffs_volume->current_sector) //Cached from the lap before
+            fffs_volume->index_cache[i].sector = UINT32_MAX;
     }
+    for (int i = 0; i < FFFS_COMPACT_HINTS; i++)
+    {
+        if (fffs_volume->compact_hints[i].sector == fffs_volume->current_sector)
+            fffs_volume->compact_hints[i].dead = 0;
+    }
+    FFFS_CHECK(fffs_oldest_update(fffs_volume) == ESP_OK, "Cannot find the oldest messages", fail);
 
-    FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_sector, 1) == ESP_OK, "Cannot write sector", fail);
-
-    /* Update the old sector before creating a new one */
+    if ((fffs_volume->current_sector / (fffs_volume->sector_size * (SECTOR_SIZE))) % fffs_volume->config.head_sectors == 0)
+        fffs_update_head(fffs_volume); //Only speeds up the next mount
 
     return ESP_OK;
 
@@ -103,402 +244,2940 @@ fail:
     return ESP_FAIL;
 }
 
+/*
+ * Only the partition headers are written. Every other sector is initialised when the writer reaches it by
+ * fffs_create_sector_block, and data blocks need no erasing as they carry their own stamps.
+ */
 esp_err_t fffs_format(fffs_volume_t *fffs_volume, unsigned char partition_size, unsigned char sector_size, bool message_rotate)
 {
     esp_err_t err = ESP_FAIL;
-    fffs_sector_table_t *sector_table = calloc(1, sizeof(fffs_sector_table_t)); //Declared in this way to ensure the entire sector table is initalized
+    fffs_sector_table_t *sector_table = fffs_volume->sector_table; //Built in place, it is read back from the card at the end
+    uint32_t volume_id = (uint32_t)esp_timer_get_time();
 
+    fffs_bdev_write_wait(fffs_volume->bdev); //A write under way belongs to the volume being replaced
+    fffs_volume->sent_count = 0;
+
+    if (fffs_bdev_read(fffs_volume->bdev, fffs_volume->read_buf, 0, 1) == ESP_OK && ((fffs_partition_table_t *)fffs_volume->read_buf)->magic_number == FFFS_MAGIC_NUMBER)
+        volume_id = ((fffs_sector_table_t *)fffs_volume->read_buf)->volume_id + 1;
+    if (volume_id == 0) //Never matches a zeroed block
+        volume_id = 1;
+
+    memset(sector_table, 0, SD_BLOCK_SIZE);
     ((fffs_partition_table_t *)sector_table)->jump_to_next_partition = false;
     ((fffs_partition_table_t *)sector_table)->jump_to_next_sector = false;
     ((fffs_partition_table_t *)sector_table)->card_full = false;
-    ((fffs_partition_table_t *)sector_table)->message_rotate = false;
+    ((fffs_partition_table_t *)sector_table)->message_rotate = message_rotate;
     ((fffs_partition_table_t *)sector_table)->last_block = 1;
     ((fffs_partition_table_t *)sector_table)->sector_size = sector_size == 0 ? 1 : sector_size;
     ((fffs_partition_table_t *)sector_table)->magic_number = FFFS_MAGIC_NUMBER;
     ((fffs_partition_table_t *)sector_table)->partition_size = partition_size == 0 ? 1 : partition_size;
     ((fffs_partition_table_t *)sector_table)->partition_id = 0;
-
-    for (uint64_t i = 0; i < fffs_volume->sd_card->csd.capacity; i = i + (partition_size * (PARTITION_SIZE)))
+    sector_table->volume_id = volume_id;
+    fffs_summary_reset(&sector_table->summary);
+
+    fffs_volume->key_blocks = fffs_volume->config.key_index_blocks;
+    if (fffs_volume->key_blocks > fffs_volume->bdev->capacity / 2)
+        fffs_volume->key_blocks = fffs_volume->bdev->capacity / 2;
+    fffs_volume->forward_blocks = fffs_volume->config.forward_blocks;
+    if (fffs_volume->forward_blocks > fffs_volume->bdev->capacity / 4)
+        fffs_volume->forward_blocks = fffs_volume->bdev->capacity / 4;
+    fffs_volume->data_blocks = fffs_volume->bdev->capacity - fffs_volume->key_blocks - fffs_volume->forward_blocks;
+    sector_table->key_blocks = fffs_volume->key_blocks;
+    sector_table->forward_blocks = fffs_volume->forward_blocks;
+    fffs_key_reset(fffs_volume);
+
+    for (uint64_t i = 0; i < fffs_volume->data_blocks; i = i + (partition_size * (PARTITION_SIZE)))
     {
-        fffs_erase_block(fffs_volume, i, sector_size * (SECTOR_SIZE));
         ESP_LOGI(TAG, "Creating Partition: %d at block number %d", ((fffs_partition_table_t *)sector_table)->partition_id, (uint32_t)i);
 
-        memcpy(fffs_volume->read_buf, sector_table, sizeof(fffs_sector_table_t));
-        FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, i, 1) == ESP_OK, "Cannot format sector", fail);
+        FFFS_CHECK(fffs_bdev_write(fffs_volume->bdev, sector_table, i, 1) == ESP_OK, "Cannot format sector", fail);
 
         ((fffs_partition_table_t *)sector_table)->partition_id++;
     }
 
     ESP_LOGI(TAG, "Created %d Partitions of size %d bytes.", ((fffs_partition_table_t *)sector_table)->partition_id, partition_size * (PARTITION_SIZE)*512);
+    fffs_volume->partition_size = ((fffs_partition_table_t *)sector_table)->partition_size;
+    fffs_volume->sector_size = ((fffs_partition_table_t *)sector_table)->sector_size;
+    fffs_volume->current_partition = 0;
     fffs_volume->last_block = 1;
     fffs_volume->current_block = 1;
     fffs_volume->current_sector = 0;
+    fffs_volume->message_id = 0;
+    fffs_volume->last_time = 0;
+    fffs_volume->volume_id = volume_id;
+    fffs_volume->block_index = 0;
+    fffs_volume->messages_in_block = 0;
+    fffs_volume->checkpoint_block = 1;
+    fffs_volume->table_dirty = false;
+    fffs_volume->message_rotate = message_rotate;
+    fffs_volume->epoch = 0;
+    fffs_volume->oldest_sector = 0;
+    fffs_volume->oldest_message_id = 0;
+    fffs_index_reset(fffs_volume);
+    FFFS_CHECK(fffs_forward_load(fffs_volume) == ESP_OK, "Cannot create forwarding table", fail);
+    FFFS_CHECK(fffs_bdev_read(fffs_volume->bdev, fffs_volume->sector_table, 0, 1) == ESP_OK, "Cannot read boot partition", fail);
     err = ESP_OK;
 
 fail:
-    free(sector_table);
     return err;
 }
 
-static uint32_t fffs_find_lastBlock(fffs_volume_t *fffs_vol)
+static inline uint16_t fffs_message_end(const uint8_t *block, uint32_t k)
 {
-    fffs_vol->last_block = 0;
+    return ((const uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] & ~FFFS_MESSAGE_FLAGS;
+}
 
-    FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, 0, 1) == ESP_OK, "Cannot read partition.", fail);
+static inline bool fffs_message_compressed(const uint8_t *block, uint32_t k)
+{
+    return (((const uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] & FFFS_MESSAGE_COMPRESSED) != 0;
+}
 
-    if ((((fffs_partition_table_t *)fffs_vol->read_buf)->magic_number) == FFFS_MAGIC_NUMBER)
-    {
-        ESP_LOGI(TAG, "FFS: Found Boot Partition.");
+static inline bool fffs_message_keyed(const uint8_t *block, uint32_t k)
+{
+    return (((const uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] & FFFS_MESSAGE_KEYED) != 0;
+}
 
-        fffs_vol->partition_size = ((fffs_partition_table_t *)fffs_vol->read_buf)->partition_size == 0 ? 1 : ((fffs_partition_table_t *)fffs_vol->read_buf)->partition_size;
-        fffs_vol->sector_size = ((fffs_partition_table_t *)fffs_vol->read_buf)->sector_size == 0 ? 1 : ((fffs_partition_table_t *)fffs_vol->read_buf)->sector_size;
+static inline bool fffs_message_erased(const uint8_t *block, uint32_t k)
+{
+    return (((const uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] & FFFS_MESSAGE_ERASED) != 0;
+}
 
-        if ((((fffs_partition_table_t *)fffs_vol->read_buf)->card_full) == true)
-        {
-            ESP_LOGE(TAG, "SD Card is full!");
-            goto fail;
-        }
+static inline bool fffs_message_copied(const uint8_t *block, uint32_t k)
+{
+    return (((const uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] & FFFS_MESSAGE_COPY) != 0;
+}
 
-        while ((((fffs_partition_table_t *)fffs_vol->read_buf)->jump_to_next_partition) == true)
-        {
-            fffs_vol->current_partition++;
-            fffs_vol->last_block = fffs_vol->current_partition * (fffs_vol->partition_size * PARTITION_SIZE);
-            if (fffs_vol->last_block >= fffs_vol->sd_card->csd.capacity)
-            {
-                ESP_LOGE(TAG, "SD Card is full!");
-                goto fail;
-            }
+/*
+ * Bytes at the start of message k of block that are not its content: the id a copy holds and the key link.
+ */
+static inline int fffs_message_prefix(const uint8_t *block, uint32_t k)
+{
+    return (fffs_message_copied(block, k) ? FFFS_COPY_ID : 0) + (fffs_message_keyed(block, k) ? FFFS_KEY_LINK : 0);
+}
 
-            FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, fffs_vol->last_block, 1) == ESP_OK, "Cannot read partition.", fail);
-        }
+static inline void fffs_set_message_end(uint8_t *block, uint32_t k, uint16_t end)
+{
+    ((uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] = end;
+}
 
-        fffs_vol->current_sector = 0;
+static inline void fffs_set_message_flags(uint8_t *block, uint32_t k, uint16_t flags)
+{
+    ((uint16_t *)(block + SD_BLOCK_SIZE))[-1 - (int)k] |= flags;
+}
 
-        while ((((fffs_partition_table_t *)fffs_vol->read_buf)->jump_to_next_sector) == true)
-        {
-            fffs_vol->last_block = fffs_vol->last_block + (fffs_vol->sector_size * (SECTOR_SIZE));
-            FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, fffs_vol->last_block, 1) == ESP_OK, "Cannot read partition.", fail);
-        }
+static void fffs_block_init(fffs_volume_t *fffs_volume, void *block)
+{
+    fffs_block_header_t *header = block;
 
-        fffs_vol->current_sector = fffs_vol->last_block;
-        fffs_vol->last_block = ((fffs_partition_table_t *)fffs_vol->read_buf)->last_block;
-        fffs_vol->message_id = ((fffs_partition_table_t *)fffs_vol->read_buf)->message_id;
+    memset(block, 0, SD_BLOCK_SIZE); //Blocks are always written whole from RAM
+    header->volume_id = fffs_volume->volume_id;
+    header->first_message = fffs_volume->message_id;
+    header->time = fffs_volume->last_time;
+}
 
-        fffs_vol->block_index = 0;
-        fffs_vol->messages_in_block = 0;
+static bool fffs_block_valid(fffs_volume_t *fffs_volume, const void *block, uint32_t first_message)
+{
+    const fffs_block_header_t *header = block;
 
-        while (((fffs_sector_table_t *)fffs_vol->read_buf)->sector_message_index[fffs_vol->block_index + 1] > 0)
-        {
-            fffs_vol->block_index++;
-        }
+    return header->volume_id == fffs_volume->volume_id && header->first_message == first_message && (header->count > 0 || header->carry > 0);
+}
 
-        fffs_vol->messages_in_block = ((fffs_sector_table_t *)fffs_vol->read_buf)->sector_message_index[fffs_vol->block_index];
-    }
+static uint16_t fffs_block_end(const uint8_t *block, int *messages)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
 
-fail:
-    return fffs_vol->last_block;
+    if (messages != NULL)
+        *messages = header->count;
+
+    return header->count == 0 ? FFFS_BLOCK_DATA + header->carry : fffs_message_end(block, header->count - 1);
 }
 
-esp_err_t fffs_read_block(fffs_volume_t *fffs_volume, int block_num)
+static inline uint32_t fffs_next_data_block(const fffs_volume_t *fffs_vol, uint32_t block)
 {
-    FFFS_CHECK(sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, block_num, 1) == ESP_OK, "Cannot read sector ", fail);
-    return ESP_OK;
+    block++;
+    if (block % (SECTOR_SIZE) == 0) //Skip the sector table
+        block = block + 1 < fffs_vol->data_blocks ? block + 1 : 1;
+    else if (block >= fffs_vol->data_blocks)
+        block = 1; //A ring goes on in sector 0
 
-fail:
-    return ESP_FAIL;
+    return block;
 }
 
-fffs_volume_t *fffs_init(sdmmc_card_t *s_card, bool format)
+/*
+ * Tells whether block holds messages of the log: up to the write head, and past it in the sectors left from the
+ * last lap of a ring.
+ */
+static inline bool fffs_block_written(const fffs_volume_t *fffs_vol, uint32_t block)
 {
-    size_t block_size = s_card->csd.sector_size; //not used at the moment. @todo need to change to sector_size
+    return block <= fffs_vol->last_block || (fffs_vol->oldest_sector > fffs_vol->current_sector && block > fffs_vol->oldest_sector && block < fffs_vol->data_blocks);
+}
 
-    fffs_volume_t *fffs_vol = malloc(sizeof(fffs_volume_t));
-    FFFS_CHECK(fffs_vol, "Cannot create FFFS volume", err);
+/*
+ * Returns the first message at or after message_id not erased by fffs_erase_range. Erased ranges never overlap or
+ * touch, so one pass is enough.
+ */
+static uint32_t fffs_erased_end(const fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    const fffs_erased_range_t *erased = fffs_vol->sector_table->erased;
 
-    fffs_vol->sd_card = s_card;
-    fffs_vol->current_block = 0;
-    fffs_vol->current_partition = 0;
-    fffs_vol->current_sector = 0;
-    fffs_vol->message_id = 0;
-    fffs_vol->block_index = 0;
-    fffs_vol->partition_size = 1;
-    fffs_vol->sector_size = 1;
-    fffs_vol->message_rotate = false;
-    fffs_vol->messages_in_block = 0;
+    for (int i = 0; i < FFFS_ERASED_RANGES; i++)
+    {
+        if (message_id >= erased[i].from && message_id < erased[i].to)
+            message_id = erased[i].to;
+    }
 
-    fffs_vol->read_buf = heap_caps_malloc(block_size, MALLOC_CAP_DMA);
-    FFFS_CHECK(fffs_vol->read_buf, "Cannot create read/write buffer for FFFS volume", fail);
+    return message_id;
+}
 
-    ESP_LOGI(TAG, "Starting FF Filing System.");
+/*
+ * Tells whether message_id was written over by the ring, truncated or erased.
+ */
+static inline bool fffs_message_gone(const fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    return message_id < fffs_vol->oldest_message_id || fffs_erased_end(fffs_vol, message_id) != message_id;
+}
 
-    fffs_vol->current_block = fffs_find_lastBlock(fffs_vol);
+/*
+ * Returns the index of the first entry of the forwarding table whose id is at or above message_id.
+ */
+static uint32_t fffs_forward_find(const fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    uint32_t lo = 0, hi = fffs_vol->forward_count;
 
-    FFFS_CHECK(fffs_vol->current_block > 0, "SD Card is not formatted for FFFS.", format);
-    return fffs_vol;
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-format:
-    if (format)
-        FFFS_CHECK(fffs_format(fffs_vol, 2, 1, false) == ESP_OK, "Formatting was not successful.", fail_format);
+        if (fffs_vol->forward[mid].id < message_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    return fffs_vol;
+    return lo;
+}
 
-fail_format:
-    ESP_LOGI(TAG, "Format failed,Changed SD card.");
-    free(fffs_vol->read_buf);
+/*
+ * Returns the id message_id is stored under: that of its copy when fffs_replace or fffs_compact moved it, its own
+ * otherwise.
+ */
+static inline uint32_t fffs_forward(const fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    uint32_t i = fffs_forward_find(fffs_vol, message_id);
 
-fail:
-    free(fffs_vol);
+    return i < fffs_vol->forward_count && fffs_vol->forward[i].id == message_id ? fffs_vol->forward[i].copy : message_id;
+}
+
+/*
+ * Returns the RAM copy of block if the card may not hold it yet, NULL if it is read from the card. Staged blocks
+ * and the tail are in stage_buf, blocks still being written by the device in sent_buf.
+ */
+static inline uint8_t *fffs_ram_block(fffs_volume_t *fffs_vol, uint32_t block)
+{
+    if (block - fffs_vol->sent_block < fffs_vol->sent_count)
+        return (uint8_t *)fffs_vol->sent_buf + (block - fffs_vol->sent_block) * SD_BLOCK_SIZE;
+
+    if (block >= fffs_vol->stage_block && block <= fffs_vol->last_block) //Blocks past the head are from the last lap of a ring
+        return (uint8_t *)fffs_vol->stage_buf + (block - fffs_vol->stage_block) * SD_BLOCK_SIZE;
 
-err:
     return NULL;
 }
 
-esp_err_t fffs_deinit(fffs_volume_t *fffs_vol)
+/*
+ * Returns the first block at or after block that is not read from the card, the end of the data blocks for the
+ * blocks a ring wrote in its last lap.
+ */
+static inline uint32_t fffs_card_end(fffs_volume_t *fffs_vol, uint32_t block)
 {
-    if (fffs_vol == NULL)
-        return ESP_OK;
-    heap_caps_free(fffs_vol->read_buf);
-    free(fffs_vol);
-    return ESP_OK;
+    uint32_t end = block < fffs_vol->stage_block ? fffs_vol->stage_block : fffs_vol->data_blocks;
+
+    return fffs_vol->sent_count > 0 && fffs_vol->sent_block > block && fffs_vol->sent_block < end ? fffs_vol->sent_block : end;
 }
 
-static esp_err_t fffs_update_table(fffs_volume_t *fffs_volume)
+/*
+ * Blocks in read_buf and in reader buffers: enough to read the fragments of a message_max message with one
+ * command, up to read_ahead_blocks.
+ */
+static inline uint32_t fffs_read_blocks(const fffs_volume_t *fffs_vol)
 {
-    if (fffs_volume->messages_in_block == 0)
-        return ESP_FAIL;
+    uint32_t blocks = (fffs_vol->config.message_max + SD_BLOCK_SIZE - FFFS_BLOCK_DATA - 1) / (SD_BLOCK_SIZE - FFFS_BLOCK_DATA);
 
-    FFFS_CHECK(sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_sector, 1) == ESP_OK, "Cannot read sector ", fail);
+    return blocks < fffs_vol->config.read_ahead_blocks ? blocks : fffs_vol->config.read_ahead_blocks;
+}
 
-    //fffs_volume->last_block = fffs_volume->current_block;
+/*
+ * Finds message k of block. Returns false if the block holds fewer messages or the trailer is damaged.
+ */
+static bool fffs_block_message(const uint8_t *block, uint32_t k, uint16_t *offset, int *size)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
+    uint32_t count = header->count;
+    uint16_t start, end;
 
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->last_block) = fffs_volume->last_block;
-    (((fffs_partition_table_t *)fffs_volume->read_buf)->message_id) = fffs_volume->message_id;
-    (((fffs_sector_table_t *)fffs_volume->read_buf)->sector_message_index[fffs_volume->block_index]) = fffs_volume->messages_in_block;
+    if (k >= count || FFFS_BLOCK_DATA + header->carry + count * sizeof(uint16_t) > SD_BLOCK_SIZE)
+        return false;
 
-    FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_sector, 1) == ESP_OK, "Cannot write sector ", fail);
+    start = k == 0 ? FFFS_BLOCK_DATA + header->carry : fffs_message_end(block, k - 1);
+    end = fffs_message_end(block, k);
+    if (start < FFFS_BLOCK_DATA || end < start || end > SD_BLOCK_SIZE - count * sizeof(uint16_t))
+        return false;
 
-    return ESP_OK;
-fail:
-    return ESP_FAIL;
+    *offset = start;
+    *size = end - start;
+    return true;
 }
 
-static esp_err_t fffs_next_block(fffs_volume_t *fffs_volume)
+/*
+ * Finds message k of block as stored in the block, past the size leading a message that continues in the next one.
+ */
+static bool fffs_message_stored(const uint8_t *block, uint32_t k, uint16_t *offset, int *size)
 {
-    FFFS_CHECK(fffs_volume->last_block++ < fffs_volume->sd_card->csd.capacity, "SD CARD is full.", full_card);
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
 
-    FFFS_CHECK(fffs_erase_block(fffs_volume, fffs_volume->last_block, 1) == ESP_OK, "Cannot create next block", fail);
+    if (!fffs_block_message(block, k, offset, size))
+        return false;
 
-    if (fffs_volume->last_block % (fffs_volume->partition_size * (PARTITION_SIZE)) == 0)
+    if ((header->flags & FFFS_BLOCK_CONTINUES) && k + 1 == header->count)
     {
-        fffs_update_partition_block(fffs_volume);
+        if (*size < (int)sizeof(uint32_t))
+            return false;
+        *offset += sizeof(uint32_t);
+        *size -= sizeof(uint32_t);
     }
 
-    if (fffs_volume->last_block % (SECTOR_SIZE) == 0)
-    {
-        ESP_LOGI(TAG, "Creating new sector");
-        fffs_create_sector_block(fffs_volume);
-        fffs_volume->messages_in_block = 0;
-        fffs_volume->block_index = 0;
-        return fffs_next_block(fffs_volume);
-    }
+    return true;
+}
 
-    if (fffs_volume->last_block % (BLOCKS_IN_SECTOR) == 0)
-    {
-        //fffs_volume->last_block = fffs_volume->current_block;
-        if (fffs_volume->messages_in_block > 0)
-            fffs_volume->block_index++;
-        fffs_volume->messages_in_block = 0;
-        return ESP_OK;
-    }
+/*
+ * Tells whether message k of block, stored under id stored, holds message message_id: the message itself unless it
+ * was moved, or a copy made of it. A copy read under its own id holds nothing. Copies are never compressed.
+ */
+static bool fffs_message_holds(const uint8_t *block, uint32_t k, uint32_t stored, uint32_t message_id)
+{
+    uint32_t origin;
+    uint16_t offset;
+    int size;
 
-full_card:
-    fffs_volume->current_partition = 0;
-    fffs_volume->current_sector = 0;
-    fffs_volume->last_block = 1;
-    FFFS_CHECK(sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_partition, 1) == ESP_OK, "Cannot read partition ", fail);
-    ((fffs_partition_table_t *)fffs_volume->read_buf)->card_full = true;
-    ((fffs_partition_table_t *)fffs_volume->read_buf)->jump_to_next_sector = false;
-    FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_partition, 1) == ESP_OK, "Cannot read partition ", fail);
+    if (!fffs_message_copied(block, k))
+        return stored == message_id;
 
-    if (((fffs_partition_table_t *)fffs_volume->read_buf)->message_rotate == true) //log can be rotated
-    {
-        ((fffs_partition_table_t *)fffs_volume->read_buf)->jump_to_next_partition = false;
-        FFFS_CHECK(sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->current_partition, 1) == ESP_OK, "Cannot read partition ", fail);
-        fffs_next_block(fffs_volume);
-    }
+    if (stored == message_id || !fffs_message_stored(block, k, &offset, &size) || size < (int)FFFS_COPY_ID)
+        return false;
 
-fail:
-    return ESP_FAIL;
+    memcpy(&origin, block + offset, FFFS_COPY_ID);
+    return origin == message_id;
 }
 
-esp_err_t fffs_write(fffs_volume_t *fffs_volume, void *message, int size)
+/*
+ * Records the flags and time stamp of data block index in the sector table.
+ */
+static void fffs_table_mark(fffs_sector_table_t *table, uint32_t index, const void *block)
 {
-    static int old_last_block = 0;
+    const fffs_block_header_t *header = block;
 
-    esp_err_t err = ESP_OK;
-
-    if (size > SD_BLOCK_SIZE - 3 || size == 0) //messages can only 510 bytes long  since the first two bytes must be reserved for the next message offset
-        return ESP_ERR_INVALID_SIZE;
-
-    //fffs_volume->current_block = fffs_volume->last_block;
+    if (header->flags & FFFS_BLOCK_COMPRESSED)
+        table->compressed_blocks[index / 8] |= 1 << (index % 8);
+    if (header->time > table->last_time)
+        table->last_time = header->time;
+}
 
-    err = sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->last_block, 1);
+/*
+ * Adds message k of block to the raw content in window. Compressed messages are decoded, raw ones copied if
+ * they fit, as the writer did when it appended them to lz_window.
+ */
+static bool fffs_window_add(const uint8_t *block, uint32_t k, uint8_t *window, int *pos)
+{
+    uint16_t offset;
+    int size, end;
 
-    int tmp = 0;
-    static int i;
+    if (!fffs_block_message(block, k, &offset, &size))
+        return false;
 
-    if (fffs_volume->last_block == old_last_block)
+    if (fffs_message_compressed(block, k))
     {
-        tmp = i;
+        end = fffs_lz_decompress(block + offset, size, window, *pos, FFFS_COMPRESS_WINDOW);
+        if (end < 0)
+            return false;
+        *pos = end;
     }
-    else
+    else if (*pos + size <= FFFS_COMPRESS_WINDOW)
     {
-        old_last_block = fffs_volume->last_block;
-        i = 0;
-        do
-        { //This is required for when an sd card is restarted
-            tmp = *((uint8_t *)(fffs_volume->read_buf) + i);
-            tmp = (tmp == 0 && *((uint8_t *)(fffs_volume->read_buf) + i + 1) > 0) ? (*((uint8_t *)(fffs_volume->read_buf) + i + 1)) + 0x100 : tmp;
-            if ((i + tmp) > SD_BLOCK_SIZE - 2)
-                tmp = 0;
-            else
-            {
-                i = i + tmp;
-            }
-
-        } while (tmp > 0);
+        memcpy(window + *pos, block + offset, size);
+        *pos += size;
     }
 
-    if (size > (SD_BLOCK_SIZE - 3 - (i)))
-    {
-        if (fffs_next_block(fffs_volume) == ESP_FAIL)
-            return ESP_FAIL;
+    return true;
+}
 
-        return fffs_write(fffs_volume, message, size) == ESP_OK ? ESP_OK : ESP_FAIL;
-    }
+/*
+ * Decodes compressed message k of block, card block block_num, into window. Messages already decoded by an
+ * earlier call for the same block are kept: blocks only grow until they are sealed. Returns the offset of the
+ * message in window->buf, -1 if it cannot be decoded.
+ */
+static int fffs_window_decode(fffs_window_t *window, const uint8_t *block, uint32_t block_num, uint32_t k)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
+    int pos, start = -1;
 
-    if (size < 255)
+    if (window->buf == NULL)
+        window->buf = malloc(FFFS_COMPRESS_WINDOW);
+    if (window->buf == NULL)
+        return -1;
+
+    if (window->block != block_num || window->first_message != header->first_message || window->next > k)
     {
-        memcpy((uint8_t *)(fffs_volume->read_buf) + i + 1, message, size);
-        *((uint8_t *)(fffs_volume->read_buf) + i) = (uint8_t)size + 1; //this is the offset not message size
-        i = i + size + 1;
+        window->block = block_num;
+        window->first_message = header->first_message;
+        window->pos = 0;
+        window->next = 0;
     }
-    else
+
+    pos = window->pos;
+    for (; window->next <= k; window->next++)
     {
-        memcpy((uint8_t *)(fffs_volume->read_buf) + i + 2, message, size);
-        *((uint8_t *)(fffs_volume->read_buf) + i) = 0;                                //indicate that the message is longer than 255 characters
-        *((uint8_t *)(fffs_volume->read_buf) + i + 1) = (uint8_t)((size - 0xff)) + 1; //this is the offset not message size
-        i = i + size + 2;
+        start = pos;
+        if (!fffs_window_add(block, window->next, window->buf, &pos))
+        {
+            window->block = UINT32_MAX;
+            return -1;
+        }
+        window->pos = pos;
     }
 
-    err = sdmmc_write_sectors(fffs_volume->sd_card, fffs_volume->read_buf, fffs_volume->last_block, 1);
-    if (err != ESP_OK)
-        return ESP_FAIL;
-
-    fffs_volume->messages_in_block++;
-    fffs_volume->message_id++;
-    fffs_update_table(fffs_volume);
-
-    return ESP_OK;
+    return start;
 }
 
-static esp_err_t fffs_internal_read(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *message, int *size, int *_block, int *_offset)
+static void fffs_window_init(fffs_window_t *window)
 {
+    window->buf = NULL;
+    window->block = UINT32_MAX;
+}
 
-    uint32_t fetch_block;
-    uint8_t partition = 0;
-    FFFS_CHECK((message_num < fffs_vol->message_id), "Message num is too big", err);
+/*
+ * The sector table on the card is only as recent as the last checkpoint. Blocks committed after it are counted
+ * here, stopping at the first block whose stamps do not follow on, which was not written since the format or in
+ * this pass over the card, or at the end of the sector.
+ */
+static esp_err_t fffs_recover_tail(fffs_volume_t *fffs_vol)
+{
+    uint32_t sector_end = fffs_vol->current_sector + (SECTOR_SIZE);
+    uint32_t index = (fffs_vol->last_block - fffs_vol->current_sector - 1) / BLOCKS_IN_SECTOR;
+    uint32_t first_message = fffs_vol->message_id - fffs_vol->sector_table->sector_message_index[index];
+    fffs_block_header_t *header = fffs_vol->read_buf;
 
-    do
+    for (uint32_t block = fffs_vol->last_block; block < sector_end && block < fffs_vol->data_blocks; block++)
     {
-        fetch_block = (fffs_vol->partition_size * (PARTITION_SIZE)) * partition++;
-        FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, fetch_block, 1) == ESP_OK, "Cannot read partition", err);
-
-    } while ((((fffs_partition_table_t *)fffs_vol->read_buf)->jump_to_next_partition) == true && (((fffs_partition_table_t *)fffs_vol->read_buf)->message_id < message_num));
+        index = (block - fffs_vol->current_sector - 1) / BLOCKS_IN_SECTOR;
 
-    --partition;
-    int message_base;
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, header, block, 1) == ESP_OK, "Cannot read block %d", fail, block);
 
-    while ((((fffs_partition_table_t *)fffs_vol->read_buf)->jump_to_next_sector) == true && (((fffs_partition_table_t *)fffs_vol->read_buf)->message_id < message_num))
-    {
-        fetch_block = fetch_block + (SECTOR_SIZE);
-        FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, fetch_block, 1) == ESP_OK, "Cannot read sector", err);
-    }
-    message_base = ((fffs_sector_table_t *)fffs_vol->read_buf)->first_message;
+        if (!fffs_block_valid(fffs_vol, header, first_message))
+            break;
 
-    fetch_block++;
+        if (header->count > fffs_vol->sector_table->sector_message_index[index])
+        {
+            fffs_vol->sector_table->sector_message_index[index] = header->count;
+            fffs_vol->table_dirty = true;
+        }
+        fffs_table_mark(fffs_vol->sector_table, index, header);
 
-    int old_message_base;
+        first_message += fffs_vol->sector_table->sector_message_index[index];
+        fffs_vol->message_id = first_message;
+        fffs_vol->last_block = block;
+    }
 
-    int i = 0;
-    do
+    if (fffs_vol->message_id > fffs_vol->sector_table->partition_sector_table.message_id) //Appended after the summary was checkpointed
     {
-        old_message_base = message_base;
-        message_base = message_base + (((fffs_sector_table_t *)fffs_vol->read_buf)->sector_message_index[i++]);
+        fffs_vol->sector_table->summary.flags |= FFFS_SUMMARY_PARTIAL;
+        fffs_vol->table_dirty = true;
+    }
 
-    } while (message_base < ((message_num) + 1) && (((fffs_sector_table_t *)fffs_vol->read_buf)->sector_message_index[i]) != 0);
+    if (fffs_vol->table_dirty)
+        ESP_LOGI(TAG, "Recovered messages up to %d in block %d.", fffs_vol->message_id, fffs_vol->last_block);
 
-    fetch_block = fetch_block + (i * BLOCKS_IN_SECTOR) - 1;
+    fffs_vol->sector_table->partition_sector_table.last_block = fffs_vol->last_block;
+    fffs_vol->sector_table->partition_sector_table.message_id = fffs_vol->message_id;
+    return ESP_OK;
 
-    FFFS_CHECK(sdmmc_read_sectors(fffs_vol->sd_card, fffs_vol->read_buf, fetch_block, 1) == ESP_OK, "Cannot read block", err);
+fail:
+    return ESP_FAIL;
+}
 
-    if (_block != NULL)
-        *_block = fetch_block;
+/*
+ * Reads the header of sector into read_buf and tells whether the writer has moved past that sector in the current
+ * lap. Sectors of a ring ahead of the write head are sealed too, but in the lap before.
+ */
+static bool fffs_sector_sealed(fffs_volume_t *fffs_vol, uint32_t sector)
+{
+    fffs_partition_table_t *header = fffs_vol->read_buf;
 
-    int index = 0;
-    int offset = 0;
-    for (unsigned char num_offset = (message_num - old_message_base); num_offset > 0; num_offset--)
-    {
-        offset = *((uint8_t *)(fffs_vol->read_buf) + index);
+    if (sector >= fffs_vol->data_blocks || fffs_bdev_read(fffs_vol->bdev, header, sector, 1) != ESP_OK)
+        return false;
 
-        if (offset == 0)
-            offset = 0x100 + (*((uint8_t *)(fffs_vol->read_buf) + index + 1));
+    return header->magic_number == FFFS_MAGIC_NUMBER && header->jump_to_next_sector == true &&
+           ((fffs_sector_table_t *)header)->volume_id == fffs_vol->volume_id && ((fffs_sector_table_t *)header)->epoch == fffs_vol->epoch;
+}
 
-        index = index + offset;
-    }
+/*
+ * Finds the sector of the write head. Sectors are sealed in order, so starting from the head pointer in the
+ * boot block only the sectors opened since it was last written are walked. Should the walk get too long the
+ * sealed flags are binary searched from the last sector found sealed, which also covers a missing or damaged
+ * pointer.
+ */
+static uint32_t fffs_find_head(fffs_volume_t *fffs_vol, uint32_t hint)
+{
+    uint32_t stride = fffs_vol->sector_size * (SECTOR_SIZE);
+    uint32_t lo = 0;
+    uint32_t hi = (fffs_vol->data_blocks + stride - 1) / stride;
+    uint32_t walk = 2 * fffs_vol->config.head_sectors;
 
-    if (_offset != NULL)
-        *_offset = index;
+    if (hint % stride != 0 || hint >= fffs_vol->data_blocks || (hint > 0 && !fffs_sector_sealed(fffs_vol, hint - stride)))
+        hint = 0; //A damaged pointer may lie past the head, the sector before it must be sealed
 
-    offset = (*((uint8_t *)(fffs_vol->read_buf) + index) == 0 ? 0xFF + (*((uint8_t *)(fffs_vol->read_buf) + index + 1)) : *((uint8_t *)(fffs_vol->read_buf) + index));
+    for (lo = hint / stride;; lo++) //At least the hinted sector is checked
+    {
+        if (!fffs_sector_sealed(fffs_vol, lo * stride))
+            return lo * stride;
+        if (walk <= 1)
+            break; //Sector lo is the last one found sealed
+        walk--;
+    }
 
-    *size = --offset;
+    ESP_LOGW(TAG, "Head pointer is stale, searching from sector %d.", lo * stride);
 
-    if (message != NULL)
-        memcpy(message, (uint8_t *)(fffs_vol->read_buf) + index + 1 + ((*size) > 0xFF ? 1 : 0), *size);
+    while (hi - lo > 1) //lo sealed, hi not sealed
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
 
-    return ESP_OK;
+        if (fffs_sector_sealed(fffs_vol, mid * stride))
+            lo = mid;
+        else
+            hi = mid;
+    }
 
-err:
-    return ESP_FAIL;
+    return hi * stride;
 }
 
-esp_err_t fffs_read(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *message, int *size)
+static uint32_t fffs_find_lastBlock(fffs_volume_t *fffs_vol)
 {
-    int *block = NULL, *offset = NULL;
-    return fffs_internal_read(fffs_vol, message_num, message, size, block, offset);
-}
+    fffs_vol->last_block = 0;
 
-esp_err_t fffs_erase(fffs_volume_t *fffs_vol, size_t message_num)
+    FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, fffs_vol->read_buf, 0, 1) == ESP_OK, "Cannot read partition.", fail);
+
+    if ((((fffs_partition_table_t *)fffs_vol->read_buf)->magic_number) == FFFS_MAGIC_NUMBER)
+    {
+        ESP_LOGI(TAG, "FFS: Found Boot Partition.");
+
+        fffs_vol->partition_size = ((fffs_partition_table_t *)fffs_vol->read_buf)->partition_size == 0 ? 1 : ((fffs_partition_table_t *)fffs_vol->read_buf)->partition_size;
+        fffs_vol->sector_size = ((fffs_partition_table_t *)fffs_vol->read_buf)->sector_size == 0 ? 1 : ((fffs_partition_table_t *)fffs_vol->read_buf)->sector_size;
+
+        fffs_vol->volume_id = ((fffs_sector_table_t *)fffs_vol->read_buf)->volume_id;
+        fffs_vol->key_blocks = ((fffs_sector_table_t *)fffs_vol->read_buf)->key_blocks;
+        if (fffs_vol->key_blocks >= fffs_vol->bdev->capacity)
+            fffs_vol->key_blocks = 0;
+        fffs_vol->forward_blocks = ((fffs_sector_table_t *)fffs_vol->read_buf)->forward_blocks;
+        if (fffs_vol->forward_blocks >= fffs_vol->bdev->capacity - fffs_vol->key_blocks)
+            fffs_vol->forward_blocks = 0;
+        fffs_vol->data_blocks = fffs_vol->bdev->capacity - fffs_vol->key_blocks - fffs_vol->forward_blocks;
+        fffs_vol->message_rotate = ((fffs_partition_table_t *)fffs_vol->read_buf)->message_rotate;
+        fffs_vol->epoch = ((fffs_sector_table_t *)fffs_vol->read_buf)->epoch; //Sector 0 is the first one opened in a lap
+
+        fffs_vol->current_sector = fffs_find_head(fffs_vol, ((fffs_sector_table_t *)fffs_vol->read_buf)->head_sector);
+        FFFS_CHECK(fffs_vol->current_sector < fffs_vol->data_blocks, "SD Card is full!", fail);
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, fffs_vol->read_buf, fffs_vol->current_sector, 1) == ESP_OK, "Cannot read partition.", fail);
+        FFFS_CHECK(((fffs_partition_table_t *)fffs_vol->read_buf)->magic_number == FFFS_MAGIC_NUMBER && ((fffs_sector_table_t *)fffs_vol->read_buf)->volume_id == fffs_vol->volume_id,
+                   "No sector table at the write head (block %d)", fail, fffs_vol->current_sector);
+
+        memcpy(fffs_vol->sector_table, fffs_vol->read_buf, SD_BLOCK_SIZE);
+        fffs_vol->current_partition = fffs_vol->current_sector / (fffs_vol->partition_size * PARTITION_SIZE);
+        fffs_vol->last_block = fffs_vol->sector_table->partition_sector_table.last_block;
+        fffs_vol->message_id = fffs_vol->sector_table->partition_sector_table.message_id;
+        if (fffs_vol->last_block <= fffs_vol->current_sector)
+            fffs_vol->last_block = fffs_vol->current_sector + 1;
+
+        FFFS_CHECK(fffs_recover_tail(fffs_vol) == ESP_OK, "Cannot recover blocks after the last checkpoint.", fail);
+        fffs_vol->last_time = fffs_vol->sector_table->last_time;
+        FFFS_CHECK(fffs_oldest_update(fffs_vol) == ESP_OK, "Cannot find the oldest messages", fail);
+
+        fffs_vol->block_index = (fffs_vol->last_block - fffs_vol->current_sector - 1) / BLOCKS_IN_SECTOR; //The tail block may not have been committed yet
+        fffs_vol->messages_in_block = fffs_vol->sector_table->sector_message_index[fffs_vol->block_index];
+        fffs_vol->checkpoint_block = fffs_vol->last_block;
+    }
+
+    return fffs_vol->last_block;
+
+fail:
+    fffs_vol->last_block = 0;
+    return fffs_vol->last_block;
+}
+
+static esp_err_t fffs_load_tail(fffs_volume_t *fffs_volume)
+{
+    fffs_volume->stage_block = fffs_volume->last_block;
+    fffs_volume->stage_slot = 0;
+    fffs_volume->tail_buf = fffs_volume->stage_buf;
+    FFFS_CHECK(fffs_bdev_read(fffs_volume->bdev, fffs_volume->tail_buf, fffs_volume->last_block, 1) == ESP_OK, "Cannot read tail block ", fail);
+
+    if (!fffs_block_valid(fffs_volume, fffs_volume->tail_buf, fffs_volume->message_id - fffs_volume->messages_in_block))
+    {
+        if (fffs_volume->messages_in_block > 0) //The sector table counts messages that are not on the card
+        {
+            ESP_LOGE(TAG, "Tail block %d is damaged, %d messages lost.", fffs_volume->last_block, fffs_volume->messages_in_block);
+            fffs_volume->message_id -= fffs_volume->messages_in_block;
+            fffs_volume->messages_in_block = 0;
+            fffs_volume->sector_table->sector_message_index[fffs_volume->block_index] = 0;
+        }
+
+        fffs_block_init(fffs_volume, fffs_volume->tail_buf);
+    }
+
+    fffs_volume->tail_offset = fffs_block_end(fffs_volume->tail_buf, NULL);
+    fffs_volume->tail_first_message = fffs_volume->message_id - fffs_volume->messages_in_block;
+    fffs_volume->tail_dirty = 0;
+
+    if (fffs_volume->lz_window != NULL) //Rebuild what later messages of the tail can refer back to
+    {
+        fffs_lz_reset(fffs_volume->lz_table);
+        fffs_volume->lz_pos = 0;
+        fffs_volume->lz_hashed = 0;
+        for (uint32_t k = 0; k < fffs_volume->messages_in_block; k++)
+        {
+            if (!fffs_window_add(fffs_volume->tail_buf, k, fffs_volume->lz_window, &fffs_volume->lz_pos))
+            {
+                fffs_volume->lz_pos = FFFS_COMPRESS_WINDOW; //Nothing more is compressed in this block
+                break;
+            }
+        }
+    }
+    fffs_volume->tail_commit_time = esp_timer_get_time();
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_read_block(fffs_volume_t *fffs_volume, int block_num)
+{
+    esp_err_t err = ESP_OK;
+
+    fffs_lock(fffs_volume);
+    if (block_num <= fffs_volume->last_block && fffs_ram_block(fffs_volume, block_num) != NULL) //The card copy of staged blocks may be behind
+        memcpy(fffs_volume->read_buf, fffs_ram_block(fffs_volume, block_num), SD_BLOCK_SIZE);
+    else
+        err = fffs_bdev_read(fffs_volume->bdev, fffs_volume->read_buf, block_num, 1);
+    fffs_unlock(fffs_volume);
+
+    FFFS_CHECK(err == ESP_OK, "Cannot read sector ", fail);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+static esp_err_t fffs_index_create(fffs_volume_t *fffs_vol)
+{
+    uint32_t sectors = fffs_vol->bdev->capacity / (SECTOR_SIZE) + 1;
+
+    while (((sectors + (1 << fffs_vol->index_shift) - 1) >> fffs_vol->index_shift) > fffs_vol->config.index_sectors && fffs_vol->index_shift < 31)
+        fffs_vol->index_shift++;
+
+    fffs_vol->index_entries = (sectors + (1 << fffs_vol->index_shift) - 1) >> fffs_vol->index_shift;
+    fffs_vol->index_first = heap_caps_malloc(fffs_vol->index_entries * sizeof(uint32_t), fffs_vol->config.index_caps);
+    FFFS_CHECK(fffs_vol->index_first, "Cannot allocate %d index entries", fail, fffs_vol->index_entries);
+
+    fffs_vol->index_cache = calloc(fffs_vol->config.index_cache_sectors, sizeof(fffs_index_cache_t));
+    FFFS_CHECK(fffs_vol->index_cache, "Cannot allocate sector table cache", fail);
+
+    for (uint32_t i = 0; i < fffs_vol->config.index_cache_sectors; i++)
+    {
+        fffs_vol->index_cache[i].table = heap_caps_malloc(SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+        FFFS_CHECK(fffs_vol->index_cache[i].table, "Cannot allocate sector table cache", fail);
+    }
+
+    fffs_index_reset(fffs_vol);
+    ESP_LOGI(TAG, "Message index: %d entries, %d sectors per entry.", fffs_vol->index_entries, 1 << fffs_vol->index_shift);
+    return ESP_OK;
+
+fail:
+    return ESP_ERR_NO_MEM;
+}
+
+static void fffs_index_delete(fffs_volume_t *fffs_vol)
+{
+    if (fffs_vol->index_cache != NULL)
+    {
+        for (uint32_t i = 0; i < fffs_vol->config.index_cache_sectors; i++)
+            heap_caps_free(fffs_vol->index_cache[i].table);
+    }
+
+    free(fffs_vol->index_cache);
+    heap_caps_free(fffs_vol->index_first);
+    fffs_vol->index_cache = NULL;
+    fffs_vol->index_first = NULL;
+}
+
+fffs_volume_t *fffs_init(fffs_bdev_t *bdev, bool format)
+{
+    fffs_config_t config = FFFS_CONFIG_DEFAULT();
+    return fffs_init_with_config(bdev, format, &config);
+}
+
+fffs_volume_t *fffs_init_with_config(fffs_bdev_t *bdev, bool format, const fffs_config_t *config)
+{
+    FFFS_CHECK(bdev, "Block device is NULL.", err);
+    FFFS_CHECK(config, "Configuration is NULL.", err);
+    FFFS_CHECK(bdev->block_size == SD_BLOCK_SIZE, "Unsupported block size %d.", err, bdev->block_size);
+
+    size_t block_size = bdev->block_size;
+
+    fffs_volume_t *fffs_vol = malloc(sizeof(fffs_volume_t));
+    FFFS_CHECK(fffs_vol, "Cannot create FFFS volume", err);
+
+    fffs_vol->bdev = bdev;
+    fffs_vol->current_block = 0;
+    fffs_vol->current_partition = 0;
+    fffs_vol->current_sector = 0;
+    fffs_vol->message_id = 0;
+    fffs_vol->volume_id = 0;
+    fffs_vol->block_index = 0;
+    fffs_vol->partition_size = 1;
+    fffs_vol->sector_size = 1;
+    fffs_vol->message_rotate = false;
+    fffs_vol->epoch = 0;
+    fffs_vol->oldest_sector = 0;
+    fffs_vol->oldest_message_id = 0;
+    fffs_vol->messages_in_block = 0;
+    fffs_vol->config = *config;
+    fffs_vol->tail_buf = NULL;
+    fffs_vol->stage_buf = NULL;
+    fffs_vol->sent_buf = NULL;
+    fffs_vol->sent_count = 0;
+    fffs_vol->stage_counts = NULL;
+    fffs_vol->stage_slot = 0;
+    fffs_vol->tail_split = false;
+    fffs_vol->last_time = 0;
+    if (fffs_vol->config.batch_blocks == 0)
+        fffs_vol->config.batch_blocks = 1;
+    fffs_vol->sector_table = NULL;
+    fffs_vol->checkpoint_block = 0;
+    fffs_vol->table_dirty = false;
+    fffs_vol->index_first = NULL;
+    fffs_vol->index_cache = NULL;
+    fffs_vol->index_clock = 0;
+    fffs_vol->index_shift = 0;
+    if (fffs_vol->config.index_cache_sectors == 0)
+        fffs_vol->config.index_cache_sectors = 1;
+    if (fffs_vol->config.read_ahead_blocks == 0)
+        fffs_vol->config.read_ahead_blocks = 1;
+    if (fffs_vol->config.head_sectors == 0)
+        fffs_vol->config.head_sectors = 1;
+    if (fffs_vol->config.message_max == 0)
+        fffs_vol->config.message_max = FFFS_MESSAGE_MAX;
+    fffs_vol->lock.take = NULL;
+    fffs_vol->lock.give = NULL;
+    fffs_vol->lock.ctx = NULL;
+    fffs_vol->lz_window = NULL;
+    fffs_vol->lz_table = NULL;
+    fffs_vol->lz_out = NULL;
+    fffs_vol->lz_pos = 0;
+    fffs_vol->lz_hashed = 0;
+    fffs_window_init(&fffs_vol->read_window);
+    fffs_vol->data_blocks = bdev->capacity;
+    fffs_vol->key_blocks = 0;
+    fffs_vol->key_cache = NULL;
+    fffs_vol->key_record = NULL;
+    fffs_vol->key_clock = 0;
+    if (fffs_vol->config.key_cache_buckets == 0)
+        fffs_vol->config.key_cache_buckets = 1;
+    fffs_vol->forward_blocks = 0;
+    fffs_vol->forward = NULL;
+    fffs_vol->forward_count = 0;
+    fffs_vol->copy_record = NULL;
+    fffs_vol->compact_buf = NULL;
+
+    fffs_vol->read_buf = heap_caps_malloc(block_size * fffs_read_blocks(fffs_vol), MALLOC_CAP_DMA);
+    FFFS_CHECK(fffs_vol->read_buf, "Cannot create read/write buffer for FFFS volume", fail);
+
+    fffs_vol->stage_buf = heap_caps_malloc(block_size * fffs_vol->config.batch_blocks, MALLOC_CAP_DMA);
+    fffs_vol->stage_counts = calloc(fffs_vol->config.batch_blocks, sizeof(uint8_t));
+    FFFS_CHECK(fffs_vol->stage_buf && fffs_vol->stage_counts, "Cannot create tail buffer for FFFS volume", fail_format);
+    fffs_vol->tail_buf = fffs_vol->stage_buf;
+
+    if (bdev->write_start != NULL) //Blocks fill in one buffer while the other is written
+    {
+        fffs_vol->sent_buf = heap_caps_malloc(block_size * fffs_vol->config.batch_blocks, MALLOC_CAP_DMA);
+        FFFS_CHECK(fffs_vol->sent_buf, "Cannot create second stage buffer for FFFS volume", fail_format);
+    }
+
+    fffs_vol->sector_table = heap_caps_malloc(block_size, MALLOC_CAP_DMA);
+    FFFS_CHECK(fffs_vol->sector_table, "Cannot create sector table for FFFS volume", fail_format);
+
+    FFFS_CHECK(fffs_index_create(fffs_vol) == ESP_OK, "Cannot create message index for FFFS volume", fail_format);
+
+    if (fffs_vol->config.compress)
+    {
+        fffs_vol->lz_window = malloc(FFFS_COMPRESS_WINDOW);
+        fffs_vol->lz_table = malloc(FFFS_LZ_HASH_SIZE * sizeof(uint16_t));
+        fffs_vol->lz_out = malloc(FFFS_MESSAGE_MAX);
+        FFFS_CHECK(fffs_vol->lz_window && fffs_vol->lz_table && fffs_vol->lz_out, "Cannot create compression buffers for FFFS volume", fail_format);
+    }
+
+    ESP_LOGI(TAG, "Starting FF Filing System.");
+
+    fffs_vol->current_block = fffs_find_lastBlock(fffs_vol);
+
+    FFFS_CHECK(fffs_vol->current_block > 0, "SD Card is not formatted for FFFS.", format);
+    FFFS_CHECK(fffs_load_tail(fffs_vol) == ESP_OK, "Cannot load tail block.", fail_format);
+    FFFS_CHECK(fffs_forward_load(fffs_vol) == ESP_OK, "Cannot load forwarding table.", fail_format);
+    return fffs_vol;
+
+format:
+    if (!format)
+        goto fail_format; //A volume that was not mounted takes no writes
+    FFFS_CHECK(fffs_format(fffs_vol, 2, 1, fffs_vol->config.message_rotate) == ESP_OK, "Formatting was not successful.", fail_format);
+    FFFS_CHECK(fffs_load_tail(fffs_vol) == ESP_OK, "Cannot load tail block.", fail_format);
+    return fffs_vol;
+
+fail_format:
+    ESP_LOGI(TAG, "Format failed,Changed SD card.");
+    fffs_index_delete(fffs_vol);
+    fffs_key_delete(fffs_vol);
+    fffs_forward_delete(fffs_vol);
+    free(fffs_vol->lz_window);
+    free(fffs_vol->lz_table);
+    free(fffs_vol->lz_out);
+    free(fffs_vol->read_window.buf);
+    heap_caps_free(fffs_vol->sector_table);
+    free(fffs_vol->stage_counts);
+    heap_caps_free(fffs_vol->stage_buf);
+    heap_caps_free(fffs_vol->sent_buf);
+    heap_caps_free(fffs_vol->read_buf);
+
+fail:
+    free(fffs_vol);
+
+err:
+    return NULL;
+}
+
+esp_err_t fffs_deinit(fffs_volume_t *fffs_vol)
+{
+    if (fffs_vol == NULL)
+        return ESP_OK;
+    fffs_flush(fffs_vol);
+    if (fffs_vol->table_dirty)
+        fffs_checkpoint(fffs_vol);
+    fffs_index_delete(fffs_vol);
+    fffs_key_delete(fffs_vol);
+    fffs_forward_delete(fffs_vol);
+    free(fffs_vol->lz_window);
+    free(fffs_vol->lz_table);
+    free(fffs_vol->lz_out);
+    free(fffs_vol->read_window.buf);
+    heap_caps_free(fffs_vol->sector_table);
+    free(fffs_vol->stage_counts);
+    heap_caps_free(fffs_vol->stage_buf);
+    heap_caps_free(fffs_vol->sent_buf);
+    heap_caps_free(fffs_vol->read_buf);
+    free(fffs_vol);
+    return ESP_OK;
+}
+
+static esp_err_t fffs_update_table(fffs_volume_t *fffs_volume)
+{
+    const fffs_block_header_t *header = fffs_volume->tail_buf;
+
+    if (header->count == 0 && header->carry == 0)
+        return ESP_FAIL;
+
+    fffs_volume->sector_table->partition_sector_table.last_block = fffs_volume->last_block;
+    fffs_volume->sector_table->partition_sector_table.message_id = fffs_volume->message_id;
+    fffs_volume->sector_table->sector_message_index[fffs_volume->block_index] = fffs_volume->messages_in_block;
+    fffs_table_mark(fffs_volume->sector_table, fffs_volume->block_index, header);
+    fffs_volume->table_dirty = true; //Reaches the card with the next checkpoint
+
+    return ESP_OK;
+}
+
+/*
+ * Moves last_block to the next data block, opening a new sector at sector boundaries. At the end of the data
+ * blocks a message_rotate card wraps around to sector 0 in the next lap: its table is written again, over the
+ * oldest messages, and the rest of the sectors follow as the writer reaches them. Other cards are full.
+ */
+static esp_err_t fffs_next_block(fffs_volume_t *fffs_volume)
+{
+    uint32_t next = fffs_volume->last_block + 1;
+
+    if (next >= fffs_volume->data_blocks || (next % (SECTOR_SIZE) == 0 && next + 1 >= fffs_volume->data_blocks))
+    {
+        FFFS_CHECK(fffs_volume->message_rotate, "SD CARD is full.", fail);
+        fffs_volume->last_block = 0;
+        fffs_volume->current_partition = 0;
+        fffs_volume->epoch++;
+        ESP_LOGI(TAG, "Wrapping around to the start of the card, lap %d", fffs_volume->epoch);
+    }
+    else if (++fffs_volume->last_block % (fffs_volume->partition_size * (PARTITION_SIZE)) == 0)
+    {
+        fffs_update_partition_block(fffs_volume);
+    }
+
+    if (fffs_volume->last_block % (SECTOR_SIZE) == 0)
+    {
+        ESP_LOGI(TAG, "Creating new sector");
+        FFFS_CHECK(fffs_create_sector_block(fffs_volume) == ESP_OK, "Cannot open sector %d", fail, fffs_volume->last_block);
+        return fffs_next_block(fffs_volume);
+    }
+
+    if (fffs_volume->last_block % (BLOCKS_IN_SECTOR) == 0)
+    {
+        fffs_volume->block_index = (fffs_volume->last_block - fffs_volume->current_sector - 1) / BLOCKS_IN_SECTOR;
+        fffs_volume->messages_in_block = 0;
+
+        if (fffs_volume->table_dirty && fffs_volume->last_block - fffs_volume->checkpoint_block >= fffs_volume->config.checkpoint_blocks)
+            return fffs_checkpoint(fffs_volume); //Bounds the blocks a mount has to scan
+    }
+
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Records the message counts of the full stage slots in the sector table.
+ */
+static void fffs_stage_mark(fffs_volume_t *fffs_volume)
+{
+    for (uint32_t slot = 0; slot < fffs_volume->stage_slot; slot++)
+    {
+        uint32_t index = (fffs_volume->stage_block + slot - fffs_volume->current_sector - 1) / BLOCKS_IN_SECTOR;
+
+        fffs_volume->sector_table->sector_message_index[index] = fffs_volume->stage_counts[slot];
+        fffs_table_mark(fffs_volume->sector_table, index, (uint8_t *)fffs_volume->stage_buf + slot * SD_BLOCK_SIZE);
+    }
+}
+
+/*
+ * Waits for the blocks handed over by fffs_send to be written, after which sent_buf is free again. The lock is
+ * released meanwhile as in fffs_commit: readers copy the blocks from sent_buf until sent_count is cleared.
+ */
+static esp_err_t fffs_sent_wait(fffs_volume_t *fffs_volume)
+{
+    esp_err_t err;
+
+    if (fffs_volume->sent_count == 0)
+        return ESP_OK;
+
+    if (!fffs_volume->tail_split)
+        fffs_unlock(fffs_volume);
+    err = fffs_bdev_write_wait(fffs_volume->bdev);
+    if (!fffs_volume->tail_split)
+        fffs_lock(fffs_volume);
+    FFFS_CHECK(err == ESP_OK, "Cannot write blocks %d-%d", fail, fffs_volume->sent_block, fffs_volume->sent_block + fffs_volume->sent_count - 1);
+
+    fffs_volume->sent_count = 0;
+    return ESP_OK;
+
+fail:
+    fffs_volume->sent_count = 0; //The blocks are lost either way, the buffer is not held for them
+    return ESP_FAIL;
+}
+
+/*
+ * Hands the staged blocks, the tail included, to the device with write_start once they are all full and swaps
+ * the stage with sent_buf, so that the next blocks fill while they are written. The write started before is
+ * waited for to free sent_buf. The sector table is updated at once, it only reaches the card behind them.
+ */
+static esp_err_t fffs_send(fffs_volume_t *fffs_volume)
+{
+    void *buf;
+
+    fffs_stage_mark(fffs_volume); //Before the wait, readers locate the staged messages through the table
+    fffs_update_table(fffs_volume);
+    FFFS_CHECK(fffs_sent_wait(fffs_volume) == ESP_OK, "Cannot reuse stage buffer.", fail);
+
+    FFFS_CHECK(fffs_bdev_write_start(fffs_volume->bdev, fffs_volume->stage_buf, fffs_volume->stage_block, fffs_volume->stage_slot + 1) == ESP_OK,
+               "Cannot write blocks %d-%d", fail, fffs_volume->stage_block, fffs_volume->last_block);
+
+    buf = fffs_volume->sent_buf;
+    fffs_volume->sent_buf = fffs_volume->stage_buf;
+    fffs_volume->sent_block = fffs_volume->stage_block;
+    fffs_volume->sent_count = fffs_volume->stage_slot + 1;
+    fffs_volume->stage_buf = buf;
+    fffs_volume->tail_buf = buf;
+    fffs_volume->stage_block = fffs_volume->last_block + 1; //Past the sent blocks even if sent_count is cleared before fffs_next_tail moves it
+    fffs_volume->stage_slot = 0;
+    fffs_volume->tail_dirty = 0;
+    fffs_volume->tail_commit_time = esp_timer_get_time();
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Writes the staged blocks, from stage_block up to and including the tail, with one multi-block command and
+ * records their message counts in the sector table. The tail then moves back to the first stage slot.
+ * The volume lock is released during the write: the stage stays untouched and readers copy staged messages
+ * from RAM until stage_block moves past them. It is kept while a message spanning blocks is being appended.
+ */
+static esp_err_t fffs_commit(fffs_volume_t *fffs_volume)
+{
+    esp_err_t err;
+
+    fffs_stage_mark(fffs_volume);
+    FFFS_CHECK(fffs_sent_wait(fffs_volume) == ESP_OK, "Cannot commit after lost blocks.", fail);
+
+    if (fffs_volume->tail_dirty == 0 && fffs_volume->stage_slot == 0)
+        return ESP_OK;
+
+    if (!fffs_volume->tail_split)
+        fffs_unlock(fffs_volume);
+    err = fffs_bdev_write(fffs_volume->bdev, fffs_volume->stage_buf, fffs_volume->stage_block, fffs_volume->stage_slot + 1);
+    if (!fffs_volume->tail_split)
+        fffs_lock(fffs_volume);
+    FFFS_CHECK(err == ESP_OK, "Cannot write blocks %d-%d", fail, fffs_volume->stage_block, fffs_volume->last_block);
+
+    fffs_update_table(fffs_volume);
+
+    if (fffs_volume->stage_slot > 0)
+    {
+        memcpy(fffs_volume->stage_buf, fffs_volume->tail_buf, SD_BLOCK_SIZE);
+        fffs_volume->tail_buf = fffs_volume->stage_buf;
+        fffs_volume->stage_block = fffs_volume->last_block;
+        fffs_volume->stage_slot = 0;
+    }
+
+    fffs_volume->tail_dirty = 0;
+    fffs_volume->tail_commit_time = esp_timer_get_time();
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+static bool fffs_commit_due(fffs_volume_t *fffs_volume)
+{
+    if (fffs_volume->config.commit_messages > 0 && fffs_volume->tail_dirty >= fffs_volume->config.commit_messages)
+        return true;
+
+    if (fffs_volume->config.commit_interval_ms > 0 && esp_timer_get_time() - fffs_volume->tail_commit_time >= (int64_t)fffs_volume->config.commit_interval_ms * 1000)
+        return true;
+
+    return false;
+}
+
+esp_err_t fffs_flush(fffs_volume_t *fffs_volume)
+{
+    esp_err_t err;
+
+    fffs_lock(fffs_volume);
+    err = fffs_commit(fffs_volume);
+    if (err == ESP_OK)
+        err = fffs_key_flush(fffs_volume);
+    fffs_unlock(fffs_volume);
+
+    FFFS_CHECK(err == ESP_OK, "Cannot commit tail block or key index.", fail);
+    FFFS_CHECK(fffs_bdev_flush(fffs_volume->bdev) == ESP_OK, "Cannot flush block device.", fail);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Moves the tail to a new block. A batch keeps the full block in the stage and continues in the next slot, so long
+ * as the next block follows on the card in the same sector. Otherwise everything staged is committed first, or
+ * sent while the next blocks fill when the device can write in the background. Stages also end on multiples of
+ * batch_blocks, so that full stages line up with the stripe units of a striped device and the pages of the card.
+ */
+static esp_err_t fffs_next_tail(fffs_volume_t *fffs_volume, bool batch)
+{
+    bool stage = batch && fffs_volume->stage_slot + 1 < fffs_volume->config.batch_blocks &&
+                 (fffs_volume->last_block + 1) % fffs_volume->config.batch_blocks != 0 &&
+                 (fffs_volume->last_block + 1) % (SECTOR_SIZE) != 0 && fffs_volume->last_block + 1 < fffs_volume->data_blocks;
+
+    if (stage)
+        fffs_volume->stage_counts[fffs_volume->stage_slot] = fffs_volume->messages_in_block;
+    else if (fffs_volume->sent_buf != NULL)
+        FFFS_CHECK(fffs_send(fffs_volume) == ESP_OK, "Cannot write full blocks.", fail);
+    else
+        FFFS_CHECK(fffs_commit(fffs_volume) == ESP_OK, "Cannot commit tail block.", fail);
+
+    if (fffs_next_block(fffs_volume) == ESP_FAIL)
+        return ESP_FAIL;
+
+    if (stage)
+    {
+        fffs_volume->stage_slot++;
+        fffs_volume->tail_buf = (uint8_t *)fffs_volume->stage_buf + fffs_volume->stage_slot * SD_BLOCK_SIZE;
+    }
+    else
+    {
+        fffs_volume->stage_block = fffs_volume->last_block;
+    }
+
+    fffs_block_init(fffs_volume, fffs_volume->tail_buf);
+    fffs_volume->tail_offset = FFFS_BLOCK_DATA;
+    fffs_volume->tail_first_message = fffs_volume->message_id;
+
+    if (fffs_volume->lz_window != NULL)
+    {
+        fffs_lz_reset(fffs_volume->lz_table);
+        fffs_volume->lz_pos = 0;
+        fffs_volume->lz_hashed = 0;
+    }
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Appends a message that does not fit in the rest of the tail block. The first fragment fills the tail, prefixed
+ * by the size of the whole message, and the rest is carried by the next blocks, staged so that a batch of them
+ * reaches the card with one command.
+ */
+static esp_err_t fffs_append_split(fffs_volume_t *fffs_volume, const uint8_t *message, int size, int room, uint16_t flags)
+{
+    uint8_t *tail = fffs_volume->tail_buf;
+    fffs_block_header_t *header = (fffs_block_header_t *)tail;
+    uint32_t whole = size;
+    int done = room - sizeof(whole);
+    int len;
+
+    memcpy(tail + fffs_volume->tail_offset, &whole, sizeof(whole));
+    memcpy(tail + fffs_volume->tail_offset + sizeof(whole), message, done);
+    fffs_set_message_end(tail, header->count, (fffs_volume->tail_offset + room) | flags);
+    header->count++;
+    header->flags |= FFFS_BLOCK_CONTINUES;
+    header->time = fffs_volume->last_time;
+
+    fffs_volume->tail_offset += room;
+    fffs_volume->tail_dirty++;
+    fffs_volume->messages_in_block++;
+    fffs_volume->message_id++;
+    fffs_volume->tail_split = true;
+
+    for (; done < size; done += len)
+    {
+        FFFS_CHECK(fffs_next_tail(fffs_volume, true) == ESP_OK, "Cannot continue message %d", fail, fffs_volume->message_id - 1);
+
+        tail = fffs_volume->tail_buf;
+        header = (fffs_block_header_t *)tail;
+        len = size - done;
+        if (len > SD_BLOCK_SIZE - FFFS_BLOCK_DATA)
+        {
+            len = SD_BLOCK_SIZE - FFFS_BLOCK_DATA;
+            header->flags |= FFFS_BLOCK_CONTINUES;
+        }
+
+        memcpy(tail + FFFS_BLOCK_DATA, message + done, len);
+        header->carry = len;
+        header->time = fffs_volume->last_time;
+        fffs_volume->tail_offset = FFFS_BLOCK_DATA + len;
+        fffs_volume->tail_dirty++;
+    }
+
+    fffs_volume->tail_split = false;
+    return ESP_OK;
+
+fail:
+    fffs_volume->tail_split = false;
+    return ESP_FAIL;
+}
+
+/*
+ * Widens the key range and Bloom filter of summary to cover message.
+ */
+static void fffs_summary_add(fffs_volume_t *fffs_volume, fffs_sector_summary_t *summary, const uint8_t *message, int size)
+{
+    int32_t value;
+    uint32_t key;
+
+    if (size == 0)
+        return;
+
+    if (fffs_volume->config.value_key != NULL && fffs_volume->config.value_key(message, size, &value))
+    {
+        if (value < summary->value_min)
+            summary->value_min = value;
+        if (value > summary->value_max)
+            summary->value_max = value;
+    }
+
+    if (fffs_volume->config.filter_key != NULL && fffs_volume->config.filter_key(message, size, &key))
+        fffs_filter_add(summary->filter, key);
+}
+
+/*
+ * Adds message to the summary of the sector it starts in, the current one as the tail has been placed. The link
+ * of a keyed message is not part of its content. Copies are summarised where their message was first written.
+ */
+static void fffs_summarize(fffs_volume_t *fffs_volume, const uint8_t *message, int size, uint16_t flags)
+{
+    fffs_sector_summary_t *summary = &fffs_volume->sector_table->summary;
+
+    if (flags & FFFS_MESSAGE_COPY)
+        return;
+
+    if (flags & FFFS_MESSAGE_KEYED)
+    {
+        message += FFFS_KEY_LINK;
+        size -= FFFS_KEY_LINK;
+    }
+
+    summary->messages++;
+    summary->bytes += size;
+    fffs_summary_add(fffs_volume, summary, message, size);
+}
+
+/*
+ * Compresses message against the raw content of the tail block, keeping the result in lz_out if it is smaller
+ * than the message and at most cap bytes. Returns its size, 0 if the message is better stored raw.
+ */
+static int fffs_compress(fffs_volume_t *fffs_volume, const void *message, int size, int cap)
+{
+    if (fffs_volume->lz_window == NULL || size == 0 || fffs_volume->lz_pos + size > FFFS_COMPRESS_WINDOW)
+        return 0;
+
+    if (cap > size - 1)
+        cap = size - 1;
+    if (cap <= 0)
+        return 0;
+
+    memcpy(fffs_volume->lz_window + fffs_volume->lz_pos, message, size);
+    return fffs_lz_compress(fffs_volume->lz_window, fffs_volume->lz_pos, fffs_volume->lz_pos + size, fffs_volume->lz_table,
+                            &fffs_volume->lz_hashed, fffs_volume->lz_out, cap);
+}
+
+static void fffs_append_record(fffs_volume_t *fffs_volume, const void *data, int size, uint16_t flags)
+{
+    uint8_t *tail = fffs_volume->tail_buf;
+    fffs_block_header_t *header = (fffs_block_header_t *)tail;
+    int i = fffs_volume->tail_offset;
+
+    if (size > 0)
+        memcpy(tail + i, data, size);
+    i = i + size;
+    fffs_set_message_end(tail, header->count, i | flags);
+
+    fffs_volume->tail_offset = i;
+    header->count++;
+    header->time = fffs_volume->last_time;
+    fffs_volume->tail_dirty++;
+    fffs_volume->messages_in_block++;
+    fffs_volume->message_id++;
+}
+
+/*
+ * Stores message compressed in the tail block, or in a new one if it does not fit in the rest of the tail even
+ * when compressed. Returns false if the message is to be stored raw.
+ */
+static bool fffs_append_compressed(fffs_volume_t *fffs_volume, const void *message, int size, uint16_t flags, bool batch, esp_err_t *err)
+{
+    int room = SD_BLOCK_SIZE - (fffs_volume->messages_in_block + 1) * sizeof(uint16_t) - fffs_volume->tail_offset;
+    int packed = fffs_volume->messages_in_block == UINT8_MAX ? 0 : fffs_compress(fffs_volume, message, size, room);
+
+    if (packed == 0 && (size > room || fffs_volume->messages_in_block == UINT8_MAX) && fffs_volume->tail_offset > FFFS_BLOCK_DATA)
+    {
+        *err = fffs_next_tail(fffs_volume, batch); //Compressed against an empty block it may still fit in one
+        if (*err != ESP_OK)
+            return true;
+
+        packed = fffs_compress(fffs_volume, message, size, FFFS_MESSAGE_MAX);
+    }
+
+    if (packed == 0)
+        return false;
+
+    fffs_summarize(fffs_volume, message, size, flags);
+    fffs_append_record(fffs_volume, fffs_volume->lz_out, packed, FFFS_MESSAGE_COMPRESSED | flags);
+    ((fffs_block_header_t *)fffs_volume->tail_buf)->flags |= FFFS_BLOCK_COMPRESSED;
+    fffs_volume->lz_pos += size;
+    *err = ESP_OK;
+    return true;
+}
+
+/*
+ * Reads the clock for the message about to be appended. Should the clock go back the stamps are held at the last
+ * value so that they stay ordered.
+ */
+static void fffs_stamp(fffs_volume_t *fffs_volume)
+{
+    uint32_t now = fffs_volume->config.clock != NULL ? fffs_volume->config.clock() : (uint32_t)time(NULL);
+
+    if (now > fffs_volume->last_time)
+        fffs_volume->last_time = now;
+}
+
+/*
+ * Appends message with the trailer flags given, FFFS_MESSAGE_KEYED if it starts with a key link and
+ * FFFS_MESSAGE_COPY if it starts with the id of the message it is a copy of. Copies are stored raw.
+ */
+static esp_err_t fffs_append(fffs_volume_t *fffs_volume, const void *message, int size, uint16_t flags, bool batch)
+{
+    esp_err_t err;
+
+    fffs_stamp(fffs_volume);
+
+    if (fffs_volume->lz_window != NULL && !(flags & FFFS_MESSAGE_COPY) && fffs_append_compressed(fffs_volume, message, size, flags, batch, &err))
+        return err;
+
+    int i = fffs_volume->tail_offset;
+    int room = SD_BLOCK_SIZE - (fffs_volume->messages_in_block + 1) * sizeof(uint16_t) - i; //Data that fits with its trailer entry
+    int fragment_min = sizeof(uint32_t) + (flags & FFFS_MESSAGE_KEYED ? FFFS_KEY_LINK : 0) + (flags & FFFS_MESSAGE_COPY ? FFFS_COPY_ID : 0); //The id and link stay in the first block
+    bool split = size > room && (fffs_volume->config.pack_messages || size > FFFS_MESSAGE_MAX);
+
+    if (fffs_volume->messages_in_block == UINT8_MAX || (size > room && !(split && room > fragment_min))) //sector_message_index counts up to 255
+    {
+        if (fffs_next_tail(fffs_volume, batch) != ESP_OK)
+            return ESP_FAIL;
+
+        i = FFFS_BLOCK_DATA;
+        room = FFFS_MESSAGE_MAX;
+        split = size > room;
+    }
+
+    fffs_summarize(fffs_volume, message, size, flags);
+    if (split)
+        return fffs_append_split(fffs_volume, message, size, room, flags);
+
+    fffs_append_record(fffs_volume, message, size, flags);
+
+    if (fffs_volume->lz_window != NULL && fffs_volume->lz_pos + size <= FFFS_COMPRESS_WINDOW) //Later messages can refer back to it
+    {
+        memcpy(fffs_volume->lz_window + fffs_volume->lz_pos, message, size);
+        fffs_volume->lz_pos += size;
+    }
+
+    return ESP_OK;
+}
+
+static esp_err_t fffs_key_slot(fffs_volume_t *fffs_vol, uint64_t key, fffs_key_cache_t **entry, uint32_t *slot);
+
+/*
+ * Appends a message and, when key is not NULL, links it to the previous message with that key and makes it the
+ * newest one in the key index. A key that finds no room in the index gets a message without a link.
+ */
+static esp_err_t fffs_write_message(fffs_volume_t *fffs_volume, void *message, int size, const uint64_t *key)
+{
+    int max = fffs_volume->config.message_max - (key != NULL ? FFFS_KEY_LINK : 0);
+
+    if (size > max || size == 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    esp_err_t err = ESP_OK;
+    fffs_key_cache_t *entry = NULL;
+    uint32_t message_id, slot, prev;
+    uint16_t flags = 0;
+
+    fffs_lock(fffs_volume);
+    if (key != NULL)
+    {
+        err = fffs_key_slot(fffs_volume, *key, &entry, &slot);
+        if (err == ESP_OK)
+        {
+            prev = slot < entry->bucket->count ? entry->bucket->message_ids[slot] : FFFS_KEY_NONE;
+            memcpy(fffs_volume->key_record, &prev, FFFS_KEY_LINK);
+            memcpy(fffs_volume->key_record + FFFS_KEY_LINK, message, size);
+            message = fffs_volume->key_record;
+            size += FFFS_KEY_LINK;
+            flags = FFFS_MESSAGE_KEYED;
+        }
+        else if (err != ESP_ERR_NO_MEM)
+        {
+            fffs_unlock(fffs_volume);
+            return err;
+        }
+    }
+
+    message_id = fffs_volume->message_id;
+    if (fffs_append(fffs_volume, message, size, flags, false) != ESP_OK)
+    {
+        err = ESP_FAIL;
+    }
+    else
+    {
+        if (flags & FFFS_MESSAGE_KEYED)
+        {
+            if (slot == entry->bucket->count)
+                entry->bucket->count++;
+            entry->bucket->keys[slot] = *key;
+            entry->bucket->message_ids[slot] = message_id;
+            entry->dirty = true;
+        }
+        bool due = fffs_commit_due(fffs_volume);
+
+        if ((fffs_volume->stage_slot > 0 || fffs_volume->tail_first_message > message_id || due) &&
+            fffs_commit(fffs_volume) != ESP_OK) //A message spanning blocks is committed at once, even if its first blocks left with a full stage
+            err = ESP_FAIL;
+        else if (due && fffs_key_flush(fffs_volume) != ESP_OK) //Keys follow the commit cadence of their messages
+            err = ESP_FAIL;
+    }
+    fffs_unlock(fffs_volume);
+
+    return err;
+}
+
+esp_err_t fffs_write(fffs_volume_t *fffs_volume, void *message, int size)
+{
+    return fffs_write_message(fffs_volume, message, size, NULL);
+}
+
+esp_err_t fffs_write_key(fffs_volume_t *fffs_volume, void *message, int size, uint64_t key)
+{
+    if (fffs_volume->key_blocks == 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    return fffs_write_message(fffs_volume, message, size, &key);
+}
+
+esp_err_t fffs_write_batch(fffs_volume_t *fffs_volume, const fffs_message_t *messages, size_t count, uint32_t *first_id)
+{
+    FFFS_CHECK(messages != NULL || count == 0, "Messages are NULL.", invalid);
+
+    for (size_t m = 0; m < count; m++)
+    {
+        if (messages[m].size > fffs_volume->config.message_max || messages[m].size < 0 || (messages[m].size > 0 && messages[m].data == NULL))
+            return ESP_ERR_INVALID_SIZE;
+    }
+
+    esp_err_t err = ESP_OK;
+
+    fffs_lock(fffs_volume);
+    if (first_id != NULL)
+        *first_id = fffs_volume->message_id;
+
+    for (size_t m = 0; m < count; m++)
+        FFFS_CHECK(fffs_append(fffs_volume, messages[m].data, messages[m].size, 0, true) == ESP_OK, "Cannot append message %u of batch", fail, (unsigned)m);
+
+    err = fffs_commit(fffs_volume);
+    fffs_unlock(fffs_volume);
+    return err;
+
+fail:
+    fffs_commit(fffs_volume); //Whatever was appended keeps its id
+    fffs_unlock(fffs_volume);
+    return ESP_FAIL;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static void fffs_key_reset(fffs_volume_t *fffs_vol)
+{
+    if (fffs_vol->key_cache == NULL)
+        return;
+
+    for (uint32_t i = 0; i < fffs_vol->config.key_cache_buckets; i++)
+    {
+        fffs_vol->key_cache[i].block = UINT32_MAX;
+        fffs_vol->key_cache[i].dirty = false;
+    }
+}
+
+static esp_err_t fffs_key_create(fffs_volume_t *fffs_vol)
+{
+    fffs_vol->key_record = malloc(fffs_vol->config.message_max);
+    FFFS_CHECK(fffs_vol->key_record, "Cannot create key record buffer", fail);
+
+    fffs_vol->key_cache = calloc(fffs_vol->config.key_cache_buckets, sizeof(fffs_key_cache_t));
+    FFFS_CHECK(fffs_vol->key_cache, "Cannot create key cache", fail);
+
+    for (uint32_t i = 0; i < fffs_vol->config.key_cache_buckets; i++)
+    {
+        fffs_vol->key_cache[i].block = UINT32_MAX;
+        fffs_vol->key_cache[i].bucket = heap_caps_malloc(SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+        FFFS_CHECK(fffs_vol->key_cache[i].bucket, "Cannot create key cache", fail);
+    }
+
+    return ESP_OK;
+
+fail:
+    fffs_key_delete(fffs_vol);
+    return ESP_FAIL;
+}
+
+static void fffs_key_delete(fffs_volume_t *fffs_vol)
+{
+    free(fffs_vol->key_record);
+    fffs_vol->key_record = NULL;
+
+    if (fffs_vol->key_cache == NULL)
+        return;
+
+    for (uint32_t i = 0; i < fffs_vol->config.key_cache_buckets; i++)
+        heap_caps_free(fffs_vol->key_cache[i].bucket);
+
+    free(fffs_vol->key_cache);
+    fffs_vol->key_cache = NULL;
+}
+
+static uint32_t fffs_key_home(fffs_volume_t *fffs_vol, uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xFF51AFD7ED558CCDULL;
+    key ^= key >> 33;
+    key *= 0xC4CEB9FE1A85EC53ULL;
+    key ^= key >> 33;
+
+    return key % fffs_vol->key_blocks;
+}
+
+/*
+ * Writes a cached bucket back. The messages it points at are committed first so that after a power loss no key
+ * refers to an id that is then given to another message. Only the first of the buckets written back together
+ * pays for the commit.
+ */
+static esp_err_t fffs_key_write_back(fffs_volume_t *fffs_vol, fffs_key_cache_t *entry)
+{
+    if (fffs_vol->tail_dirty > 0 || fffs_vol->stage_slot > 0)
+        FFFS_CHECK(fffs_commit(fffs_vol) == ESP_OK, "Cannot commit tail block.", fail);
+
+    FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, entry->bucket, entry->block, 1) == ESP_OK, "Cannot write key bucket %d", fail, entry->block);
+    entry->dirty = false;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+static esp_err_t fffs_key_flush(fffs_volume_t *fffs_vol)
+{
+    if (fffs_vol->key_cache == NULL)
+        return ESP_OK;
+
+    for (uint32_t i = 0; i < fffs_vol->config.key_cache_buckets; i++)
+    {
+        if (fffs_vol->key_cache[i].dirty)
+            FFFS_CHECK(fffs_key_write_back(fffs_vol, &fffs_vol->key_cache[i]) == ESP_OK, "Cannot write key index", fail);
+    }
+
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+static void fffs_key_load(fffs_volume_t *fffs_vol, fffs_key_bucket_t *bucket)
+{
+    if (bucket->volume_id != fffs_vol->volume_id)
+    {
+        memset(bucket, 0, SD_BLOCK_SIZE);
+        bucket->volume_id = fffs_vol->volume_id;
+    }
+    else if (bucket->count > FFFS_KEY_ENTRIES)
+    {
+        bucket->count = FFFS_KEY_ENTRIES;
+    }
+}
+
+/*
+ * Returns the cache entry of bucket index, read into the least recently used clean entry. Dirty entries are not
+ * written back one at a time: when every entry is dirty they all are, behind a single commit.
+ */
+static fffs_key_cache_t *fffs_key_bucket(fffs_volume_t *fffs_vol, uint32_t index)
+{
+    uint32_t block = fffs_vol->data_blocks + index;
+    fffs_key_cache_t *victim = NULL, *oldest;
+
+    if (fffs_vol->key_cache == NULL && fffs_key_create(fffs_vol) != ESP_OK)
+        return NULL;
+
+    oldest = &fffs_vol->key_cache[0];
+    for (uint32_t i = 0; i < fffs_vol->config.key_cache_buckets; i++)
+    {
+        fffs_key_cache_t *entry = &fffs_vol->key_cache[i];
+
+        if (entry->block == block)
+        {
+            entry->used = ++fffs_vol->key_clock;
+            return entry;
+        }
+
+        if (entry->used < oldest->used)
+            oldest = entry;
+        if (!entry->dirty && (victim == NULL || entry->used < victim->used))
+            victim = entry;
+    }
+
+    if (victim == NULL)
+    {
+        FFFS_CHECK(fffs_key_flush(fffs_vol) == ESP_OK, "Cannot write key index", fail);
+        victim = oldest;
+    }
+
+    victim->block = UINT32_MAX;
+    FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, victim->bucket, block, 1) == ESP_OK, "Cannot read key bucket %d", fail, block);
+    fffs_key_load(fffs_vol, victim->bucket);
+
+    victim->block = block;
+    victim->used = ++fffs_vol->key_clock;
+    return victim;
+
+fail:
+    return NULL;
+}
+
+/*
+ * Finds the entry of key in its buckets: the slot holding it, or the first free one should it be new. Returns
+ * ESP_ERR_NO_MEM if neither is found in FFFS_KEY_PROBES buckets.
+ */
+static esp_err_t fffs_key_slot(fffs_volume_t *fffs_vol, uint64_t key, fffs_key_cache_t **entry, uint32_t *slot)
+{
+    uint32_t index = fffs_key_home(fffs_vol, key);
+    fffs_key_bucket_t *bucket;
+
+    for (int probe = 0; probe < FFFS_KEY_PROBES; probe++, index = (index + 1) % fffs_vol->key_blocks)
+    {
+        *entry = fffs_key_bucket(fffs_vol, index);
+        FFFS_CHECK(*entry, "Cannot load key bucket %d", fail, index);
+
+        bucket = (*entry)->bucket;
+        for (*slot = 0; *slot < bucket->count; (*slot)++)
+        {
+            if (bucket->keys[*slot] == key)
+                return ESP_OK;
+        }
+
+        if (bucket->count < FFFS_KEY_ENTRIES) //Keys are never removed, so the key is in no later bucket
+            return ESP_OK;
+    }
+
+    ESP_LOGW(TAG, "Key index is full around bucket %d, message %d is written without its key.", fffs_key_home(fffs_vol, key), fffs_vol->message_id);
+    return ESP_ERR_NO_MEM;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Reads the key link of message_id, the id of the message with the same key before it, and tells whether the
+ * message is still live. Erased messages keep their link. Called with the volume lock held.
+ */
+static esp_err_t fffs_key_prev(fffs_volume_t *fffs_vol, uint32_t message_id, uint32_t *prev, bool *live)
+{
+    uint32_t block, k;
+    uint8_t *buf;
+    uint16_t offset;
+    int size, start;
+    esp_err_t err = fffs_message_at(fffs_vol, message_id, &block, &k, &buf);
+
+    if (err != ESP_OK)
+        return err;
+
+    FFFS_CHECK(fffs_message_keyed(buf, k), "Message %d has no key link", fail, message_id);
+    *live = !fffs_message_erased(buf, k);
+
+    if (fffs_message_compressed(buf, k))
+    {
+        start = fffs_window_decode(&fffs_vol->read_window, buf, block, k);
+        FFFS_CHECK(start >= 0 && fffs_vol->read_window.pos - start >= (int)FFFS_KEY_LINK, "Message %d is damaged", fail, message_id);
+        memcpy(prev, fffs_vol->read_window.buf + start, FFFS_KEY_LINK);
+        return ESP_OK;
+    }
+
+    FFFS_CHECK(fffs_message_stored(buf, k, &offset, &size) && size >= fffs_message_prefix(buf, k), "Message %d is damaged", fail, message_id);
+    memcpy(prev, buf + offset + fffs_message_prefix(buf, k) - FFFS_KEY_LINK, FFFS_KEY_LINK); //Past the id of a copy
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Lookups leave the cache as it is: a bucket missing from it is read into read_buf, so a reader never has to write
+ * a bucket back or commit on behalf of the writer.
+ */
+esp_err_t fffs_lookup_key(fffs_volume_t *fffs_vol, uint64_t key, bool (*found)(uint32_t message_id, void *ctx), void *ctx)
+{
+    const fffs_key_bucket_t *bucket;
+    uint32_t index, message_id = FFFS_KEY_NONE, prev, matches = 0;
+    esp_err_t err = ESP_FAIL;
+    bool live;
+
+    FFFS_CHECK(fffs_vol && found, "Volume or callback is NULL.", invalid);
+    if (fffs_vol->key_blocks == 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    index = fffs_key_home(fffs_vol, key);
+    fffs_lock(fffs_vol);
+    for (int probe = 0; probe < FFFS_KEY_PROBES && message_id == FFFS_KEY_NONE; probe++, index = (index + 1) % fffs_vol->key_blocks)
+    {
+        uint32_t block = fffs_vol->data_blocks + index;
+
+        bucket = NULL;
+        for (uint32_t i = 0; fffs_vol->key_cache != NULL && i < fffs_vol->config.key_cache_buckets; i++)
+        {
+            if (fffs_vol->key_cache[i].block == block)
+                bucket = fffs_vol->key_cache[i].bucket;
+        }
+
+        if (bucket == NULL)
+        {
+            FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, fffs_vol->read_buf, block, 1) == ESP_OK, "Cannot read key bucket %d", unlock, block);
+            fffs_key_load(fffs_vol, fffs_vol->read_buf);
+            bucket = fffs_vol->read_buf;
+        }
+
+        for (uint32_t i = 0; i < bucket->count; i++)
+        {
+            if (bucket->keys[i] == key)
+                message_id = bucket->message_ids[i];
+        }
+
+        if (bucket->count < FFFS_KEY_ENTRIES)
+            break;
+    }
+    fffs_unlock(fffs_vol);
+
+    while (message_id < fffs_vol->message_id && !fffs_message_gone(fffs_vol, message_id)) //The link of a dropped message is lost with it
+    {
+        fffs_lock(fffs_vol);
+        err = fffs_key_prev(fffs_vol, message_id, &prev, &live);
+        fffs_unlock(fffs_vol);
+        if (err == ESP_ERR_NOT_FOUND)
+            break;
+        if (err != ESP_OK)
+            return ESP_FAIL;
+
+        if (live)
+        {
+            matches++;
+            if (!found(message_id, ctx))
+                break;
+        }
+
+        if (prev != FFFS_KEY_NONE && prev >= message_id)
+        {
+            ESP_LOGE(TAG, "Key link of message %d is damaged", message_id);
+            return ESP_FAIL;
+        }
+        message_id = prev;
+    }
+
+    return matches > 0 ? ESP_OK : ESP_ERR_NOT_FOUND;
+
+unlock:
+    fffs_unlock(fffs_vol);
+    return err;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static void fffs_forward_delete(fffs_volume_t *fffs_vol)
+{
+    heap_caps_free(fffs_vol->forward);
+    free(fffs_vol->copy_record);
+    heap_caps_free(fffs_vol->compact_buf);
+    fffs_vol->forward = NULL;
+    fffs_vol->copy_record = NULL;
+    fffs_vol->compact_buf = NULL;
+    fffs_vol->forward_count = 0;
+}
+
+/*
+ * Reads the forwarding table into RAM, allocating it along with the buffers of fffs_replace and fffs_compact.
+ * Entries out of order or pointing past the write head, whose copy was lost with the tail, are dropped. The
+ * compaction hints start over.
+ */
+static esp_err_t fffs_forward_load(fffs_volume_t *fffs_vol)
+{
+    fffs_forward_block_t *block = fffs_vol->read_buf;
+
+    for (int i = 0; i < FFFS_COMPACT_HINTS; i++)
+    {
+        fffs_vol->compact_hints[i].sector = UINT32_MAX;
+        fffs_vol->compact_hints[i].dead = 0;
+    }
+
+    fffs_forward_delete(fffs_vol);
+    if (fffs_vol->forward_blocks == 0)
+        return ESP_OK;
+
+    fffs_vol->forward = heap_caps_malloc(fffs_vol->forward_blocks * FFFS_FORWARD_ENTRIES * sizeof(fffs_forward_t), fffs_vol->config.index_caps);
+    fffs_vol->copy_record = malloc(fffs_vol->config.message_max + FFFS_COPY_ID);
+    fffs_vol->compact_buf = heap_caps_malloc(fffs_read_blocks(fffs_vol) * SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+    FFFS_CHECK(fffs_vol->forward && fffs_vol->copy_record && fffs_vol->compact_buf, "Cannot create forwarding table", fail);
+
+    for (uint32_t i = 0; i < fffs_vol->forward_blocks; i++)
+    {
+        uint32_t block_num = fffs_vol->data_blocks + fffs_vol->key_blocks + i;
+
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, block, block_num, 1) == ESP_OK, "Cannot read forwarding block %d", fail, block_num);
+        if (block->volume_id != fffs_vol->volume_id) //Left by an earlier format
+            break;
+
+        for (uint32_t e = 0; e < block->count && e < FFFS_FORWARD_ENTRIES; e++)
+        {
+            const fffs_forward_t *entry = &block->entries[e];
+
+            if (entry->id < entry->copy && entry->copy < fffs_vol->message_id &&
+                (fffs_vol->forward_count == 0 || fffs_vol->forward[fffs_vol->forward_count - 1].id < entry->id))
+                fffs_vol->forward[fffs_vol->forward_count++] = *entry;
+        }
+
+        if (block->count < FFFS_FORWARD_ENTRIES)
+            break;
+    }
+
+    return ESP_OK;
+
+fail:
+    fffs_forward_delete(fffs_vol);
+    return ESP_FAIL;
+}
+
+/*
+ * Writes the forwarding table back from the block holding entry first, up to the block after the last full one so
+ * that it ends the table. The copies it points at are committed first, as with the key index.
+ */
+static esp_err_t fffs_forward_write(fffs_volume_t *fffs_vol, uint32_t first)
+{
+    fffs_forward_block_t *block = fffs_vol->read_buf;
+    uint32_t last = fffs_vol->forward_count / FFFS_FORWARD_ENTRIES;
+
+    if (last >= fffs_vol->forward_blocks)
+        last = fffs_vol->forward_blocks - 1;
+
+    if (fffs_vol->tail_dirty > 0 || fffs_vol->stage_slot > 0)
+        FFFS_CHECK(fffs_commit(fffs_vol) == ESP_OK, "Cannot commit tail block.", fail);
+
+    for (uint32_t i = first / FFFS_FORWARD_ENTRIES; i <= last; i++)
+    {
+        uint32_t from = i * FFFS_FORWARD_ENTRIES;
+        uint32_t block_num = fffs_vol->data_blocks + fffs_vol->key_blocks + i;
+
+        block->volume_id = fffs_vol->volume_id;
+        block->count = fffs_vol->forward_count > from ? fffs_vol->forward_count - from : 0;
+        if (block->count > FFFS_FORWARD_ENTRIES)
+            block->count = FFFS_FORWARD_ENTRIES;
+        memcpy(block->entries, fffs_vol->forward + from, block->count * sizeof(fffs_forward_t));
+        FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, block, block_num, 1) == ESP_OK, "Cannot write forwarding block %d", fail, block_num);
+    }
+
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Tells whether the forwarding table has no room for a new entry for message_id.
+ */
+static inline bool fffs_forward_full(const fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    return fffs_vol->forward_count == fffs_vol->forward_blocks * FFFS_FORWARD_ENTRIES && fffs_forward(fffs_vol, message_id) == message_id;
+}
+
+/*
+ * Forwards message_id to copy, the table having room, and returns the index of the entry.
+ */
+static uint32_t fffs_forward_set(fffs_volume_t *fffs_vol, uint32_t message_id, uint32_t copy)
+{
+    uint32_t i = fffs_forward_find(fffs_vol, message_id);
+
+    if (i == fffs_vol->forward_count || fffs_vol->forward[i].id != message_id)
+    {
+        memmove(&fffs_vol->forward[i + 1], &fffs_vol->forward[i], (fffs_vol->forward_count - i) * sizeof(fffs_forward_t));
+        fffs_vol->forward[i].id = message_id;
+        fffs_vol->forward_count++;
+    }
+
+    fffs_vol->forward[i].copy = copy;
+    return i;
+}
+
+/*
+ * Removes the entries of messages that are gone, of copies that are, and of copies from from up to to, excluded.
+ */
+static void fffs_forward_prune(fffs_volume_t *fffs_vol, uint32_t from, uint32_t to)
+{
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < fffs_vol->forward_count; i++)
+    {
+        const fffs_forward_t *entry = &fffs_vol->forward[i];
+
+        if (!fffs_message_gone(fffs_vol, entry->id) && !fffs_message_gone(fffs_vol, entry->copy) && (entry->copy < from || entry->copy >= to))
+            fffs_vol->forward[n++] = *entry;
+    }
+
+    fffs_vol->forward_count = n;
+}
+
+static void fffs_index_reset(fffs_volume_t *fffs_vol)
+{
+    for (uint32_t i = 0; i < fffs_vol->index_entries; i++)
+        fffs_vol->index_first[i] = UINT32_MAX;
+
+    for (uint32_t i = 0; i < fffs_vol->config.index_cache_sectors; i++)
+        fffs_vol->index_cache[i].sector = UINT32_MAX;
+}
+
+static void fffs_index_set(fffs_volume_t *fffs_vol, uint32_t sector, uint32_t first_message)
+{
+    uint32_t ordinal = sector / (SECTOR_SIZE);
+
+    if ((ordinal & ((1 << fffs_vol->index_shift) - 1)) == 0 && (ordinal >> fffs_vol->index_shift) < fffs_vol->index_entries)
+        fffs_vol->index_first[ordinal >> fffs_vol->index_shift] = first_message;
+}
+
+static fffs_sector_table_t *fffs_index_table(fffs_volume_t *fffs_vol, uint32_t sector)
+{
+    fffs_index_cache_t *victim = &fffs_vol->index_cache[0];
+
+    if (sector == fffs_vol->current_sector)
+        return fffs_vol->sector_table;
+
+    for (uint32_t i = 0; i < fffs_vol->config.index_cache_sectors; i++)
+    {
+        if (fffs_vol->index_cache[i].sector == sector)
+        {
+            fffs_vol->index_cache[i].used = ++fffs_vol->index_clock;
+            return fffs_vol->index_cache[i].table;
+        }
+
+        if (fffs_vol->index_cache[i].used < victim->used)
+            victim = &fffs_vol->index_cache[i];
+    }
+
+    victim->sector = UINT32_MAX;
+    FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, victim->table, sector, 1) == ESP_OK, "Cannot read sector %d", fail, sector);
+    FFFS_CHECK(victim->table->partition_sector_table.magic_number == FFFS_MAGIC_NUMBER, "No sector table at block %d", fail, sector);
+
+    victim->sector = sector;
+    victim->used = ++fffs_vol->index_clock;
+    fffs_index_set(fffs_vol, sector, victim->table->first_message);
+    return victim->table;
+
+fail:
+    return NULL;
+}
+
+static uint32_t fffs_index_first(fffs_volume_t *fffs_vol, uint32_t ordinal)
+{
+    fffs_sector_table_t *table;
+
+    if ((ordinal & ((1 << fffs_vol->index_shift) - 1)) == 0 && fffs_vol->index_first[ordinal >> fffs_vol->index_shift] != UINT32_MAX)
+        return fffs_vol->index_first[ordinal >> fffs_vol->index_shift];
+
+    table = fffs_index_table(fffs_vol, ordinal * (SECTOR_SIZE));
+    return table == NULL ? UINT32_MAX : table->first_message;
+}
+
+/*
+ * Physical ordinal of the sector ordinal sectors after the oldest one. A ring holds its sectors in order from
+ * oldest_sector to the end of the card and then from sector 0 to the write head.
+ */
+static inline uint32_t fffs_sector_ordinal(const fffs_volume_t *fffs_vol, uint32_t ordinal)
+{
+    return (fffs_vol->oldest_sector / (SECTOR_SIZE) + ordinal) % fffs_sector_count(fffs_vol);
+}
+
+/*
+ * Ordinal of the current sector counted from the oldest one.
+ */
+static inline uint32_t fffs_sector_head(const fffs_volume_t *fffs_vol)
+{
+    return (fffs_vol->current_sector / (SECTOR_SIZE) + fffs_sector_count(fffs_vol) - fffs_vol->oldest_sector / (SECTOR_SIZE)) % fffs_sector_count(fffs_vol);
+}
+
+/*
+ * Last index of sector_message_index in use once sector is sealed. The last sector of the card may be short.
+ */
+static inline uint32_t fffs_sector_last_index(const fffs_volume_t *fffs_vol, uint32_t sector)
+{
+    uint32_t end = sector + (SECTOR_SIZE) < fffs_vol->data_blocks ? sector + (SECTOR_SIZE) : fffs_vol->data_blocks;
+
+    return (end - sector - 2) / BLOCKS_IN_SECTOR;
+}
+
+/*
+ * Finds the data block holding message_num. Sealed sectors are located by a binary search over their
+ * first_message, in the order they were written from the oldest one, probing indexed sectors first so that only
+ * the last few steps may need a sector table from the card. The block inside the sector comes from the prefix
+ * sum of its sector_message_index. Messages written over by a ring are not found.
+ */
+static esp_err_t fffs_locate(fffs_volume_t *fffs_vol, uint32_t message_num, uint32_t *block, uint32_t *first_message)
+{
+    uint32_t stride = 1 << fffs_vol->index_shift;
+    uint32_t lo = 0;
+    uint32_t hi = fffs_sector_head(fffs_vol);
+    uint32_t sector = fffs_vol->current_sector;
+    uint32_t last_index;
+    fffs_sector_table_t *table = fffs_vol->sector_table;
+
+    if (message_num < fffs_vol->oldest_message_id)
+        return ESP_ERR_NOT_FOUND;
+
+    if (message_num >= fffs_vol->tail_first_message)
+    {
+        *block = fffs_vol->last_block;
+        *first_message = fffs_vol->tail_first_message;
+        return ESP_OK;
+    }
+
+    if (message_num < table->first_message)
+    {
+        while (hi - lo > 1) //first_message(lo) <= message_num < first_message(hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            uint32_t ordinal = fffs_sector_ordinal(fffs_vol, mid);
+            uint32_t first;
+
+            if ((ordinal & (stride - 1)) < mid - lo) //Indexed sectors need no card read
+            {
+                mid -= ordinal & (stride - 1);
+                ordinal &= ~(stride - 1);
+            }
+
+            first = fffs_index_first(fffs_vol, ordinal);
+            FFFS_CHECK(first != UINT32_MAX, "Cannot read sector %d", fail, ordinal * (SECTOR_SIZE));
+
+            if (first <= message_num)
+                lo = mid;
+            else
+                hi = mid;
+        }
+
+        sector = fffs_sector_ordinal(fffs_vol, lo) * (SECTOR_SIZE);
+        table = fffs_index_table(fffs_vol, sector);
+        FFFS_CHECK(table, "Cannot read sector %d", fail, sector);
+        last_index = fffs_sector_last_index(fffs_vol, sector);
+    }
+    else
+    {
+        last_index = fffs_vol->block_index;
+    }
+
+    uint32_t base = table->first_message;
+    uint32_t i = 0;
+    while (i < last_index && base + table->sector_message_index[i] <= message_num)
+        base += table->sector_message_index[i++];
+
+    *block = sector + 1 + i * BLOCKS_IN_SECTOR;
+    *first_message = base;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Copies message k of block, card block block_num, to message. Compressed messages are decoded through window.
+ * Only the first fragment of a message continuing in the next blocks is copied, *total is then set to the size
+ * of the whole message and otherwise to *size. Nothing is copied if the whole message is larger than cap, and
+ * messages larger than message_max, or than a copy of one, are refused. The key link of a keyed message and the
+ * id of a copy are left out unless record is set, as when compaction moves the message on.
+ */
+static bool fffs_message_copy(fffs_volume_t *fffs_vol, const uint8_t *block, uint32_t block_num, uint32_t k, fffs_window_t *window, uint8_t *message, int cap, int *size, int *total, bool record)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
+    int link = record ? 0 : fffs_message_prefix(block, k);
+    int max = fffs_vol->config.message_max + (fffs_message_copied(block, k) ? FFFS_COPY_ID : 0);
+    uint16_t offset;
+    uint32_t whole;
+    int start;
+
+    if (!fffs_block_message(block, k, &offset, size))
+        return false;
+
+    if (fffs_message_compressed(block, k))
+    {
+        start = fffs_window_decode(window, block, block_num, k);
+        if (start < 0 || window->pos - start < link || window->pos - start > max)
+            return false;
+
+        start += link;
+        *size = *total = window->pos - start;
+        if (message != NULL && *total <= cap)
+            memcpy(message, window->buf + start, *size);
+        return true;
+    }
+
+    *total = *size;
+    if ((header->flags & FFFS_BLOCK_CONTINUES) && k + 1 == header->count)
+    {
+        if (*size < (int)sizeof(whole))
+            return false;
+
+        memcpy(&whole, block + offset, sizeof(whole));
+        offset += sizeof(whole);
+        *size -= sizeof(whole);
+        if (whole <= (uint32_t)*size || whole > INT32_MAX)
+            return false;
+
+        *total = whole;
+    }
+
+    if (*total > max || *size < link)
+        return false;
+
+    offset += link;
+    *size -= link;
+    *total -= link;
+
+    if (message != NULL && *total <= cap)
+        memcpy(message, block + offset, *size);
+
+    return true;
+}
+
+/*
+ * Appends the fragment carried by block to message. Returns false if block does not continue the message
+ * started before next_message, the first_message stamp every block carrying it has.
+ */
+static bool fffs_fragment_copy(fffs_volume_t *fffs_vol, const uint8_t *block, uint32_t next_message, uint8_t *message, int *size, int total)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
+
+    if (header->volume_id != fffs_vol->volume_id || header->first_message != next_message || header->carry == 0 ||
+        header->carry > SD_BLOCK_SIZE - FFFS_BLOCK_DATA || header->carry > total - *size)
+        return false;
+
+    if (header->carry < total - *size && !(header->flags & FFFS_BLOCK_CONTINUES))
+        return false;
+
+    if (message != NULL)
+        memcpy(message + *size, block + FFFS_BLOCK_DATA, header->carry);
+    *size += header->carry;
+
+    return true;
+}
+
+/*
+ * Collects the rest of a message that continues past block until *size reaches total, called with the volume
+ * lock held. Staged blocks are copied from RAM. Blocks on the card are read with one command per sector into buf,
+ * which holds fffs_read_blocks blocks, with the lock dropped when unlock is set: committed blocks are sealed.
+ */
+static esp_err_t fffs_fragments_read(fffs_volume_t *fffs_vol, uint32_t block, uint32_t next_message, uint8_t *message, int *size, int total, uint8_t *buf, bool unlock)
+{
+    const int carry_max = SD_BLOCK_SIZE - FFFS_BLOCK_DATA;
+    uint32_t buf_blocks = fffs_read_blocks(fffs_vol);
+    const uint8_t *src;
+    uint32_t count;
+    esp_err_t err = ESP_FAIL;
+
+    FFFS_CHECK(total <= fffs_vol->config.message_max + FFFS_COPY_ID, "Message %d of %d bytes is too large", fail, next_message - 1, total);
+
+    while (*size < total)
+    {
+        block = fffs_next_data_block(fffs_vol, block);
+        FFFS_CHECK(fffs_block_written(fffs_vol, block), "Message %d is incomplete", fail, next_message - 1);
+
+        if (fffs_ram_block(fffs_vol, block) != NULL)
+        {
+            src = fffs_ram_block(fffs_vol, block);
+            count = 1;
+        }
+        else
+        {
+            count = (total - *size + carry_max - 1) / carry_max;
+            if (count > buf_blocks)
+                count = buf_blocks;
+            if (count > fffs_card_end(fffs_vol, block) - block)
+                count = fffs_card_end(fffs_vol, block) - block;
+            if (count > (SECTOR_SIZE) - block % (SECTOR_SIZE))
+                count = (SECTOR_SIZE) - block % (SECTOR_SIZE); //Stop at the next sector table
+
+            if (unlock)
+                fffs_unlock(fffs_vol);
+            err = fffs_bdev_read(fffs_vol->bdev, buf, block, count);
+            if (unlock)
+                fffs_lock(fffs_vol);
+            FFFS_CHECK(err == ESP_OK, "Cannot read blocks %d-%d", fail, block, block + count - 1);
+            src = buf;
+        }
+
+        for (uint32_t n = 0; n < count; n++)
+            FFFS_CHECK(fffs_fragment_copy(fffs_vol, src + n * SD_BLOCK_SIZE, next_message, message, size, total), "Message %d is incomplete", fail, next_message - 1);
+
+        block += count - 1;
+    }
+
+    err = ESP_OK;
+
+fail:
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+/*
+ * Finds the message stored under id stored and points buf at its block, from RAM or read into read_buf. Returns
+ * ESP_ERR_NOT_FOUND if the block was discarded by compaction. Called with the volume lock held.
+ */
+static esp_err_t fffs_stored_at(fffs_volume_t *fffs_vol, uint32_t stored, uint32_t *block, uint32_t *k, uint8_t **buf)
+{
+    uint32_t first_message;
+    const fffs_block_header_t *header;
+    esp_err_t err = fffs_locate(fffs_vol, stored, block, &first_message);
+
+    if (err != ESP_OK) //Written over by a ring
+        return err;
+
+    *buf = fffs_ram_block(fffs_vol, *block); //Staged blocks and the tail are served from RAM
+    if (*buf == NULL)
+    {
+        *buf = fffs_vol->read_buf;
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, *buf, *block, 1) == ESP_OK, "Cannot read block %d", fail, *block);
+    }
+
+    header = (const fffs_block_header_t *)*buf;
+    if (header->volume_id != fffs_vol->volume_id) //Discarded by compaction
+        return ESP_ERR_NOT_FOUND;
+
+    *k = stored - first_message;
+    FFFS_CHECK(header->first_message == first_message && *k < header->count, "Message %d is not in block %d", fail, stored, *block);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Finds message message_num where it is stored, in the copy the forwarding table sends it to if it was moved.
+ * Returns ESP_ERR_NOT_FOUND if the message is gone, if it was dropped by compaction or if the id is that of a copy.
+ * Erased messages are found, their flag tells them apart. Called with the volume lock held.
+ */
+static esp_err_t fffs_message_at(fffs_volume_t *fffs_vol, uint32_t message_num, uint32_t *block, uint32_t *k, uint8_t **buf)
+{
+    uint32_t stored = fffs_forward(fffs_vol, message_num);
+    esp_err_t err;
+
+    FFFS_CHECK(message_num < fffs_vol->message_id, "Message num is too big", fail);
+    if (fffs_message_gone(fffs_vol, message_num) || fffs_message_gone(fffs_vol, stored))
+        return ESP_ERR_NOT_FOUND;
+
+    err = fffs_stored_at(fffs_vol, stored, block, k, buf);
+    if (err != ESP_OK)
+        return err;
+    return fffs_message_holds(*buf, *k, stored, message_num) ? ESP_OK : ESP_ERR_NOT_FOUND;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Reads message message_num into message, which holds cap bytes. Returns ESP_ERR_INVALID_SIZE with *size set to
+ * the size of the message if it is larger. With _buf set the message is only located for a rewrite in place.
+ */
+static esp_err_t fffs_internal_read(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *message, int cap, int *size, int *_block, int *_offset, uint8_t **_buf)
+{
+    uint32_t fetch_block, k;
+    uint16_t offset;
+    int total;
+    uint8_t *buf;
+    esp_err_t found = fffs_message_at(fffs_vol, message_num, &fetch_block, &k, &buf);
+
+    if (found == ESP_OK && fffs_message_erased(buf, k))
+        found = ESP_ERR_NOT_FOUND;
+    if (found != ESP_OK)
+        return found;
+
+    if (_block != NULL)
+        *_block = fetch_block;
+
+    if (_buf != NULL)
+        *_buf = buf;
+
+    FFFS_CHECK(fffs_block_message(buf, k, &offset, size), "Message %u is not in block %d", err, (unsigned)message_num, fetch_block);
+
+    if (_offset != NULL)
+        *_offset = offset + fffs_message_prefix(buf, k); //Rewrites leave the id of a copy and the link
+    if (_buf != NULL && (((fffs_block_header_t *)buf)->flags & FFFS_BLOCK_COMPRESSED)) //Rewriting in place breaks the messages after it
+        return ESP_ERR_NOT_SUPPORTED;
+
+    FFFS_CHECK(fffs_message_copy(fffs_vol, buf, fetch_block, k, &fffs_vol->read_window, message, cap, size, &total, false), "Message %u is damaged", err, (unsigned)message_num);
+
+    if (total > cap)
+    {
+        *size = total;
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if (total > *size)
+    {
+        if (_buf != NULL) //Rewriting in place only covers the first fragment
+            return ESP_ERR_NOT_SUPPORTED;
+
+        FFFS_CHECK(fffs_fragments_read(fffs_vol, fetch_block, ((fffs_block_header_t *)buf)->first_message + ((fffs_block_header_t *)buf)->count, message, size, total, fffs_vol->read_buf, false) == ESP_OK,
+                   "Cannot read message %u", err, (unsigned)message_num);
+    }
+
+    return ESP_OK;
+
+err:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_read(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *message, int *size)
+{
+    int *block = NULL, *offset = NULL;
+    esp_err_t err;
+
+    fffs_lock(fffs_vol); //read_buf is shared, see fffs_reader_read
+    err = fffs_internal_read(fffs_vol, message_num, message, fffs_vol->config.message_max, size, block, offset, NULL);
+    fffs_unlock(fffs_vol);
+
+    return err;
+}
+
+esp_err_t fffs_read_into(fffs_volume_t *fffs_vol, size_t message_num, void *buf, size_t cap, int *size)
+{
+    esp_err_t err;
+
+    FFFS_CHECK(fffs_vol && size && (buf || cap == 0), "Invalid arguments.", invalid);
+    if (cap > INT32_MAX)
+        cap = INT32_MAX;
+
+    fffs_lock(fffs_vol);
+    err = fffs_internal_read(fffs_vol, message_num, buf, cap, size, NULL, NULL, NULL);
+    fffs_unlock(fffs_vol);
+
+    return err;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
+
+fffs_reader_t *fffs_reader_create(fffs_volume_t *fffs_vol)
+{
+    FFFS_CHECK(fffs_vol, "Volume is Null.", err);
+
+    fffs_reader_t *reader = malloc(sizeof(fffs_reader_t));
+    FFFS_CHECK(reader, "Cannot create reader", err);
+
+    reader->vol = fffs_vol;
+    fffs_window_init(&reader->window);
+    reader->buf = heap_caps_malloc(SD_BLOCK_SIZE * fffs_read_blocks(fffs_vol), MALLOC_CAP_DMA);
+    FFFS_CHECK(reader->buf, "Cannot create reader buffer", fail);
+
+    return reader;
+
+fail:
+    free(reader);
+
+err:
+    return NULL;
+}
+
+esp_err_t fffs_reader_read(fffs_reader_t *reader, uint32_t message_num, uint8_t *message, int *size)
+{
+    fffs_volume_t *fffs_vol;
+    uint32_t block, first_message, stored, k;
+    uint8_t *buf;
+    int total;
+    esp_err_t err = ESP_FAIL;
+
+    FFFS_CHECK(reader && size, "Reader is Null.", fail);
+    fffs_vol = reader->vol;
+
+    fffs_lock(fffs_vol);
+again:
+    FFFS_CHECK(message_num < fffs_vol->message_id, "Message num is too big", unlock);
+    stored = fffs_forward(fffs_vol, message_num);
+    if (fffs_message_gone(fffs_vol, message_num) || fffs_message_gone(fffs_vol, stored))
+    {
+        err = ESP_ERR_NOT_FOUND;
+        goto unlock;
+    }
+    FFFS_CHECK(fffs_locate(fffs_vol, stored, &block, &first_message) == ESP_OK, "Cannot locate message %d", unlock, stored);
+    k = stored - first_message;
+
+    if (fffs_ram_block(fffs_vol, block) != NULL) //Not on the card yet
+    {
+        buf = fffs_ram_block(fffs_vol, block);
+        FFFS_CHECK(k < ((fffs_block_header_t *)buf)->count, "Message %d is not in block %d", unlock, stored, block);
+        if (fffs_message_erased(buf, k) || !fffs_message_holds(buf, k, stored, message_num))
+        {
+            err = ESP_ERR_NOT_FOUND;
+            goto unlock;
+        }
+        FFFS_CHECK(fffs_message_copy(fffs_vol, buf, block, k, &reader->window, message, fffs_vol->config.message_max, size, &total, false), "Message %d is not in block %d", unlock, message_num, block);
+    }
+    else
+    {
+        fffs_unlock(fffs_vol);
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, reader->buf, block, 1) == ESP_OK, "Cannot read block %d", fail, block);
+        if (!fffs_block_valid(fffs_vol, reader->buf, first_message)) //A ring wrote over it or compaction moved it since the lock was dropped
+        {
+            fffs_lock(fffs_vol);
+            if (fffs_forward(fffs_vol, message_num) != stored)
+                goto again;
+            err = ESP_ERR_NOT_FOUND;
+            goto unlock;
+        }
+        FFFS_CHECK(k < ((fffs_block_header_t *)reader->buf)->count, "Message %d is not in block %d", fail, stored, block);
+        if (fffs_message_erased(reader->buf, k) || !fffs_message_holds(reader->buf, k, stored, message_num))
+            return ESP_ERR_NOT_FOUND;
+        FFFS_CHECK(fffs_message_copy(fffs_vol, reader->buf, block, k, &reader->window, message, fffs_vol->config.message_max, size, &total, false), "Message %d is not in block %d", fail, message_num, block);
+        if (total == *size)
+            return ESP_OK;
+
+        buf = reader->buf;
+        fffs_lock(fffs_vol);
+    }
+
+    if (total > *size)
+        err = fffs_fragments_read(fffs_vol, block, first_message + ((fffs_block_header_t *)buf)->count, message, size, total, reader->buf, true);
+    else
+        err = ESP_OK;
+
+unlock:
+    fffs_unlock(fffs_vol);
+
+fail:
+    return err;
+}
+
+esp_err_t fffs_reader_delete(fffs_reader_t *reader)
+{
+    if (reader == NULL)
+        return ESP_OK;
+
+    heap_caps_free(reader->buf);
+    free(reader->window.buf);
+    free(reader);
+    return ESP_OK;
+}
+
+/*
+ * Points buf at the cursor block, called with the volume lock held. Staged blocks are served from RAM, every
+ * other block comes from the read-ahead buffer, which is refilled with the blocks from the cursor up to the
+ * stage in one command when it misses. The lock is dropped during that read: committed blocks are sealed so
+ * the buffered copies stay valid until the cursor moves past them.
+ */
+static esp_err_t fffs_cursor_block(fffs_cursor_t *cursor, uint8_t **buf)
+{
+    fffs_volume_t *fffs_vol = cursor->vol;
+    uint32_t count;
+    esp_err_t err;
+
+    FFFS_CHECK(fffs_block_written(fffs_vol, cursor->block), "Block %d is past the write head", fail, cursor->block);
+
+    if (fffs_ram_block(fffs_vol, cursor->block) != NULL)
+    {
+        *buf = fffs_ram_block(fffs_vol, cursor->block);
+        return ESP_OK;
+    }
+
+    if (cursor->block < cursor->ahead_block || cursor->block >= cursor->ahead_block + cursor->ahead_count)
+    {
+        count = fffs_card_end(fffs_vol, cursor->block) - cursor->block;
+        if (count > fffs_vol->config.read_ahead_blocks)
+            count = fffs_vol->config.read_ahead_blocks;
+
+        cursor->ahead_count = 0;
+        fffs_unlock(fffs_vol);
+        err = fffs_bdev_read(fffs_vol->bdev, cursor->ahead_buf, cursor->block, count);
+        fffs_lock(fffs_vol);
+        FFFS_CHECK(err == ESP_OK, "Cannot read blocks %d-%d", fail, cursor->block, cursor->block + count - 1);
+
+        cursor->ahead_block = cursor->block;
+        cursor->ahead_count = count;
+    }
+
+    *buf = cursor->ahead_buf + (cursor->block - cursor->ahead_block) * SD_BLOCK_SIZE;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Moves a cursor past the messages that are gone: to the oldest message when the ring has lapped it or the log
+ * was truncated under it, and past an erased range. Called with the volume locked.
+ */
+static esp_err_t fffs_cursor_skip(fffs_cursor_t *cursor)
+{
+    fffs_volume_t *fffs_vol = cursor->vol;
+    uint32_t next = cursor->message_id < fffs_vol->oldest_message_id ? fffs_vol->oldest_message_id : cursor->message_id;
+    uint32_t first_message;
+
+    next = fffs_erased_end(fffs_vol, next);
+    if (next == cursor->message_id)
+        return ESP_OK;
+
+    cursor->message_id = next;
+    cursor->ahead_count = 0;
+    cursor->block = fffs_vol->last_block;
+    return next < fffs_vol->message_id ? fffs_locate(fffs_vol, next, &cursor->block, &first_message) : ESP_OK;
+}
+
+fffs_cursor_t *fffs_cursor_open(fffs_volume_t *fffs_vol, uint32_t from_id)
+{
+    fffs_cursor_t *cursor = NULL;
+    uint32_t first_message;
+    esp_err_t err;
+
+    FFFS_CHECK(fffs_vol, "Volume is Null.", fail);
+
+    cursor = calloc(1, sizeof(fffs_cursor_t));
+    FFFS_CHECK(cursor, "Cannot create cursor", fail);
+    fffs_window_init(&cursor->window);
+
+    cursor->ahead_buf = heap_caps_malloc(fffs_vol->config.read_ahead_blocks * SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+    FFFS_CHECK(cursor->ahead_buf, "Cannot create read-ahead buffer", fail);
+    cursor->vol = fffs_vol;
+
+    fffs_lock(fffs_vol);
+    cursor->block = fffs_vol->last_block;
+    if (from_id < fffs_vol->oldest_message_id) //Starts from the oldest message still held
+        from_id = fffs_vol->oldest_message_id;
+    from_id = fffs_erased_end(fffs_vol, from_id);
+    cursor->message_id = from_id; //from_id equal to message_id waits at the write head
+
+    if (from_id > fffs_vol->message_id)
+        err = ESP_ERR_INVALID_ARG;
+    else if (from_id < fffs_vol->message_id)
+        err = fffs_locate(fffs_vol, from_id, &cursor->block, &first_message);
+    else
+        err = ESP_OK;
+    fffs_unlock(fffs_vol);
+
+    FFFS_CHECK(err == ESP_OK, "Cannot locate message %d", fail, from_id);
+    return cursor;
+
+fail:
+    fffs_cursor_close(cursor);
+    return NULL;
+}
+
+/*
+ * Messages are returned in id order. Those moved by fffs_replace or fffs_compact are read from their copy, the
+ * others from the blocks the cursor walks through. Copies, erased messages and messages of the blocks compaction
+ * discarded that it did not move are skipped.
+ */
+esp_err_t fffs_cursor_next(fffs_cursor_t *cursor, uint8_t *message, int *size, uint32_t *message_id)
+{
+    fffs_volume_t *fffs_vol;
+    esp_err_t err = ESP_FAIL;
+    fffs_block_header_t *header;
+    uint32_t next_message, sector, k;
+    uint8_t *buf;
+    int total;
+
+    FFFS_CHECK(cursor && size, "Cursor is Null.", fail);
+    fffs_vol = cursor->vol;
+
+    fffs_lock(fffs_vol);
+    for (;; cursor->message_id++)
+    {
+        FFFS_CHECK(fffs_cursor_skip(cursor) == ESP_OK, "Cannot locate message %d", unlock, cursor->message_id);
+        if (cursor->message_id >= fffs_vol->message_id)
+        {
+            err = ESP_ERR_NOT_FOUND;
+            goto unlock;
+        }
+
+        if (fffs_forward(fffs_vol, cursor->message_id) != cursor->message_id)
+        {
+            err = fffs_internal_read(fffs_vol, cursor->message_id, message, fffs_vol->config.message_max, size, NULL, NULL, NULL);
+            if (err == ESP_ERR_NOT_FOUND)
+                continue;
+            if (err != ESP_OK)
+                goto unlock;
+            break;
+        }
+
+        FFFS_CHECK(fffs_cursor_block(cursor, &buf) == ESP_OK, "Cannot read block %d", unlock, cursor->block);
+
+        header = (fffs_block_header_t *)buf;
+        while (header->volume_id == fffs_vol->volume_id && cursor->message_id >= header->first_message + header->count) //Past the messages starting in the block
+        {
+            cursor->block = fffs_next_data_block(fffs_vol, cursor->block);
+            FFFS_CHECK(fffs_cursor_block(cursor, &buf) == ESP_OK, "Cannot read block %d", unlock, cursor->block);
+            header = (fffs_block_header_t *)buf;
+            FFFS_CHECK(header->volume_id != fffs_vol->volume_id || header->first_message <= cursor->message_id, "Block %d does not follow on", unlock, cursor->block);
+        }
+
+        if (header->volume_id != fffs_vol->volume_id) //Discarded by compaction, which moved the live messages of the sector
+        {
+            sector = fffs_next_sector(fffs_vol, cursor->block - cursor->block % (SECTOR_SIZE));
+            next_message = fffs_index_first(fffs_vol, sector / (SECTOR_SIZE));
+            FFFS_CHECK(next_message != UINT32_MAX, "Cannot read sector %d", unlock, sector);
+            if (cursor->message_id >= next_message)
+            {
+                cursor->block = sector + 1;
+                cursor->message_id--; //Tried again in the next sector
+            }
+            continue;
+        }
+
+        k = cursor->message_id - header->first_message;
+        if (fffs_message_erased(buf, k) || fffs_message_copied(buf, k))
+            continue;
+
+        FFFS_CHECK(fffs_message_copy(fffs_vol, buf, cursor->block, k, &cursor->window, message, fffs_vol->config.message_max, size, &total, false), "Message %d is damaged", unlock, cursor->message_id);
+
+        next_message = header->first_message + header->count;
+        while (*size < total) //The rest is carried by the next blocks, which come with the same read-ahead
+        {
+            cursor->block = fffs_next_data_block(fffs_vol, cursor->block);
+            FFFS_CHECK(fffs_cursor_block(cursor, &buf) == ESP_OK, "Cannot read block %d", unlock, cursor->block);
+            FFFS_CHECK(fffs_fragment_copy(fffs_vol, buf, next_message, message, size, total), "Message %d is incomplete", unlock, cursor->message_id);
+        }
+        break;
+    }
+
+    if (message_id != NULL)
+        *message_id = cursor->message_id;
+
+    cursor->message_id++;
+    err = ESP_OK;
+
+unlock:
+    fffs_unlock(fffs_vol);
+
+fail:
+    return err;
+}
+
+esp_err_t fffs_cursor_close(fffs_cursor_t *cursor)
+{
+    if (cursor == NULL)
+        return ESP_OK;
+
+    heap_caps_free(cursor->ahead_buf);
+    free(cursor->window.buf);
+    free(cursor);
+    return ESP_OK;
+}
+
+static bool fffs_scan_keeps(const fffs_query_t *query, const fffs_sector_summary_t *summary)
+{
+    if (summary->flags & FFFS_SUMMARY_PARTIAL)
+        return true;
+
+    if (query->use_value && (summary->value_min > summary->value_max || summary->value_min > query->value_max || summary->value_max < query->value_min))
+        return false;
+
+    if (query->use_filter && !fffs_filter_test(summary->filter, query->filter_key))
+        return false;
+
+    return query->sector == NULL || query->sector(summary, query->ctx);
+}
+
+/*
+ * Moves the cursor of scan over the sealed sectors ruled out by their summary, from the one holding its next message
+ * on, and sets limit to the end of the sector it is let into. Sectors follow each other on the card, so after the
+ * first lookup only their tables are read, wrapping to the start of the card in a ring. The sector being written is
+ * let in up to the messages it holds now and tested again past them, as it may have been sealed in the meantime.
+ * Called with the volume locked.
+ */
+static esp_err_t fffs_scan_sectors(fffs_scan_t *scan)
+{
+    fffs_cursor_t *cursor = scan->cursor;
+    fffs_volume_t *fffs_vol = cursor->vol;
+    fffs_sector_table_t *table;
+    uint32_t block, first_message, sector, next;
+    bool keep;
+
+    FFFS_CHECK(fffs_cursor_skip(cursor) == ESP_OK, "Cannot locate message %d", fail, cursor->message_id);
+    if (cursor->message_id < scan->limit || cursor->message_id >= fffs_vol->message_id)
+        return ESP_OK;
+
+    FFFS_CHECK(fffs_locate(fffs_vol, cursor->message_id, &block, &first_message) == ESP_OK, "Cannot locate message %d", fail, cursor->message_id);
+
+    for (sector = block - block % (SECTOR_SIZE); sector != fffs_vol->current_sector; sector = fffs_next_sector(fffs_vol, sector))
+    {
+        table = fffs_index_table(fffs_vol, sector);
+        FFFS_CHECK(table, "Cannot read sector %d", fail, sector);
+        keep = fffs_scan_keeps(&scan->query, &table->summary);
+
+        next = fffs_index_first(fffs_vol, fffs_next_sector(fffs_vol, sector) / (SECTOR_SIZE));
+        FFFS_CHECK(next != UINT32_MAX, "Cannot read sector %d", fail, fffs_next_sector(fffs_vol, sector));
+
+        if (keep)
+        {
+            scan->limit = next;
+            return ESP_OK;
+        }
+
+        cursor->message_id = next; //The first block of the next sector starts with it
+        cursor->block = fffs_next_sector(fffs_vol, sector) + 1;
+        scan->skipped++;
+    }
+
+    scan->limit = fffs_vol->message_id;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+fffs_scan_t *fffs_scan_open(fffs_volume_t *fffs_vol, uint32_t from_id, const fffs_query_t *query)
+{
+    fffs_scan_t *scan = NULL;
+
+    FFFS_CHECK(query, "Query is Null.", fail);
+
+    scan = calloc(1, sizeof(fffs_scan_t));
+    FFFS_CHECK(scan, "Cannot create scan", fail);
+
+    scan->query = *query;
+    scan->cursor = fffs_cursor_open(fffs_vol, from_id);
+    FFFS_CHECK(scan->cursor, "Cannot open cursor at message %d", fail, from_id);
+    return scan;
+
+fail:
+    fffs_scan_close(scan);
+    return NULL;
+}
+
+esp_err_t fffs_scan_next(fffs_scan_t *scan, uint8_t *message, int *size, uint32_t *message_id)
+{
+    uint32_t id;
+    esp_err_t err;
+
+    FFFS_CHECK(scan && size, "Scan is Null.", fail);
+
+    for (;;)
+    {
+        fffs_lock(scan->cursor->vol);
+        err = fffs_scan_sectors(scan);
+        fffs_unlock(scan->cursor->vol);
+        if (err != ESP_OK)
+            return err;
+
+        err = fffs_cursor_next(scan->cursor, message, size, &id);
+        if (err != ESP_OK)
+            return err;
+
+        if (scan->query.match == NULL || scan->query.match(message, *size, scan->query.ctx))
+            break;
+    }
+
+    if (message_id != NULL)
+        *message_id = id;
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_scan_close(fffs_scan_t *scan)
+{
+    if (scan == NULL)
+        return ESP_OK;
+
+    fffs_cursor_close(scan->cursor);
+    free(scan);
+    return ESP_OK;
+}
+
+/*
+ * Returns the header of data block index of sector, from the stage while it has not been committed.
+ */
+static const fffs_block_header_t *fffs_block_header(fffs_volume_t *fffs_vol, uint32_t sector, uint32_t index)
+{
+    uint32_t block = sector + 1 + index * BLOCKS_IN_SECTOR;
+
+    if (fffs_ram_block(fffs_vol, block) != NULL)
+        return (const fffs_block_header_t *)fffs_ram_block(fffs_vol, block);
+
+    FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, fffs_vol->read_buf, block, 1) == ESP_OK, "Cannot read block %d", fail, block);
+    FFFS_CHECK(((fffs_block_header_t *)fffs_vol->read_buf)->volume_id == fffs_vol->volume_id ||
+                   ((fffs_block_header_t *)fffs_vol->read_buf)->volume_id == 0, //Discarded by fffs_erase_range, see fffs_block_live
+               "Block %d was not written", fail, block);
+    return fffs_vol->read_buf;
+
+fail:
+    return NULL;
+}
+
+/*
+ * Returns the header of the first block of sector from *index up to last that fffs_erase_range has not discarded,
+ * and moves *index to it. When every one of them was, the header of last is returned with its volume_id of 0.
+ */
+static const fffs_block_header_t *fffs_block_live(fffs_volume_t *fffs_vol, uint32_t sector, uint32_t *index, uint32_t last)
+{
+    const fffs_block_header_t *header;
+
+    for (;; (*index)++)
+    {
+        header = fffs_block_header(fffs_vol, sector, *index);
+        if (header == NULL || header->volume_id != 0 || *index == last)
+            return header;
+    }
+}
+
+/*
+ * Time stamps never decrease, so the sector holding the answer is the first one whose last_time reaches time and
+ * the block is the first one of that sector whose stamp does. Sectors are searched in the order they were written,
+ * from the oldest one a ring still holds. The current sector always qualifies once the newest stamp does, and only
+ * its uncommitted blocks are read from RAM.
+ */
+esp_err_t fffs_seek_time(fffs_volume_t *fffs_vol, uint32_t time, uint32_t *message_id)
 {
+    const fffs_block_header_t *header;
+    fffs_sector_table_t *table;
+    uint32_t lo = 0, hi, last, sector;
     esp_err_t err = ESP_FAIL;
+
+    FFFS_CHECK(fffs_vol && message_id, "Volume or message id is NULL.", invalid);
+
+    fffs_lock(fffs_vol);
+    *message_id = fffs_vol->message_id;
+    if (fffs_vol->message_id == 0 || time > fffs_vol->last_time)
+    {
+        err = ESP_ERR_NOT_FOUND;
+        goto done;
+    }
+
+    hi = fffs_sector_head(fffs_vol);
+    while (lo < hi) //Sectors before lo end before time, sector hi holds a message at or after it
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        sector = fffs_sector_ordinal(fffs_vol, mid) * (SECTOR_SIZE);
+        table = fffs_index_table(fffs_vol, sector);
+        FFFS_CHECK(table, "Cannot read sector %d", done, sector);
+
+        if (table->last_time >= time)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    sector = fffs_sector_ordinal(fffs_vol, lo) * (SECTOR_SIZE);
+    table = fffs_index_table(fffs_vol, sector);
+    FFFS_CHECK(table, "Cannot read sector %d", done, sector);
+
+    if (table->first_time >= time)
+    {
+        *message_id = table->first_message;
+        goto found;
+    }
+
+    lo = 0;
+    hi = last = sector == fffs_vol->current_sector ? fffs_vol->block_index : fffs_sector_last_index(fffs_vol, sector);
+    while (lo < hi) //The same over the blocks of the sector, a discarded block standing for the next live one
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        uint32_t live = mid;
+
+        header = fffs_block_live(fffs_vol, sector, &live, last);
+        FFFS_CHECK(header, "Cannot read block %d of sector %d", done, live, sector);
+
+        if (header->volume_id == 0 || header->time >= time)
+            hi = mid;
+        else
+            lo = live + 1;
+    }
+
+    header = fffs_block_live(fffs_vol, sector, &lo, last);
+    FFFS_CHECK(header, "Cannot read block %d of sector %d", done, lo, sector);
+    *message_id = header->volume_id != 0 ? header->first_message : fffs_index_first(fffs_vol, fffs_next_sector(fffs_vol, sector) / (SECTOR_SIZE)); //The rest of the sector was discarded
+    FFFS_CHECK(*message_id != UINT32_MAX, "Cannot read sector %d", done, fffs_next_sector(fffs_vol, sector));
+
+found:
+    if (*message_id < fffs_vol->oldest_message_id) //Truncated or written over
+        *message_id = fffs_vol->oldest_message_id;
+    *message_id = fffs_erased_end(fffs_vol, *message_id);
+    err = *message_id < fffs_vol->message_id ? ESP_OK : ESP_ERR_NOT_FOUND;
+
+done:
+    fffs_unlock(fffs_vol);
+    return err;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
+
+/*
+ * Writes back block, card block block_num, after a change in place. Blocks still in RAM reach the card with the
+ * next commit.
+ */
+static esp_err_t fffs_block_rewrite(fffs_volume_t *fffs_vol, uint32_t block_num, const uint8_t *block)
+{
+    if (fffs_ram_block(fffs_vol, block_num) != NULL)
+    {
+        fffs_vol->tail_dirty++;
+        return ESP_OK;
+    }
+
+    FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, block, block_num, 1) == ESP_OK, "Cannot write block %d", fail, block_num);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Adds bytes to the dead bytes counted for the sector holding block. A sector missing from the hints takes the place
+ * of the one with the fewest if it has more.
+ */
+static void fffs_compact_note(fffs_volume_t *fffs_vol, uint32_t block, uint32_t bytes)
+{
+    fffs_compact_hint_t *victim = &fffs_vol->compact_hints[0];
+    uint32_t sector = block - block % (SECTOR_SIZE);
+
+    for (int i = 0; i < FFFS_COMPACT_HINTS; i++)
+    {
+        if (fffs_vol->compact_hints[i].sector == sector)
+        {
+            fffs_vol->compact_hints[i].dead += bytes;
+            return;
+        }
+
+        if (fffs_vol->compact_hints[i].dead < victim->dead)
+            victim = &fffs_vol->compact_hints[i];
+    }
+
+    if (victim->dead < bytes)
+    {
+        victim->sector = sector;
+        victim->dead = bytes;
+    }
+}
+
+/*
+ * Flags message k of block, card block block_num, as erased and counts its bytes for compaction. Its content is
+ * wiped unless other messages of the block are compressed against it.
+ */
+static esp_err_t fffs_message_kill(fffs_volume_t *fffs_vol, uint32_t block_num, uint8_t *block, uint32_t k)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)block;
+    uint32_t dead;
+    uint16_t offset;
     int size;
-    int block, offset;
-    uint8_t *message = malloc(SD_BLOCK_SIZE);
-    if (message == NULL)
-        return ESP_FAIL;
 
-    FFFS_CHECK(fffs_internal_read(fffs_vol, message_num, message, &size, &block, &offset) == ESP_OK, "Cannot Read message", fail);
-    free(message);
-    message = calloc(size, 1);
-    memcpy((uint8_t *)(fffs_vol->read_buf) + offset + 1 + (size > 0xFF ? 1 : 0), message, size);
-    free(message);
+    FFFS_CHECK(fffs_message_stored(block, k, &offset, &size), "Message %d of block %d is damaged", fail, k, block_num);
+    fffs_set_message_flags(block, k, FFFS_MESSAGE_ERASED);
+    if (!(header->flags & FFFS_BLOCK_COMPRESSED) && size > fffs_message_prefix(block, k))
+        memset(block + offset + fffs_message_prefix(block, k), 0, size - fffs_message_prefix(block, k)); //The id of a copy and the link stay
 
-    FFFS_CHECK(sdmmc_write_sectors(fffs_vol->sd_card, fffs_vol->read_buf, block, 1) == ESP_OK, "Cannot write block", fail);
+    dead = size;
+    if ((header->flags & FFFS_BLOCK_CONTINUES) && k + 1 == header->count)
+        memcpy(&dead, block + offset - sizeof(dead), sizeof(dead)); //The fragments carried by the next blocks die with it
 
-    err = ESP_OK;
+    fffs_compact_note(fffs_vol, block_num, dead);
+    return fffs_block_rewrite(fffs_vol, block_num, block);
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_erase(fffs_volume_t *fffs_vol, size_t message_num)
+{
+    esp_err_t err = ESP_FAIL;
+    uint32_t block, k;
+    uint8_t *buf;
+
+    fffs_lock(fffs_vol);
+    err = fffs_sent_wait(fffs_vol); //Blocks being written are rewritten on the card
+    if (err == ESP_OK)
+        err = fffs_message_at(fffs_vol, message_num, &block, &k, &buf);
+    if (err == ESP_OK && fffs_message_erased(buf, k))
+        err = ESP_ERR_NOT_FOUND;
+    FFFS_CHECK(err == ESP_OK, "Cannot find message %u", fail, (unsigned)message_num);
+    err = fffs_message_kill(fffs_vol, block, buf, k);
 
 fail:
+    fffs_unlock(fffs_vol);
     return err;
 }
 
@@ -507,20 +3186,501 @@ esp_err_t fffs_update(fffs_volume_t *fffs_vol, size_t message_num, uint8_t *new_
     esp_err_t err = ESP_FAIL;
     int size;
     int block, offset;
-    uint8_t *message = malloc(SD_BLOCK_SIZE);
-    if (message == NULL)
-        return ESP_FAIL;
+    uint8_t *buf;
+
+    fffs_lock(fffs_vol);
+    err = fffs_sent_wait(fffs_vol); //Blocks being written are rewritten on the card
+    if (err == ESP_OK)
+        err = fffs_internal_read(fffs_vol, message_num, NULL, fffs_vol->config.message_max, &size, &block, &offset, &buf); //Only locates the message
+    FFFS_CHECK(err == ESP_OK, "Cannot read message", fail);
+    err = ESP_FAIL;
+    memcpy(buf + offset, new_message, size);
+
+    if (fffs_ram_block(fffs_vol, block) != NULL)
+        fffs_vol->tail_dirty++;
+    else
+        FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot write block", fail);
+
+    err = ESP_OK;
+
+fail:
+    fffs_unlock(fffs_vol);
+    return err;
+}
 
-    FFFS_CHECK(fffs_internal_read(fffs_vol, message_num, message, &size, &block, &offset) == ESP_OK, "Cannot read message", fail);
-    free(message);
-    message = calloc(size, 1);
-    memcpy((uint8_t *)(fffs_vol->read_buf) + offset + 1 + (size > 0xFF ? 1 : 0), new_message, size);
-    free(message);
+/*
+ * Widens the summary of the sector message_id was written in to cover its new content, so that scans keep finding
+ * it once replaced. The table of a sealed sector is written back at once.
+ */
+static esp_err_t fffs_summary_widen(fffs_volume_t *fffs_vol, uint32_t message_id, const uint8_t *message, int size)
+{
+    fffs_sector_table_t *table;
+    uint32_t block, first_message, sector;
+    esp_err_t err;
 
-    FFFS_CHECK(sdmmc_write_sectors(fffs_vol->sd_card, fffs_vol->read_buf, block, 1) == ESP_OK, "Cannot write block", fail);
+    if (fffs_vol->config.value_key == NULL && fffs_vol->config.filter_key == NULL)
+        return ESP_OK;
 
-    err = ESP_OK;
+    err = fffs_locate(fffs_vol, message_id, &block, &first_message);
+    if (err == ESP_ERR_NOT_FOUND) //Written over by a ring while copied
+        return ESP_OK;
+    FFFS_CHECK(err == ESP_OK, "Cannot locate message %d", fail, message_id);
+    sector = block - block % (SECTOR_SIZE);
+    table = fffs_index_table(fffs_vol, sector);
+    FFFS_CHECK(table, "Cannot read sector %d", fail, sector);
+    fffs_summary_add(fffs_vol, &table->summary, message, size);
+
+    if (sector == fffs_vol->current_sector)
+        fffs_vol->table_dirty = true;
+    else
+        FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, table, sector, 1) == ESP_OK, "Cannot write sector %d", fail, sector);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * The copy and the table pointing at it reach the card before the old message is erased, so that after a power
+ * cut the message reads either as it was or as replaced.
+ */
+esp_err_t fffs_replace(fffs_volume_t *fffs_vol, uint32_t message_num, const void *message, int size)
+{
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    uint32_t block, k, stored, prev, copy, index;
+    uint16_t offset;
+    int stored_size, prefix;
+    uint8_t *buf;
+    bool live, pruned;
+
+    FFFS_CHECK(fffs_vol && size > 0 && message, "Invalid arguments.", invalid);
+    if (fffs_vol->forward_blocks == 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    fffs_lock(fffs_vol);
+    err = fffs_sent_wait(fffs_vol); //Blocks being written are rewritten on the card
+    if (err == ESP_OK)
+        err = fffs_message_at(fffs_vol, message_num, &block, &k, &buf);
+    if (err == ESP_OK && fffs_message_erased(buf, k))
+        err = ESP_ERR_NOT_FOUND;
+    if (err != ESP_OK)
+        goto unlock;
+
+    err = ESP_ERR_INVALID_SIZE;
+    prefix = fffs_message_keyed(buf, k) ? FFFS_KEY_LINK : 0;
+    if (size > fffs_vol->config.message_max - prefix)
+        goto unlock;
+
+    err = ESP_FAIL;
+    FFFS_CHECK(fffs_message_stored(buf, k, &offset, &stored_size), "Message %d is damaged", unlock, message_num);
+    if (!(((fffs_block_header_t *)buf)->flags & FFFS_BLOCK_COMPRESSED) && stored_size == fffs_message_prefix(buf, k) + size &&
+        !((((fffs_block_header_t *)buf)->flags & FFFS_BLOCK_CONTINUES) && k + 1 == ((fffs_block_header_t *)buf)->count))
+    {
+        memcpy(buf + offset + fffs_message_prefix(buf, k), message, size);
+        err = fffs_block_rewrite(fffs_vol, block, buf);
+        if (err == ESP_OK)
+            err = fffs_summary_widen(fffs_vol, message_num, message, size);
+        goto unlock;
+    }
+
+    err = ESP_ERR_NO_MEM;
+    pruned = fffs_forward_full(fffs_vol, message_num);
+    if (pruned)
+        fffs_forward_prune(fffs_vol, 0, 0); //Entries of messages gone since make room
+    if (fffs_forward_full(fffs_vol, message_num))
+        goto unlock;
+
+    err = ESP_FAIL;
+    if (prefix > 0)
+        FFFS_CHECK(fffs_key_prev(fffs_vol, message_num, &prev, &live) == ESP_OK, "Cannot read the key link of message %d", unlock, message_num);
+
+    memcpy(fffs_vol->copy_record, &message_num, FFFS_COPY_ID);
+    if (prefix > 0)
+        memcpy(fffs_vol->copy_record + FFFS_COPY_ID, &prev, FFFS_KEY_LINK);
+    memcpy(fffs_vol->copy_record + FFFS_COPY_ID + prefix, message, size);
+
+    stored = fffs_forward(fffs_vol, message_num);
+    copy = fffs_vol->message_id;
+    FFFS_CHECK(fffs_append(fffs_vol, fffs_vol->copy_record, FFFS_COPY_ID + prefix + size, FFFS_MESSAGE_COPY | (prefix > 0 ? FFFS_MESSAGE_KEYED : 0), false) == ESP_OK,
+               "Cannot copy message %d", unlock, message_num);
+    index = fffs_forward_set(fffs_vol, message_num, copy);
+    FFFS_CHECK(fffs_forward_write(fffs_vol, pruned ? 0 : index) == ESP_OK, "Cannot write forwarding table", unlock);
+    FFFS_CHECK(fffs_summary_widen(fffs_vol, message_num, message, size) == ESP_OK, "Cannot widen the summary of message %d", unlock, message_num);
+
+    if (fffs_stored_at(fffs_vol, stored, &block, &k, &buf) == ESP_OK) //The old copy or message is dead from now on
+        err = fffs_message_kill(fffs_vol, block, buf, k);
+    else
+        err = ESP_OK;
+
+unlock:
+    fffs_unlock(fffs_vol);
+
+invalid:
+    return err;
+}
+
+/*
+ * Copies the live messages of sector to the write head and forwards them, then discards its data blocks. A message
+ * is live unless it is gone, erased or forwarded already, and a copy while its message is forwarded to it. Erased
+ * keyed messages leave a copy of their link behind, flagged as erased. The first blocks carrying the end of a
+ * message started before the sector are kept, with the messages starting in them flagged as erased. Called with
+ * the volume locked and nothing being written.
+ */
+static esp_err_t fffs_sector_compact(fffs_volume_t *fffs_vol, uint32_t sector, uint32_t *moved)
+{
+    const fffs_block_header_t *header = (const fffs_block_header_t *)fffs_vol->compact_buf;
+    uint8_t *buf = fffs_vol->compact_buf;
+    uint32_t last_index = fffs_sector_last_index(fffs_vol, sector);
+    uint32_t first, next, block, stored, message_id, copy, count, prev, keep = 0;
+    fffs_sector_table_t *table;
+    uint16_t offset, flags;
+    bool leading = true, erased;
+    esp_err_t err = ESP_FAIL;
+    int prefix, size, total;
+
+    table = fffs_index_table(fffs_vol, sector);
+    FFFS_CHECK(table, "Cannot read sector %d", fail, sector);
+    first = table->first_message;
+    next = fffs_index_first(fffs_vol, fffs_next_sector(fffs_vol, sector) / (SECTOR_SIZE));
+    FFFS_CHECK(next != UINT32_MAX, "Cannot read sector %d", fail, fffs_next_sector(fffs_vol, sector));
+    if (next < first) //Last sector of the card
+        next = fffs_vol->message_id;
+
+    for (uint32_t i = 0; i <= last_index; i++)
+    {
+        block = sector + 1 + i * BLOCKS_IN_SECTOR;
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot read block %d", abort, block);
+        if (header->volume_id != fffs_vol->volume_id) //Discarded by an erase_range
+        {
+            leading = false;
+            continue;
+        }
+
+        if (leading && header->carry > 0)
+            keep = i + 1;
+        leading = leading && header->carry > 0 && header->count == 0;
+
+        count = header->count;
+        for (uint32_t k = 0; k < count; k++)
+        {
+            stored = message_id = header->first_message + k;
+            erased = fffs_message_erased(buf, k);
+            if ((erased && !fffs_message_keyed(buf, k)) || fffs_message_gone(fffs_vol, stored))
+                continue;
+
+            prefix = FFFS_COPY_ID;
+            if (fffs_message_copied(buf, k)) //Moved on as it is
+            {
+                FFFS_CHECK(fffs_message_stored(buf, k, &offset, &size) && size >= (int)FFFS_COPY_ID, "Message %d is damaged", abort, stored);
+                memcpy(&message_id, buf + offset, FFFS_COPY_ID);
+                prefix = 0;
+            }
+            if (fffs_message_gone(fffs_vol, message_id) || fffs_forward(fffs_vol, message_id) != stored)
+                continue;
+
+            flags = FFFS_MESSAGE_COPY | (fffs_message_keyed(buf, k) ? FFFS_MESSAGE_KEYED : 0);
+            memcpy(fffs_vol->copy_record, &message_id, FFFS_COPY_ID);
+            FFFS_CHECK(fffs_message_copy(fffs_vol, buf, block, k, &fffs_vol->read_window, fffs_vol->copy_record + prefix,
+                                         fffs_vol->config.message_max + FFFS_COPY_ID - prefix, &size, &total, true) &&
+                           total <= (int)(fffs_vol->config.message_max + FFFS_COPY_ID) - prefix,
+                       "Message %d is damaged", abort, stored);
+
+            if (erased) //Only its key link is moved on, for lookups to carry on past it
+            {
+                memcpy(&prev, fffs_vol->copy_record + FFFS_COPY_ID, FFFS_KEY_LINK);
+                if (prev == FFFS_KEY_NONE || fffs_message_gone(fffs_vol, prev))
+                    continue;
+                flags |= FFFS_MESSAGE_ERASED;
+                prefix = 0;
+                size = total = FFFS_COPY_ID + FFFS_KEY_LINK;
+            }
+
+            err = ESP_ERR_NO_MEM;
+            if (fffs_forward_full(fffs_vol, message_id))
+                goto abort;
+            if (fffs_vol->message_rotate && fffs_next_sector(fffs_vol, fffs_vol->current_sector) == sector) //The writer came round to it
+                goto abort;
+            err = ESP_FAIL;
+
+            if (total > size) //The last message of the block, buf is overwritten
+                FFFS_CHECK(fffs_fragments_read(fffs_vol, block, stored + 1, fffs_vol->copy_record + prefix, &size, total, buf, false) == ESP_OK,
+                           "Cannot read message %d", abort, stored);
+
+            copy = fffs_vol->message_id;
+            FFFS_CHECK(fffs_append(fffs_vol, fffs_vol->copy_record, prefix + total, flags, true) == ESP_OK, "Cannot copy message %d", abort, stored);
+            fffs_forward_set(fffs_vol, message_id, copy);
+            (*moved)++;
+        }
+    }
+
+    fffs_forward_prune(fffs_vol, first, next); //Copies left in the sector are dead
+    FFFS_CHECK(fffs_forward_write(fffs_vol, 0) == ESP_OK, "Cannot write forwarding table", fail);
+
+    if (keep > 0)
+    {
+        block = sector + keep * BLOCKS_IN_SECTOR;
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot read block %d", fail, block);
+        if (header->count > 0)
+        {
+            for (uint32_t k = 0; k < header->count; k++)
+                fffs_set_message_flags(buf, k, FFFS_MESSAGE_ERASED);
+            FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot write block %d", fail, block);
+        }
+    }
+
+    if (keep <= last_index)
+        FFFS_CHECK(fffs_bdev_erase(fffs_vol->bdev, sector + 1 + keep * BLOCKS_IN_SECTOR, (last_index + 1 - keep) * BLOCKS_IN_SECTOR) == ESP_OK,
+                   "Cannot discard sector %d", fail, sector);
+    return ESP_OK;
+
+abort:
+    if (fffs_forward_write(fffs_vol, 0) != ESP_OK) //Copies made so far stay forwarded
+        err = ESP_FAIL;
+
+fail:
+    return err;
+}
+
+esp_err_t fffs_compact(fffs_volume_t *fffs_vol, uint32_t min_dead_percent, uint32_t *moved)
+{
+    const uint64_t sector_bytes = ((SECTOR_SIZE) - 1) * (SD_BLOCK_SIZE - FFFS_BLOCK_DATA);
+    fffs_compact_hint_t *best = NULL;
+    uint32_t count = 0, ahead;
+    esp_err_t err = ESP_ERR_NOT_FOUND;
+
+    FFFS_CHECK(fffs_vol, "Volume is Null.", invalid);
+    if (moved != NULL)
+        *moved = 0;
+    if (fffs_vol->forward_blocks == 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    fffs_lock(fffs_vol);
+    ahead = fffs_next_sector(fffs_vol, fffs_vol->current_sector);
+    for (int i = 0; i < FFFS_COMPACT_HINTS; i++)
+    {
+        fffs_compact_hint_t *hint = &fffs_vol->compact_hints[i];
+
+        if (hint->sector == UINT32_MAX || hint->sector == fffs_vol->current_sector)
+            continue;
+
+        if (fffs_vol->message_rotate && (hint->sector == ahead || hint->sector == fffs_next_sector(fffs_vol, ahead))) //Written over before long
+        {
+            hint->sector = UINT32_MAX;
+            hint->dead = 0;
+            continue;
+        }
+
+        if (hint->dead * 100ULL >= min_dead_percent * sector_bytes && (best == NULL || hint->dead > best->dead))
+            best = hint;
+    }
+
+    if (best != NULL)
+        err = fffs_sent_wait(fffs_vol);
+    if (best != NULL && err == ESP_OK)
+    {
+        fffs_forward_prune(fffs_vol, 0, 0); //Entries of messages gone since make room
+        err = fffs_sector_compact(fffs_vol, best->sector, &count);
+        if (err == ESP_OK)
+        {
+            ESP_LOGI(TAG, "Compacted sector %d, %d messages moved.", best->sector, count);
+            best->sector = UINT32_MAX;
+            best->dead = 0;
+        }
+    }
+    fffs_unlock(fffs_vol);
+
+    if (moved != NULL)
+        *moved = count;
+    return err;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
+
+/*
+ * Wipes the messages of block from from up to to, excluded, in place, along with the bytes carried into it from
+ * one of them. The size leading a message continued in the next block is kept. Blocks already discarded and
+ * compressed blocks, which cannot be rewritten, are left to the checks on reads.
+ */
+static esp_err_t fffs_block_wipe(fffs_volume_t *fffs_vol, uint32_t block, uint32_t from, uint32_t to)
+{
+    uint8_t *buf = fffs_ram_block(fffs_vol, block);
+    fffs_block_header_t *header;
+    uint16_t offset;
+    int size;
+
+    if (buf == NULL)
+    {
+        buf = fffs_vol->read_buf;
+        FFFS_CHECK(fffs_bdev_read(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot read block %d", fail, block);
+    }
+
+    header = (fffs_block_header_t *)buf;
+    if (header->volume_id != fffs_vol->volume_id || (header->flags & FFFS_BLOCK_COMPRESSED))
+        return ESP_OK;
+
+    if (header->carry > 0 && header->first_message > from && header->first_message <= to)
+        memset(buf + FFFS_BLOCK_DATA, 0, header->carry);
+
+    for (uint32_t k = 0; k < header->count; k++)
+    {
+        if (header->first_message + k < from || header->first_message + k >= to || !fffs_block_message(buf, k, &offset, &size))
+            continue;
+
+        if ((header->flags & FFFS_BLOCK_CONTINUES) && k + 1 == header->count)
+        {
+            offset += sizeof(uint32_t);
+            size -= sizeof(uint32_t);
+        }
+        memset(buf + offset, 0, size);
+    }
+
+    if (buf != fffs_vol->read_buf)
+        fffs_vol->tail_dirty++; //Reaches the card with the next commit
+    else
+        FFFS_CHECK(fffs_bdev_write(fffs_vol->bdev, buf, block, 1) == ESP_OK, "Cannot write block %d", fail, block);
+
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Drops the content of the messages from from up to to, excluded, which start in first_block and end before or in
+ * last_block. Only those two blocks are rewritten. The data blocks between them hold nothing else and are
+ * discarded in runs up to the next sector table, the end of the card or a block still in RAM.
+ */
+static esp_err_t fffs_blocks_drop(fffs_volume_t *fffs_vol, uint32_t first_block, uint32_t last_block, uint32_t from, uint32_t to)
+{
+    uint32_t start = 0, run = 0;
+
+    FFFS_CHECK(fffs_block_wipe(fffs_vol, first_block, from, to) == ESP_OK, "Cannot wipe block %d", fail, first_block);
+    if (first_block == last_block)
+        return ESP_OK;
+
+    for (uint32_t block = fffs_next_data_block(fffs_vol, first_block);; block = fffs_next_data_block(fffs_vol, block))
+    {
+        bool discard = block != last_block && fffs_ram_block(fffs_vol, block) == NULL;
+
+        if (run > 0 && (!discard || block != start + run))
+        {
+            FFFS_CHECK(fffs_bdev_erase(fffs_vol->bdev, start, run) == ESP_OK, "Cannot discard blocks %d-%d", fail, start, start + run - 1);
+            run = 0;
+        }
+
+        if (block == last_block)
+            break;
+
+        if (!discard)
+            FFFS_CHECK(fffs_block_wipe(fffs_vol, block, from, to) == ESP_OK, "Cannot wipe block %d", fail, block);
+        else if (run++ == 0)
+            start = block;
+    }
+
+    FFFS_CHECK(fffs_block_wipe(fffs_vol, last_block, from, to) == ESP_OK, "Cannot wipe block %d", fail, last_block);
+    return ESP_OK;
+
+fail:
+    return ESP_FAIL;
+}
+
+/*
+ * Records the messages from from up to to as dropped in the sector table and persists it before their content is
+ * dropped, so that a power cut in between only leaves content that reads already refuse. Called with the volume
+ * locked and nothing being written.
+ */
+static esp_err_t fffs_messages_drop(fffs_volume_t *fffs_vol, uint32_t from, uint32_t to)
+{
+    fffs_sector_table_t *table = fffs_vol->sector_table;
+    fffs_erased_range_t *range = NULL;
+    bool cleared[FFFS_ERASED_RANGES] = {false}; //<Ranges expired or merged into lo-hi
+    uint32_t first_block, last_block, first_message;
+    uint32_t lo = from, hi = to;
+
+    if (from < fffs_vol->oldest_message_id)
+        from = lo = fffs_vol->oldest_message_id;
+    if (from >= to)
+        return ESP_OK;
+
+    for (int i = 0; i < FFFS_ERASED_RANGES; i++) //Ranges merge when they overlap or touch
+    {
+        fffs_erased_range_t *erased = &table->erased[i];
+
+        if (erased->from == erased->to || erased->to <= fffs_vol->oldest_message_id)
+        {
+            cleared[i] = true;
+            if (range == NULL)
+                range = erased;
+        }
+        else if (lo > fffs_vol->oldest_message_id && erased->from <= hi && lo <= erased->to)
+        {
+            lo = erased->from < lo ? erased->from : lo;
+            hi = erased->to > hi ? erased->to : hi;
+            cleared[i] = true;
+            range = erased;
+        }
+    }
+
+    if (lo > fffs_vol->oldest_message_id && range == NULL)
+    {
+        ESP_LOGW(TAG, "No room to record the erasure of messages %d-%d.", from, to - 1);
+        return ESP_ERR_NO_MEM;
+    }
+
+    //The table is left as it was if the messages cannot be found
+    FFFS_CHECK(fffs_locate(fffs_vol, from, &first_block, &first_message) == ESP_OK, "Cannot locate message %d", fail, from);
+    FFFS_CHECK(fffs_locate(fffs_vol, to, &last_block, &first_message) == ESP_OK, "Cannot locate message %d", fail, to);
+
+    for (int i = 0; i < FFFS_ERASED_RANGES; i++)
+    {
+        if (cleared[i])
+            table->erased[i].from = table->erased[i].to = 0;
+    }
+
+    if (lo > fffs_vol->oldest_message_id)
+    {
+        range->from = lo;
+        range->to = hi;
+    }
+    else
+    {
+        table->low_water = fffs_erased_end(fffs_vol, to);
+        for (int i = 0; i < FFFS_ERASED_RANGES; i++)
+        {
+            if (table->erased[i].to <= table->low_water)
+                table->erased[i].from = table->erased[i].to = 0;
+        }
+        FFFS_CHECK(fffs_oldest_update(fffs_vol) == ESP_OK, "Cannot find the oldest messages", fail);
+    }
+
+    FFFS_CHECK(fffs_checkpoint(fffs_vol) == ESP_OK, "Cannot write sector %d", fail, fffs_vol->current_sector);
+    return fffs_blocks_drop(fffs_vol, first_block, last_block, from, to);
 
 fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_erase_range(fffs_volume_t *fffs_vol, uint32_t from, uint32_t to)
+{
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+
+    FFFS_CHECK(fffs_vol && from <= to, "Invalid arguments.", invalid);
+
+    fffs_lock(fffs_vol);
+    FFFS_CHECK(to <= fffs_vol->message_id, "Message num is too big", unlock);
+    err = fffs_sent_wait(fffs_vol); //Blocks being written are dropped on the card
+    if (err == ESP_OK)
+        err = fffs_messages_drop(fffs_vol, from, to);
+
+unlock:
+    fffs_unlock(fffs_vol);
+
+invalid:
     return err;
-}
\ No newline at end of file
+}
+
+esp_err_t fffs_truncate_before(fffs_volume_t *fffs_vol, uint32_t message_id)
+{
+    return fffs_erase_range(fffs_vol, 0, message_id);
+}
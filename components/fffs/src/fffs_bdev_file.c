@@ -0,0 +1,128 @@
+#if defined(__linux__)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "fffs.h"
+#include "fffs_bdev.h"
+
+#define BDEV_CHECK(a, str, goto_tag, ...)                                         \
+    do                                                                            \
+    {                                                                             \
+        if (!(a))                                                                 \
+        {                                                                         \
+            ESP_LOGE(TAG, "%s(%d): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+            goto goto_tag;                                                        \
+        }                                                                         \
+    } while (0)
+
+static const char *TAG = "FFFS_FILE";
+
+typedef struct
+{
+    int fd;
+    uint8_t *image;
+    size_t image_size;
+} file_bdev_ctx_t;
+
+static esp_err_t file_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    file_bdev_ctx_t *ctx = bdev->ctx;
+    BDEV_CHECK(start_block + block_count <= bdev->capacity, "Read past end of image (block %u)", fail, (unsigned)start_block);
+    memcpy(dst, ctx->image + start_block * bdev->block_size, block_count * bdev->block_size);
+    return ESP_OK;
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t file_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    file_bdev_ctx_t *ctx = bdev->ctx;
+    BDEV_CHECK(start_block + block_count <= bdev->capacity, "Write past end of image (block %u)", fail, (unsigned)start_block);
+    memcpy(ctx->image + start_block * bdev->block_size, src, block_count * bdev->block_size);
+    return ESP_OK;
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t file_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    file_bdev_ctx_t *ctx = bdev->ctx;
+    BDEV_CHECK(start_block + block_count <= bdev->capacity, "Erase past end of image (block %u)", fail, (unsigned)start_block);
+    memset(ctx->image + start_block * bdev->block_size, 0, block_count * bdev->block_size);
+    return ESP_OK;
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t file_bdev_flush(fffs_bdev_t *bdev)
+{
+    file_bdev_ctx_t *ctx = bdev->ctx;
+    return msync(ctx->image, ctx->image_size, MS_SYNC) == 0 ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t file_bdev_deinit(fffs_bdev_t *bdev)
+{
+    file_bdev_ctx_t *ctx = bdev->ctx;
+    msync(ctx->image, ctx->image_size, MS_SYNC);
+    munmap(ctx->image, ctx->image_size);
+    close(ctx->fd);
+    free(ctx);
+    free(bdev);
+    return ESP_OK;
+}
+
+fffs_bdev_t *fffs_bdev_file_open(const char *path, size_t capacity)
+{
+    struct stat st;
+    fffs_bdev_t *bdev = calloc(1, sizeof(fffs_bdev_t));
+    file_bdev_ctx_t *ctx = calloc(1, sizeof(file_bdev_ctx_t));
+    BDEV_CHECK(bdev && ctx, "Cannot allocate file block device.", fail);
+
+    ctx->fd = open(path, O_RDWR | O_CREAT, 0644);
+    BDEV_CHECK(ctx->fd >= 0, "Cannot open image %s", fail, path);
+    BDEV_CHECK(fstat(ctx->fd, &st) == 0, "Cannot stat image %s", fail_fd, path);
+
+    if (capacity == 0)
+        capacity = st.st_size / SD_BLOCK_SIZE;
+    BDEV_CHECK(capacity > 0, "Image %s is empty.", fail_fd, path);
+
+    ctx->image_size = capacity * SD_BLOCK_SIZE;
+    if ((size_t)st.st_size < ctx->image_size)
+        BDEV_CHECK(ftruncate(ctx->fd, ctx->image_size) == 0, "Cannot resize image %s", fail_fd, path);
+
+    ctx->image = mmap(NULL, ctx->image_size, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+    BDEV_CHECK(ctx->image != MAP_FAILED, "Cannot map image %s", fail_fd, path);
+
+    bdev->read = file_bdev_read;
+    bdev->write = file_bdev_write;
+    bdev->erase = file_bdev_erase;
+    bdev->flush = file_bdev_flush;
+    bdev->deinit = file_bdev_deinit;
+    bdev->capacity = capacity;
+    bdev->block_size = SD_BLOCK_SIZE;
+    bdev->ctx = ctx;
+
+    ESP_LOGI(TAG, "Mapped %s: %u blocks.", path, (unsigned)capacity);
+    return bdev;
+
+fail_fd:
+    close(ctx->fd);
+fail:
+    free(ctx);
+    free(bdev);
+    return NULL;
+}
+
+#endif
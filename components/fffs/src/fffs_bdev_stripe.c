@@ -0,0 +1,262 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+
+#include "fffs_bdev.h"
+
+#define STRIPE_CHECK(a, str, goto_tag, ...)                                       \
+    do                                                                            \
+    {                                                                             \
+        if (!(a))                                                                 \
+        {                                                                         \
+            ESP_LOGE(TAG, "%s(%d): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+            goto goto_tag;                                                        \
+        }                                                                         \
+    } while (0)
+
+static const char *TAG = "FFFS_STRIPE";
+
+typedef struct
+{
+    fffs_bdev_t *members[FFFS_STRIPE_MAX];
+    size_t count;
+    uint32_t stripe_blocks;     //<Blocks written to a member before moving to the next
+    bool busy[FFFS_STRIPE_MAX]; //<Member has a write under way
+    esp_err_t err;              //<First error of the writes started with write_start
+} stripe_bdev_ctx_t;
+
+/*
+ * Maps logical block to its member and returns the block on the member. *run is set to the blocks left in the
+ * stripe unit, which lie one after the other on the member.
+ */
+static size_t stripe_map(const stripe_bdev_ctx_t *ctx, size_t block, size_t *member, size_t *run)
+{
+    size_t unit = block / ctx->stripe_blocks;
+
+    *member = unit % ctx->count;
+    *run = ctx->stripe_blocks - block % ctx->stripe_blocks;
+    return unit / ctx->count * ctx->stripe_blocks + block % ctx->stripe_blocks;
+}
+
+static esp_err_t stripe_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+    size_t member, run;
+
+    while (block_count > 0)
+    {
+        size_t block = stripe_map(ctx, start_block, &member, &run);
+        if (run > block_count)
+            run = block_count;
+
+        esp_err_t err = fffs_bdev_read(ctx->members[member], dst, block, run);
+        if (err != ESP_OK)
+            return err;
+
+        dst = (uint8_t *)dst + run * bdev->block_size;
+        start_block += run;
+        block_count -= run;
+    }
+
+    return ESP_OK;
+}
+
+/*
+ * Waits for the writes under way on every member and keeps the first error in *err.
+ */
+static void stripe_bdev_idle(stripe_bdev_ctx_t *ctx, esp_err_t *err)
+{
+    for (size_t i = 0; i < ctx->count; i++)
+    {
+        if (!ctx->busy[i])
+            continue;
+
+        esp_err_t written = fffs_bdev_write_wait(ctx->members[i]);
+        if (*err == ESP_OK)
+            *err = written;
+        ctx->busy[i] = false;
+    }
+}
+
+/*
+ * Starts the stripe units of the range on their members, so that members with write_start write side by side. A
+ * member given a second unit is waited for first, as its device keeps the result of its last write only. The first
+ * error is kept in *err.
+ */
+static void stripe_bdev_start(stripe_bdev_ctx_t *ctx, const void *src, size_t start_block, size_t block_count, size_t block_size, esp_err_t *err)
+{
+    size_t member, run;
+
+    while (block_count > 0)
+    {
+        size_t block = stripe_map(ctx, start_block, &member, &run);
+        if (run > block_count)
+            run = block_count;
+
+        if (ctx->busy[member])
+        {
+            esp_err_t written = fffs_bdev_write_wait(ctx->members[member]);
+            if (*err == ESP_OK)
+                *err = written;
+        }
+
+        esp_err_t started = fffs_bdev_write_start(ctx->members[member], src, block, run);
+        if (*err == ESP_OK)
+            *err = started;
+        ctx->busy[member] = true;
+
+        src = (const uint8_t *)src + run * block_size;
+        start_block += run;
+        block_count -= run;
+    }
+}
+
+static esp_err_t stripe_bdev_write_wait(fffs_bdev_t *bdev)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+    esp_err_t err;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    err = ctx->err;
+    ctx->err = ESP_OK;
+    return err;
+}
+
+static esp_err_t stripe_bdev_write_start(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    stripe_bdev_start(ctx, src, start_block, block_count, bdev->block_size, &ctx->err);
+    return ESP_OK;
+}
+
+/*
+ * Writes the units of the range side by side as well, but only returns once they are all on the members. The
+ * result of a write started before is left for write_wait.
+ */
+static esp_err_t stripe_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+    esp_err_t err = ESP_OK;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    stripe_bdev_start(ctx, src, start_block, block_count, bdev->block_size, &err);
+    stripe_bdev_idle(ctx, &err);
+    return err;
+}
+
+/*
+ * The blocks of a range on one member lie one after the other, so each member gets one erase command.
+ */
+static esp_err_t stripe_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+    size_t first[FFFS_STRIPE_MAX], count[FFFS_STRIPE_MAX] = {0};
+    size_t member, run;
+    esp_err_t err = ESP_OK;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    while (block_count > 0)
+    {
+        size_t block = stripe_map(ctx, start_block, &member, &run);
+        if (run > block_count)
+            run = block_count;
+
+        if (count[member] == 0)
+            first[member] = block;
+        count[member] += run;
+
+        start_block += run;
+        block_count -= run;
+    }
+
+    for (size_t i = 0; i < ctx->count && err == ESP_OK; i++)
+    {
+        if (count[i] > 0)
+            err = fffs_bdev_erase(ctx->members[i], first[i], count[i]);
+    }
+
+    return err;
+}
+
+static esp_err_t stripe_bdev_flush(fffs_bdev_t *bdev)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+    esp_err_t err = ESP_OK;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    for (size_t i = 0; i < ctx->count; i++)
+    {
+        esp_err_t flushed = fffs_bdev_flush(ctx->members[i]);
+        if (err == ESP_OK)
+            err = flushed;
+    }
+
+    return err;
+}
+
+static esp_err_t stripe_bdev_deinit(fffs_bdev_t *bdev)
+{
+    stripe_bdev_ctx_t *ctx = bdev->ctx;
+
+    stripe_bdev_idle(ctx, &ctx->err);
+    for (size_t i = 0; i < ctx->count; i++)
+        fffs_bdev_delete(ctx->members[i]);
+
+    free(ctx);
+    free(bdev);
+    return ESP_OK;
+}
+
+fffs_bdev_t *fffs_bdev_stripe_create(fffs_bdev_t *const *members, size_t count, uint32_t stripe_blocks)
+{
+    fffs_bdev_t *bdev = NULL;
+    stripe_bdev_ctx_t *ctx = NULL;
+    uint32_t capacity = UINT32_MAX;
+    bool overlap = false;
+
+    STRIPE_CHECK(members && count >= 1 && count <= FFFS_STRIPE_MAX && stripe_blocks > 0, "Invalid arguments.", err);
+    for (size_t i = 0; i < count; i++)
+    {
+        STRIPE_CHECK(members[i], "Member %d is NULL.", err, (int)i);
+        STRIPE_CHECK(members[i]->block_size == members[0]->block_size, "Member %d has another block size.", err, (int)i);
+        if (members[i]->capacity < capacity)
+            capacity = members[i]->capacity;
+        if (members[i]->write_start != NULL)
+            overlap = true;
+    }
+    STRIPE_CHECK(capacity >= stripe_blocks, "Members are smaller than a stripe unit.", err);
+
+    bdev = calloc(1, sizeof(fffs_bdev_t));
+    ctx = calloc(1, sizeof(stripe_bdev_ctx_t));
+    STRIPE_CHECK(bdev && ctx, "Cannot allocate striped device.", fail);
+
+    memcpy(ctx->members, members, count * sizeof(fffs_bdev_t *));
+    ctx->count = count;
+    ctx->stripe_blocks = stripe_blocks;
+
+    bdev->read = stripe_bdev_read;
+    bdev->write = stripe_bdev_write;
+    bdev->erase = stripe_bdev_erase;
+    bdev->flush = stripe_bdev_flush;
+    bdev->deinit = stripe_bdev_deinit;
+    if (overlap) //Otherwise the volume would keep a second stage buffer for nothing
+    {
+        bdev->write_start = stripe_bdev_write_start;
+        bdev->write_wait = stripe_bdev_write_wait;
+    }
+    bdev->capacity = capacity / stripe_blocks * stripe_blocks * count; //The rest of larger members is left unused
+    bdev->block_size = members[0]->block_size;
+    bdev->ctx = ctx;
+    return bdev;
+
+fail:
+    free(ctx);
+    free(bdev);
+err:
+    return NULL;
+}
@@ -1,17 +1,35 @@
 #include "esp_err.h"
 #include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 #include "driver/sdmmc_host.h"
 #include "driver/sdspi_host.h"
 #include "sdmmc_cmd.h"
 
+#include "fffs.h"
+#include "fffs_bdev.h"
 #include "fffs_disk.h"
 
-#define USE_SPI_MODE
-#define PIN_NUM_MISO 19
-#define PIN_NUM_MOSI 23
-#define PIN_NUM_CLK 18
-#define PIN_NUM_CS 4
+#define ZERO_BUF_BLOCKS 32      //Blocks written per command when erasing with zeros
+#define NATIVE_ERASE_BLOCKS 256 //Smaller ranges are quicker to overwrite than to erase
+
+#if defined(__has_include)
+#if __has_include("esp_idf_version.h")
+#include "esp_idf_version.h"
+#endif
+#endif
+
+#if defined(ESP_IDF_VERSION_VAL)
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 2, 0)
+#define SD_SPI_DEVICE //sdspi_host_init_device on a bus of the SPI master driver, the only way from IDF 5 on
+#endif
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#define SD_NATIVE_ERASE //sdmmc_erase_sectors (CMD32/33/38) is available
+#endif
+#endif
 
 #define DISK_CHECK(a, str, goto_tag, ...)                                         \
     do                                                                            \
@@ -26,44 +44,91 @@
 static const char *TAG = "FFFS_DISK";
 
 sdmmc_card_t *sd_card_init()
+{
+    sd_card_config_t config = SD_CARD_CONFIG_DEFAULT();
+    return sd_card_init_with_config(&config);
+}
+
+sdmmc_card_t *sd_card_init_with_config(const sd_card_config_t *config)
 {
     sdmmc_card_t *s_card = NULL;
+    sdmmc_host_t host;
+    esp_err_t err = ESP_OK;
 
-    ESP_LOGI(TAG, "Initializing SD card");
-    ESP_LOGI(TAG, "Using SPI peripheral");
+    DISK_CHECK(config, "Configuration is NULL.", fail);
 
-    sdmmc_host_t host = SDSPI_HOST_DEFAULT();
+    s_card = malloc(sizeof(sdmmc_card_t));
+    DISK_CHECK(s_card, "SD memory allocation failed.", fail);
 
-    sdspi_slot_config_t slot_config = SDSPI_SLOT_CONFIG_DEFAULT();
+    if (config->bus == SD_CARD_SDMMC)
+    {
+        ESP_LOGI(TAG, "Initializing SD card in SDMMC slot %d", config->slot);
 
-    slot_config.gpio_miso = PIN_NUM_MISO;
-    slot_config.gpio_mosi = PIN_NUM_MOSI;
-    slot_config.gpio_sck = PIN_NUM_CLK;
-    slot_config.gpio_cs = PIN_NUM_CS;
+        sdmmc_host_t sdmmc_host = SDMMC_HOST_DEFAULT();
+        sdmmc_slot_config_t slot_config = SDMMC_SLOT_CONFIG_DEFAULT();
 
-    esp_err_t err = ESP_OK;
+        host = sdmmc_host;
+        host.slot = config->slot;
+        slot_config.width = config->width;
+        if (config->width == 1)
+            host.flags &= ~SDMMC_HOST_FLAG_4BIT;
 
-    s_card = malloc(sizeof(sdmmc_card_t));
-    if (s_card == NULL)
-    {
-        ESP_LOGD(TAG, "SD memory allocation failed.");
-        goto fail;
+        err = (*host.init)();
+        DISK_CHECK(err == ESP_OK || err == ESP_ERR_INVALID_STATE, "host init returned rc=0x%x", fail, err); //Already up for the other slot
+
+        err = sdmmc_host_init_slot(host.slot, &slot_config);
+        DISK_CHECK(err == ESP_OK, "slot_config returned rc=0x%x", fail, err);
     }
+    else
+    {
+        ESP_LOGI(TAG, "Initializing SD card on SPI host %d", config->slot);
 
-    err = (*host.init)();
+        sdmmc_host_t sdspi_host = SDSPI_HOST_DEFAULT();
 
-    if (err != ESP_OK)
-    {
-        ESP_LOGD(TAG, "host init returned rc=0x%x", err);
-        goto fail;
-    }
+        host = sdspi_host;
+        host.slot = config->slot;
 
-    err = sdspi_host_init_slot(host.slot, &slot_config);
+#ifdef SD_SPI_DEVICE
+        spi_bus_config_t bus_config = {
+            .mosi_io_num = config->pin_mosi,
+            .miso_io_num = config->pin_miso,
+            .sclk_io_num = config->pin_clk,
+            .quadwp_io_num = -1,
+            .quadhd_io_num = -1,
+            .max_transfer_sz = 4000,
+        };
+        sdspi_device_config_t device_config = SDSPI_DEVICE_CONFIG_DEFAULT();
+        sdspi_dev_handle_t device;
 
-    if (err != ESP_OK)
-    {
-        ESP_LOGD(TAG, "slot_config returned rc=0x%x", err);
-        goto fail;
+#ifdef SDSPI_DEFAULT_DMA
+        err = spi_bus_initialize(config->slot, &bus_config, SDSPI_DEFAULT_DMA);
+#else
+        err = spi_bus_initialize(config->slot, &bus_config, 1); //DMA channel 1, before channels were picked automatically
+#endif
+        DISK_CHECK(err == ESP_OK || err == ESP_ERR_INVALID_STATE, "SPI bus init returned rc=0x%x", fail, err); //Already up for another device
+
+        err = (*host.init)();
+        DISK_CHECK(err == ESP_OK || err == ESP_ERR_INVALID_STATE, "host init returned rc=0x%x", fail, err);
+
+        device_config.host_id = config->slot;
+        device_config.gpio_cs = config->pin_cs;
+        err = sdspi_host_init_device(&device_config, &device);
+        DISK_CHECK(err == ESP_OK, "device init returned rc=0x%x", fail, err);
+        host.slot = device;
+#else
+        sdspi_slot_config_t slot_config = SDSPI_SLOT_CONFIG_DEFAULT();
+
+        slot_config.gpio_miso = config->pin_miso;
+        slot_config.gpio_mosi = config->pin_mosi;
+        slot_config.gpio_sck = config->pin_clk;
+        slot_config.gpio_cs = config->pin_cs;
+
+        err = (*host.init)();
+        DISK_CHECK(err == ESP_OK || err == ESP_ERR_INVALID_STATE, "host init returned rc=0x%x", fail, err);
+
+        err = sdspi_host_init_slot(host.slot, &slot_config);
+        DISK_CHECK(err == ESP_OK, "slot_config returned rc=0x%x", fail, err);
+#endif
     }
 
     err = sdmmc_card_init(&host, s_card);
@@ -88,4 +153,111 @@ esp_err_t sd_card_deinit(sdmmc_card_t *s_card)
         return ESP_OK;
     free(s_card);
     return ESP_OK;
-}
\ No newline at end of file
+}
+
+/*
+ * A volume reads while its writer task is in the middle of a write with the volume lock dropped, and the card
+ * cannot take a command while another one is under way: a card busy with a multi-block write refuses reads, and
+ * SDSPI holds CS for the whole command. Every command therefore goes through lock.
+ */
+typedef struct
+{
+    sdmmc_card_t *card;
+    void *zero_buf;
+    SemaphoreHandle_t lock;
+} sd_bdev_ctx_t;
+
+static esp_err_t sd_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    sd_bdev_ctx_t *ctx = bdev->ctx;
+
+    xSemaphoreTake(ctx->lock, portMAX_DELAY);
+    esp_err_t err = sdmmc_read_sectors(ctx->card, dst, start_block, block_count);
+    xSemaphoreGive(ctx->lock);
+    return err;
+}
+
+static esp_err_t sd_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    sd_bdev_ctx_t *ctx = bdev->ctx;
+
+    xSemaphoreTake(ctx->lock, portMAX_DELAY);
+    esp_err_t err = sdmmc_write_sectors(ctx->card, src, start_block, block_count);
+    xSemaphoreGive(ctx->lock);
+    return err;
+}
+
+static esp_err_t sd_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    sd_bdev_ctx_t *ctx = bdev->ctx;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(ctx->lock, portMAX_DELAY);
+#ifdef SD_NATIVE_ERASE
+    if (block_count >= NATIVE_ERASE_BLOCKS && ctx->card->scr.erase_mem_state == 0) //Only cards that erase to zeros
+    {
+        err = sdmmc_erase_sectors(ctx->card, start_block, block_count, SDMMC_ERASE_ARG);
+        if (err == ESP_OK)
+            block_count = 0;
+        else
+            ESP_LOGW(TAG, "Native erase failed (0x%x), writing zeros.", err);
+        err = ESP_OK;
+    }
+#endif
+
+    while (block_count > 0 && err == ESP_OK)
+    {
+        size_t count = block_count < ZERO_BUF_BLOCKS ? block_count : ZERO_BUF_BLOCKS;
+        err = sdmmc_write_sectors(ctx->card, ctx->zero_buf, start_block, count);
+        start_block += count;
+        block_count -= count;
+    }
+
+    xSemaphoreGive(ctx->lock);
+    return err;
+}
+
+static esp_err_t sd_bdev_deinit(fffs_bdev_t *bdev)
+{
+    sd_bdev_ctx_t *ctx = bdev->ctx;
+
+    vSemaphoreDelete(ctx->lock);
+    heap_caps_free(ctx->zero_buf);
+    free(ctx);
+    free(bdev);
+    return ESP_OK;
+}
+
+fffs_bdev_t *sd_card_bdev_create(sdmmc_card_t *s_card)
+{
+    DISK_CHECK(s_card, "SD card is NULL.", err);
+
+    fffs_bdev_t *bdev = calloc(1, sizeof(fffs_bdev_t));
+    sd_bdev_ctx_t *ctx = calloc(1, sizeof(sd_bdev_ctx_t));
+    DISK_CHECK(bdev && ctx, "Cannot allocate SD block device.", fail);
+
+    ctx->card = s_card;
+    ctx->zero_buf = heap_caps_calloc(ZERO_BUF_BLOCKS, SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+    DISK_CHECK(ctx->zero_buf, "Cannot allocate SD erase buffer.", fail);
+    ctx->lock = xSemaphoreCreateMutex();
+    DISK_CHECK(ctx->lock, "Cannot create SD card lock.", fail);
+
+    bdev->read = sd_bdev_read;
+    bdev->write = sd_bdev_write;
+    bdev->erase = sd_bdev_erase;
+    bdev->flush = NULL; //sdmmc_write_sectors only returns once the card has accepted the data
+    bdev->deinit = sd_bdev_deinit;
+    bdev->capacity = s_card->csd.capacity;
+    bdev->block_size = s_card->csd.sector_size;
+    bdev->ctx = ctx;
+
+    return bdev;
+
+fail:
+    if (ctx != NULL)
+        heap_caps_free(ctx->zero_buf);
+    free(ctx);
+    free(bdev);
+err:
+    return NULL;
+}
@@ -0,0 +1,176 @@
+#include <string.h>
+
+#include "fffs_lz.h"
+
+#define MIN_MATCH 4
+
+static inline uint32_t fffs_lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t fffs_lz_hash(const uint8_t *p)
+{
+    return (fffs_lz_read32(p) * 2654435761u) >> (32 - FFFS_LZ_HASH_BITS);
+}
+
+void fffs_lz_reset(uint16_t *table)
+{
+    memset(table, 0xFF, FFFS_LZ_HASH_SIZE * sizeof(uint16_t));
+}
+
+/*
+ * Writes the extra bytes of a literal or match length of 15 or more.
+ */
+static uint8_t *fffs_lz_length(uint8_t *op, const uint8_t *limit, int length)
+{
+    for (length -= 15; length >= 255; length -= 255)
+    {
+        if (op >= limit)
+            return NULL;
+        *op++ = 255;
+    }
+
+    if (op >= limit)
+        return NULL;
+    *op++ = length;
+    return op;
+}
+
+/*
+ * Writes lit literals followed by a match, or the literals only when match is 0 which ends the message.
+ */
+static uint8_t *fffs_lz_sequence(uint8_t *op, const uint8_t *limit, const uint8_t *literals, int lit, int offset, int match)
+{
+    uint8_t *token = op++;
+
+    if (token >= limit)
+        return NULL;
+
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15 && (op = fffs_lz_length(op, limit, lit)) == NULL)
+        return NULL;
+
+    if (lit > limit - op)
+        return NULL;
+    memcpy(op, literals, lit);
+    op += lit;
+
+    if (match == 0)
+        return op;
+
+    if (limit - op < 2)
+        return NULL;
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+
+    match -= MIN_MATCH;
+    *token |= match >= 15 ? 15 : match;
+    if (match >= 15 && (op = fffs_lz_length(op, limit, match)) == NULL)
+        return NULL;
+
+    return op;
+}
+
+int fffs_lz_compress(const uint8_t *window, int start, int end, uint16_t *table, int *hashed, uint8_t *out, int cap)
+{
+    const uint8_t *limit = out + cap;
+    uint8_t *op = out;
+    int anchor = start;
+    int ip = start;
+
+    for (; *hashed < start && *hashed + MIN_MATCH <= end; (*hashed)++) //Content added since the last call
+        table[fffs_lz_hash(window + *hashed)] = *hashed;
+
+    while (ip + MIN_MATCH <= end)
+    {
+        uint32_t h = fffs_lz_hash(window + ip);
+        int ref = table[h];
+        int match = MIN_MATCH;
+
+        table[h] = ip;
+        if (ref == FFFS_LZ_EMPTY || ref >= ip || fffs_lz_read32(window + ref) != fffs_lz_read32(window + ip))
+        {
+            ip++;
+            continue;
+        }
+
+        while (ip + match < end && window[ref + match] == window[ip + match])
+            match++;
+
+        op = fffs_lz_sequence(op, limit, window + anchor, ip - anchor, ip - ref, match);
+        if (op == NULL)
+            return 0;
+
+        for (int p = ip + 1; p < ip + match && p + MIN_MATCH <= end; p++)
+            table[fffs_lz_hash(window + p)] = p;
+
+        ip += match;
+        anchor = ip;
+    }
+
+    if (end - (MIN_MATCH - 1) > *hashed) //The last bytes are hashed once more content follows
+        *hashed = end - (MIN_MATCH - 1);
+
+    op = fffs_lz_sequence(op, limit, window + anchor, end - anchor, 0, 0);
+    return op == NULL ? 0 : op - out;
+}
+
+int fffs_lz_decompress(const uint8_t *src, int len, uint8_t *window, int pos, int cap)
+{
+    const uint8_t *end = src + len;
+    int lit, match, offset, b;
+
+    while (src < end)
+    {
+        int token = *src++;
+
+        lit = token >> 4;
+        if (lit == 15)
+        {
+            do
+            {
+                if (src >= end)
+                    return -1;
+                b = *src++;
+                lit += b;
+            } while (b == 255);
+        }
+
+        if (lit > end - src || lit > cap - pos)
+            return -1;
+        memcpy(window + pos, src, lit);
+        pos += lit;
+        src += lit;
+
+        if (src == end) //The last sequence has no match
+            break;
+
+        if (end - src < 2)
+            return -1;
+        offset = src[0] | src[1] << 8;
+        src += 2;
+
+        match = (token & 15) + MIN_MATCH;
+        if ((token & 15) == 15)
+        {
+            do
+            {
+                if (src >= end)
+                    return -1;
+                b = *src++;
+                match += b;
+            } while (b == 255);
+        }
+
+        if (offset == 0 || offset > pos || match > cap - pos)
+            return -1;
+
+        for (; match > 0; match--, pos++) //Byte by byte, the match may overlap what it copies
+            window[pos] = window[pos - offset];
+    }
+
+    return pos;
+}
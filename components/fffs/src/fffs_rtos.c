@@ -2,6 +2,9 @@
 #include "freertos/semphr.h"
 #include "freertos/task.h"
 
+#include <stdatomic.h>
+#include <string.h>
+
 #include "esp_err.h"
 #include "esp_log.h"
 
@@ -20,6 +23,564 @@ static char *TAG = "FSRTOS";
         }                                                                         \
     } while (0)
 
+typedef struct
+{
+    atomic_uint sequence; //<Position the slot is free for, or position + 1 once it holds that message
+    uint16_t size;
+    uint8_t data[];
+} fffs_rt_slot_t;
+
+/*
+ * Bounded multi-producer ring (D. Vyukov). Producers claim a position with a CAS on enqueue_pos, copy the
+ * message and publish it through the slot sequence. Positions are claimed in order, so the message id is
+ * base_id + position. Messages dropped from the ring leave a gap in positions that the writer task fills with
+ * empty messages to keep later ids in step.
+ */
+struct fffs_rt_async
+{
+    uint8_t *slots;
+    uint32_t slot_stride;
+    uint32_t mask;
+    atomic_uint enqueue_pos;
+    atomic_uint dequeue_pos;
+    atomic_uint written_pos;       //<Every position before this one is on the volume
+    uint32_t base_id;              //<Message id of position 0
+    fffs_rt_async_config_t config;
+    TaskHandle_t task;
+    SemaphoreHandle_t xStopped;
+    volatile bool stop;
+    uint8_t *batch_data;           //<batch messages of slot_size bytes copied out of the ring
+    fffs_message_t *batch;
+    atomic_uint queued;
+    atomic_uint written;
+    atomic_uint dropped_oldest;
+    atomic_uint dropped_newest;
+    atomic_uint blocked;
+    atomic_uint failed;
+    uint32_t next_id;              //<Id the next message written by the writer task must take
+    volatile bool broken;          //<The volume could not be brought back in step with the positions
+};
+
+struct fffs_rt_compact
+{
+    fffs_rt_compact_config_t config;
+    TaskHandle_t task;
+    SemaphoreHandle_t xStopped;
+    volatile bool stop;
+};
+
+struct fffs_rt_subscription
+{
+    fffs_head_t *head;
+    fffs_cursor_t *cursor;
+    SemaphoreHandle_t xWritten;           //<Given after every write, taken by a subscriber that has caught up
+    fffs_rt_subscription_t *next;
+};
+
+static inline fffs_rt_slot_t *fffs_rt_slot(fffs_rt_async_t *async, uint32_t pos)
+{
+    return (fffs_rt_slot_t *)(async->slots + (pos & async->mask) * async->slot_stride);
+}
+
+static bool fffs_rt_ring_push(fffs_rt_async_t *async, const void *message, uint16_t size, uint32_t *pos)
+{
+    fffs_rt_slot_t *slot;
+    uint32_t claim = atomic_load_explicit(&async->enqueue_pos, memory_order_relaxed);
+
+    while (1)
+    {
+        slot = fffs_rt_slot(async, claim);
+        int32_t diff = (int32_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - claim);
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&async->enqueue_pos, &claim, claim + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false; //Full
+        else
+            claim = atomic_load_explicit(&async->enqueue_pos, memory_order_relaxed);
+    }
+
+    memcpy(slot->data, message, size);
+    slot->size = size;
+    atomic_store_explicit(&slot->sequence, claim + 1, memory_order_release);
+    *pos = claim;
+    return true;
+}
+
+/*
+ * Takes the oldest message out of the ring, copying it to message unless that is NULL. Used by the writer task
+ * and by producers dropping the oldest message, so the claim is a CAS as well.
+ */
+static bool fffs_rt_ring_pop(fffs_rt_async_t *async, void *message, uint16_t *size, uint32_t *pos)
+{
+    fffs_rt_slot_t *slot;
+    uint32_t claim = atomic_load_explicit(&async->dequeue_pos, memory_order_relaxed);
+
+    while (1)
+    {
+        slot = fffs_rt_slot(async, claim);
+        int32_t diff = (int32_t)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - (claim + 1));
+
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&async->dequeue_pos, &claim, claim + 1, memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        else if (diff < 0)
+            return false; //Empty, or the producer is still copying
+        else
+            claim = atomic_load_explicit(&async->dequeue_pos, memory_order_relaxed);
+    }
+
+    if (message != NULL)
+        memcpy(message, slot->data, slot->size);
+    if (size != NULL)
+        *size = slot->size;
+    atomic_store_explicit(&slot->sequence, claim + async->mask + 1, memory_order_release);
+    *pos = claim;
+    return true;
+}
+
+/*
+ * Wakes the subscribers waiting for messages. Called with xSemaphore held once the messages can be read.
+ */
+static void fffs_rt_notify(fffs_head_t *fffs_head)
+{
+    for (fffs_rt_subscription_t *subscription = fffs_head->subscriptions; subscription != NULL; subscription = subscription->next)
+        xSemaphoreGive(subscription->xWritten);
+}
+
+/*
+ * Writes empty messages for the ids a failed batch did not take, as for dropped messages, so that the ids handed
+ * out for later positions stay valid. Should the volume refuse them as well, or have gone past them, asynchronous
+ * writes are refused from then on. Called with xSemaphore held.
+ */
+static void fffs_rt_async_fill(fffs_head_t *fffs_head)
+{
+    fffs_rt_async_t *async = fffs_head->async;
+    fffs_volume_t *vol = fffs_head->vol;
+
+    while ((int32_t)(async->next_id - vol->message_id) > 0)
+    {
+        uint32_t before = vol->message_id;
+        size_t count = async->next_id - vol->message_id;
+
+        if (count > async->config.batch)
+            count = async->config.batch;
+        for (size_t i = 0; i < count; i++)
+        {
+            async->batch[i].data = NULL;
+            async->batch[i].size = 0;
+        }
+
+        if (fffs_write_batch(vol, async->batch, count, NULL) != ESP_OK && vol->message_id == before)
+            break;
+    }
+
+    if (vol->message_id != async->next_id)
+    {
+        ESP_LOGE(TAG, "Message %d was written as %d, asynchronous writes are refused.", async->next_id, vol->message_id);
+        async->broken = true;
+    }
+}
+
+static void fffs_rt_async_commit(fffs_head_t *fffs_head, size_t count)
+{
+    fffs_rt_async_t *async = fffs_head->async;
+    esp_err_t err;
+
+    if (count == 0)
+        return;
+
+    if (async->broken) //Their ids cannot be kept
+    {
+        async->next_id += count;
+        atomic_fetch_add(&async->failed, count);
+        return;
+    }
+
+    while (xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) != pdTRUE)
+        ;
+    err = fffs_write_batch(fffs_head->vol, async->batch, count, NULL);
+    async->next_id += count;
+    if (err != ESP_OK)
+        fffs_rt_async_fill(fffs_head);
+    fffs_rt_notify(fffs_head);
+    xSemaphoreGive(fffs_head->xSemaphore);
+
+    if (err == ESP_OK)
+        atomic_fetch_add(&async->written, count);
+    else
+    {
+        ESP_LOGE(TAG, "Cannot write %u queued messages", (unsigned)count);
+        atomic_fetch_add(&async->failed, count);
+    }
+}
+
+/*
+ * Moves everything queued to the volume, batch messages at a time. Returns the position after the last one.
+ */
+static uint32_t fffs_rt_async_drain(fffs_head_t *fffs_head, uint32_t next_pos)
+{
+    fffs_rt_async_t *async = fffs_head->async;
+    uint32_t pos;
+    uint16_t size;
+    size_t count = 0;
+
+    while (fffs_rt_ring_pop(async, async->batch_data + count * async->config.slot_size, &size, &pos))
+    {
+        if (pos != next_pos) //Messages were dropped while queued
+        {
+            fffs_rt_async_commit(fffs_head, count);
+            memmove(async->batch_data, async->batch_data + count * async->config.slot_size, size);
+            count = 0;
+
+            while (next_pos != pos)
+            {
+                async->batch[count].data = NULL;
+                async->batch[count].size = 0;
+                next_pos++;
+                if (++count == async->config.batch)
+                {
+                    fffs_rt_async_commit(fffs_head, count);
+                    count = 0;
+                }
+            }
+
+            fffs_rt_async_commit(fffs_head, count);
+            count = 0;
+        }
+
+        async->batch[count].data = async->batch_data + count * async->config.slot_size;
+        async->batch[count].size = size;
+        next_pos++;
+
+        if (++count == async->config.batch)
+        {
+            fffs_rt_async_commit(fffs_head, count);
+            atomic_store(&async->written_pos, next_pos);
+            count = 0;
+        }
+    }
+
+    fffs_rt_async_commit(fffs_head, count);
+    atomic_store(&async->written_pos, next_pos);
+    return next_pos;
+}
+
+static void fffs_rt_async_task(void *arg)
+{
+    fffs_head_t *fffs_head = arg;
+    fffs_rt_async_t *async = fffs_head->async;
+    uint32_t next_pos = 0;
+
+    while (!async->stop)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(100));
+        next_pos = fffs_rt_async_drain(fffs_head, next_pos);
+    }
+
+    fffs_rt_async_drain(fffs_head, next_pos);
+    xSemaphoreGive(async->xStopped);
+    vTaskDelete(NULL);
+}
+
+#define FFFS_RT_ASYNC_CLOSED 0x80000000u
+
+/*
+ * fffs_rt_async_stop frees the ring, so callers other than the writer task pin it while they use it. Stop sets
+ * FFFS_RT_ASYNC_CLOSED so that no new caller gets in and waits for the count below it to drop to zero before it
+ * stops the writer task. fffs_head->async is only cleared after that, so synchronous writes stay refused until
+ * everything queued is on the volume.
+ */
+static fffs_rt_async_t *fffs_rt_async_pin(fffs_head_t *fffs_head)
+{
+    fffs_rt_async_t *async;
+
+    if (atomic_fetch_add(&fffs_head->async_users, 1) & FFFS_RT_ASYNC_CLOSED || (async = fffs_head->async) == NULL)
+    {
+        atomic_fetch_sub(&fffs_head->async_users, 1);
+        return NULL;
+    }
+    return async;
+}
+
+static void fffs_rt_async_unpin(fffs_head_t *fffs_head)
+{
+    atomic_fetch_sub(&fffs_head->async_users, 1);
+}
+
+static void fffs_rt_async_drain_wait(fffs_rt_async_t *async)
+{
+    uint32_t end = atomic_load(&async->enqueue_pos);
+
+    xTaskNotifyGive(async->task);
+    while ((int32_t)(atomic_load(&async->written_pos) - end) < 0)
+        vTaskDelay(1);
+}
+
+static void fffs_rt_async_delete(fffs_rt_async_t *async)
+{
+    if (async == NULL)
+        return;
+
+    if (async->xStopped != NULL)
+        vSemaphoreDelete(async->xStopped);
+    free(async->batch);
+    free(async->batch_data);
+    free(async->slots);
+    free(async);
+}
+
+esp_err_t fffs_rt_async_start(fffs_head_t *fffs_head, const fffs_rt_async_config_t *config)
+{
+    fffs_rt_async_t *async = NULL;
+    uint32_t slots = 1;
+
+    FRTOS_CHECK(fffs_head && config, "Head cannot be NULL.", err);
+    FRTOS_CHECK(fffs_head->async == NULL, "Asynchronous mode is already running", err);
+    FRTOS_CHECK(config->slot_size > 0 && config->slot_size <= fffs_head->vol->config.message_max, "Invalid slot size %d", err, config->slot_size);
+    FRTOS_CHECK(config->slots > 0 && config->batch > 0, "Invalid ring size", err);
+
+    while (slots < config->slots)
+        slots <<= 1;
+
+    async = calloc(1, sizeof(fffs_rt_async_t));
+    FRTOS_CHECK(async, "Cannot allocate ring", err);
+
+    async->config = *config;
+    async->config.slots = slots;
+    async->mask = slots - 1;
+    async->slot_stride = (sizeof(fffs_rt_slot_t) + config->slot_size + 3) & ~3;
+    async->slots = malloc(slots * async->slot_stride);
+    async->batch_data = malloc(config->batch * config->slot_size);
+    async->batch = malloc(config->batch * sizeof(fffs_message_t));
+    async->xStopped = xSemaphoreCreateBinary();
+    FRTOS_CHECK(async->slots && async->batch_data && async->batch && async->xStopped, "Cannot allocate ring", fail);
+
+    for (uint32_t i = 0; i < slots; i++)
+        atomic_init(&fffs_rt_slot(async, i)->sequence, i);
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+    async->base_id = fffs_head->vol->message_id; //Nothing else writes from here on
+    async->next_id = async->base_id;
+    fffs_head->async = async;
+    xSemaphoreGive(fffs_head->xSemaphore);
+
+    if (xTaskCreate(fffs_rt_async_task, "fffs_writer", config->stack_size, fffs_head, config->priority, &async->task) != pdPASS)
+    {
+        fffs_head->async = NULL;
+        FRTOS_CHECK(false, "Cannot create writer task", fail);
+    }
+
+    ESP_LOGI(TAG, "Asynchronous writes from message %d, %d slots of %d bytes.", async->base_id, slots, config->slot_size);
+    return ESP_OK;
+
+fail:
+    fffs_rt_async_delete(async);
+
+err:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_async_stop(fffs_head_t *fffs_head)
+{
+    FRTOS_CHECK(fffs_head && fffs_head->async, "Asynchronous mode is not running", err);
+    FRTOS_CHECK(!(atomic_fetch_or(&fffs_head->async_users, FFFS_RT_ASYNC_CLOSED) & FFFS_RT_ASYNC_CLOSED), "Asynchronous mode is already stopping", err);
+
+    while ((atomic_load(&fffs_head->async_users) & ~FFFS_RT_ASYNC_CLOSED) != 0)
+        vTaskDelay(1);
+
+    fffs_rt_async_t *async = fffs_head->async;
+    async->stop = true;
+    xTaskNotifyGive(async->task);
+    xSemaphoreTake(async->xStopped, portMAX_DELAY);
+
+    fffs_head->async = NULL;
+    fffs_rt_async_delete(async);
+    atomic_store(&fffs_head->async_users, 0);
+    return ESP_OK;
+
+err:
+    return ESP_FAIL;
+}
+
+/*
+ * Compacts at most one sector per round. The ids handed out by fffs_rt_write_async assume that nothing else
+ * writes, and copies take ids, so rounds are skipped while asynchronous mode is running.
+ */
+static void fffs_rt_compact_task(void *arg)
+{
+    fffs_head_t *fffs_head = arg;
+    fffs_rt_compact_t *compact = fffs_head->compact;
+    uint32_t moved;
+    esp_err_t err;
+
+    while (!compact->stop)
+    {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(compact->config.interval_ms));
+        if (compact->stop || xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) != pdTRUE)
+            continue;
+
+        if (fffs_head->async == NULL)
+        {
+            err = fffs_compact(fffs_head->vol, compact->config.min_dead_percent, &moved);
+            if (err != ESP_OK && err != ESP_ERR_NOT_FOUND)
+                ESP_LOGW(TAG, "Compaction stopped after %d messages, error %d", moved, err);
+        }
+        xSemaphoreGive(fffs_head->xSemaphore);
+    }
+
+    xSemaphoreGive(compact->xStopped);
+    vTaskDelete(NULL);
+}
+
+esp_err_t fffs_rt_compact_start(fffs_head_t *fffs_head, const fffs_rt_compact_config_t *config)
+{
+    fffs_rt_compact_t *compact = NULL;
+
+    FRTOS_CHECK(fffs_head && config, "Head cannot be NULL.", err);
+    FRTOS_CHECK(fffs_head->compact == NULL, "Compaction is already running", err);
+    FRTOS_CHECK(fffs_head->vol->forward_blocks > 0, "Volume has no forwarding table", err);
+    FRTOS_CHECK(config->interval_ms > 0, "Invalid interval", err);
+
+    compact = calloc(1, sizeof(fffs_rt_compact_t));
+    FRTOS_CHECK(compact, "Cannot allocate compaction task", err);
+
+    compact->config = *config;
+    compact->xStopped = xSemaphoreCreateBinary();
+    FRTOS_CHECK(compact->xStopped, "Cannot allocate compaction task", fail);
+
+    fffs_head->compact = compact;
+    if (xTaskCreate(fffs_rt_compact_task, "fffs_compact", config->stack_size, fffs_head, config->priority, &compact->task) != pdPASS)
+    {
+        fffs_head->compact = NULL;
+        FRTOS_CHECK(false, "Cannot create compaction task", fail);
+    }
+
+    return ESP_OK;
+
+fail:
+    if (compact->xStopped != NULL)
+        vSemaphoreDelete(compact->xStopped);
+    free(compact);
+
+err:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_compact_stop(fffs_head_t *fffs_head)
+{
+    FRTOS_CHECK(fffs_head && fffs_head->compact, "Compaction is not running", err);
+
+    fffs_rt_compact_t *compact = fffs_head->compact;
+    compact->stop = true;
+    xTaskNotifyGive(compact->task);
+    xSemaphoreTake(compact->xStopped, portMAX_DELAY);
+
+    fffs_head->compact = NULL;
+    vSemaphoreDelete(compact->xStopped);
+    free(compact);
+    return ESP_OK;
+
+err:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_write_async(fffs_head_t *fffs_head, const void *message, int message_length, uint32_t *message_id)
+{
+    fffs_rt_async_t *async;
+    esp_err_t err = ESP_FAIL;
+    uint32_t pos;
+    bool waited = false;
+
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    async = fffs_rt_async_pin(fffs_head);
+    FRTOS_CHECK(async, "Asynchronous mode is not running", fail);
+    FRTOS_CHECK(message != NULL, "Message is NULL", unpin);
+    FRTOS_CHECK(message_length > 0 && message_length <= async->config.slot_size, "Invalid message size", unpin);
+    if (async->broken)
+    {
+        err = ESP_ERR_INVALID_STATE;
+        goto unpin;
+    }
+
+    while (!fffs_rt_ring_push(async, message, message_length, &pos))
+    {
+        xTaskNotifyGive(async->task);
+
+        if (async->config.policy == FFFS_OVERFLOW_DROP_NEWEST)
+        {
+            atomic_fetch_add(&async->dropped_newest, 1);
+            err = ESP_ERR_NO_MEM;
+            goto unpin;
+        }
+
+        if (async->config.policy == FFFS_OVERFLOW_DROP_OLDEST)
+        {
+            if (fffs_rt_ring_pop(async, NULL, NULL, &pos))
+                atomic_fetch_add(&async->dropped_oldest, 1);
+            else
+                taskYIELD(); //The oldest slot is being filled or copied out
+            continue;
+        }
+
+        if (!waited)
+            atomic_fetch_add(&async->blocked, 1);
+        waited = true;
+        vTaskDelay(1);
+    }
+
+    atomic_fetch_add(&async->queued, 1);
+    xTaskNotifyGive(async->task);
+
+    if (message_id != NULL)
+        *message_id = async->base_id + pos;
+    err = ESP_OK;
+
+unpin:
+    fffs_rt_async_unpin(fffs_head);
+    return err;
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_async_get_stats(fffs_head_t *fffs_head, fffs_rt_async_stats_t *stats)
+{
+    fffs_rt_async_t *async = NULL;
+
+    FRTOS_CHECK(fffs_head && stats, "Head cannot be NULL.", err);
+    async = fffs_rt_async_pin(fffs_head);
+    FRTOS_CHECK(async, "Asynchronous mode is not running", err);
+
+    stats->queued = atomic_load(&async->queued);
+    stats->written = atomic_load(&async->written);
+    stats->dropped_oldest = atomic_load(&async->dropped_oldest);
+    stats->dropped_newest = atomic_load(&async->dropped_newest);
+    stats->blocked = atomic_load(&async->blocked);
+    stats->failed = atomic_load(&async->failed);
+    fffs_rt_async_unpin(fffs_head);
+    return ESP_OK;
+
+err:
+    return ESP_FAIL;
+}
+
+static void fffs_rt_state_take(void *ctx)
+{
+    xSemaphoreTake((SemaphoreHandle_t)ctx, portMAX_DELAY);
+}
+
+static void fffs_rt_state_give(void *ctx)
+{
+    xSemaphoreGive((SemaphoreHandle_t)ctx);
+}
+
 fffs_head_t *fffs_rt_Init(fffs_volume_t *vol)
 {
 
@@ -27,6 +588,10 @@ fffs_head_t *fffs_rt_Init(fffs_volume_t *vol)
     FRTOS_CHECK(fffs_head, "Cannot assign memory for fs head.", err);
 
     fffs_head->vol = vol;
+    fffs_head->async = NULL;
+    atomic_init(&fffs_head->async_users, 0);
+    fffs_head->subscriptions = NULL;
+    fffs_head->compact = NULL;
     fffs_head->xSemaphore = NULL;
     fffs_head->xSemaphore = xSemaphoreCreateMutex();
     FRTOS_CHECK(fffs_head->xSemaphore, "Cannot assign semaphore for fs head.", err);
@@ -34,6 +599,15 @@ fffs_head_t *fffs_rt_Init(fffs_volume_t *vol)
     if (fffs_head->xSemaphore == NULL)
         FRTOS_CHECK(fffs_head->xSemaphore, "Cannot get MUTEX", err);
 
+    fffs_head->xStateSemaphore = xSemaphoreCreateMutex();
+    FRTOS_CHECK(fffs_head->xStateSemaphore, "Cannot assign state semaphore for fs head.", err);
+
+    /* Writers queue on xSemaphore, the volume itself only holds xStateSemaphore while it touches shared state */
+
+    vol->lock.take = fffs_rt_state_take;
+    vol->lock.give = fffs_rt_state_give;
+    vol->lock.ctx = fffs_head->xStateSemaphore;
+
     return fffs_head;
 err:
     return NULL;
@@ -45,73 +619,427 @@ uint16_t fffs_rt_read_binary(fffs_head_t *fffs_head, uint32_t message_num, uint8
     FRTOS_CHECK(fffs_head, "Head cannot be NULL.", err);
     FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", err);
 
-obtain_semaphore:
-    vTaskDelay(10);
-
-    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
 
+    /* fffs_read only holds the volume state lock, so it does not queue behind writers */
     FRTOS_CHECK(fffs_read(fffs_head->vol, message_num, message, &message_length) == ESP_OK, "Cannot read message", err);
 
-release_semaphore:
-    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
 err:
     return message_length;
 }
 
-esp_err_t fffs_rt_write_binary(fffs_head_t *fffs_head, uint8_t *message, int message_length)
+esp_err_t fffs_rt_read_into(fffs_head_t *fffs_head, uint32_t message_num, void *buf, size_t cap, int *size)
 {
     FRTOS_CHECK(fffs_head, "Head cannot be NULL.", err);
-    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", err);
-    FRTOS_CHECK(message_length > 0 && message_length < 510, "Invalid message size", err);
-    FRTOS_CHECK(message != NULL, "Message is NULL", err);
+
+    return fffs_read_into(fffs_head->vol, message_num, buf, cap, size);
+
+err:
+    return ESP_ERR_INVALID_ARG;
+}
+
+esp_err_t fffs_rt_write_binary(fffs_head_t *fffs_head, uint8_t *message, int message_length)
+{
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(message_length > 0 && message_length <= fffs_head->vol->config.message_max, "Invalid message size", fail);
+    FRTOS_CHECK(message != NULL, "Message is NULL", fail);
+    FRTOS_CHECK(fffs_head->async == NULL, "Asynchronous mode is running", fail);
 obtain_semaphore:
     FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
 
-    FRTOS_CHECK(fffs_write(fffs_head->vol, message, message_length) == ESP_OK, "Cannot write message", err);
+    err = fffs_write(fffs_head->vol, message, message_length);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot write message");
+    fffs_rt_notify(fffs_head);
+
 release_semaphore:
     FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
 
-    return ESP_OK;
+fail:
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
 
-err:
-    return ESP_FAIL;
+esp_err_t fffs_rt_write_batch(fffs_head_t *fffs_head, const fffs_message_t *messages, size_t count, uint32_t *first_id)
+{
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(messages != NULL && count > 0, "Batch is empty", fail);
+    FRTOS_CHECK(fffs_head->async == NULL, "Asynchronous mode is running", fail);
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+
+    err = fffs_write_batch(fffs_head->vol, messages, count, first_id);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot write batch of %u messages", (unsigned)count);
+    fffs_rt_notify(fffs_head);
+
+release_semaphore:
+    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
+
+fail:
+    return err;
+}
+
+esp_err_t fffs_rt_write_key(fffs_head_t *fffs_head, uint8_t *message, int message_length, uint64_t key)
+{
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(message != NULL, "Message is NULL", fail);
+    FRTOS_CHECK(fffs_head->async == NULL, "Asynchronous mode is running", fail);
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+
+    err = fffs_write_key(fffs_head->vol, message, message_length, key);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot write message with key %llu", (unsigned long long)key);
+    fffs_rt_notify(fffs_head);
+
+release_semaphore:
+    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
+
+fail:
+    return err;
 }
 
 esp_err_t fffs_rt_erase(fffs_head_t *fffs_head, int message_num)
 {
-    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", err);
-    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", err);
-    FRTOS_CHECK(message_num > 0 && message_num < fffs_head->vol->message_id, "Invalid message number", err);
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(message_num > 0 && message_num < fffs_head->vol->message_id, "Invalid message number", fail);
 
 obtain_semaphore:
     FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
 
-    FRTOS_CHECK(fffs_erase(fffs_head->vol, message_num) == ESP_OK, "Cannot write message", err);
+    err = fffs_erase(fffs_head->vol, message_num);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot erase message %d", message_num);
 
 release_semaphore:
     FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
 
-    return ESP_OK;
+fail:
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
 
-err:
+esp_err_t fffs_rt_update(fffs_head_t *fffs_head, int message_num, uint8_t *new_message)
+{
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(message_num > 0 && message_num < fffs_head->vol->message_id, "Invalid message number", fail);
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+
+    err = fffs_update(fffs_head->vol, message_num, new_message);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot update message %d", message_num);
+
+release_semaphore:
+    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
+
+fail:
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+esp_err_t fffs_rt_replace(fffs_head_t *fffs_head, uint32_t message_num, const void *message, int size)
+{
+    esp_err_t err;
+
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->async == NULL, "Asynchronous mode is running", fail);
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+    err = fffs_replace(fffs_head->vol, message_num, message, size);
+
+release_semaphore:
+    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
+
+    return err;
+
+fail:
     return ESP_FAIL;
 }
 
-esp_err_t fffs_rt_update(fffs_head_t *fffs_head, int message_num, uint8_t *new_message)
+esp_err_t fffs_rt_erase_range(fffs_head_t *fffs_head, uint32_t from, uint32_t to)
 {
-    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", err);
-    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", err);
-    FRTOS_CHECK(message_num > 0 && message_num < fffs_head->vol->message_id, "Invalid message number", err);
+    esp_err_t err;
+
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+    err = fffs_erase_range(fffs_head->vol, from, to);
+
+release_semaphore:
+    FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
+
+    return err;
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_truncate_before(fffs_head_t *fffs_head, uint32_t message_id)
+{
+    return fffs_rt_erase_range(fffs_head, 0, message_id);
+}
+
+esp_err_t fffs_rt_flush(fffs_head_t *fffs_head)
+{
+    esp_err_t err = ESP_FAIL;
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", fail);
+    FRTOS_CHECK(fffs_head->xSemaphore, "Semaphore cannot be NULL.", fail);
+
+    fffs_rt_async_t *async = fffs_rt_async_pin(fffs_head);
+    if (async != NULL)
+    {
+        fffs_rt_async_drain_wait(async);
+        fffs_rt_async_unpin(fffs_head);
+    }
 
 obtain_semaphore:
     FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
-    FRTOS_CHECK(fffs_update(fffs_head->vol, message_num, new_message) == ESP_OK, "Cannot write message", err);
+
+    err = fffs_flush(fffs_head->vol);
+    if (err != ESP_OK)
+        ESP_LOGE(TAG, "Cannot flush volume");
 
 release_semaphore:
     FRTOS_CHECK(xSemaphoreGive(fffs_head->xSemaphore) == pdTRUE, "Cannot release semaphore", release_semaphore);
 
+fail:
+    return err == ESP_OK ? ESP_OK : ESP_FAIL;
+}
+
+fffs_rt_subscription_t *fffs_rt_subscribe(fffs_head_t *fffs_head, uint32_t from_id)
+{
+    fffs_rt_subscription_t *subscription = NULL;
+
+    FRTOS_CHECK(fffs_head, "Head cannot be NULL.", err);
+
+    subscription = calloc(1, sizeof(fffs_rt_subscription_t));
+    FRTOS_CHECK(subscription, "Cannot allocate subscription", err);
+
+    subscription->head = fffs_head;
+    subscription->cursor = fffs_cursor_open(fffs_head->vol, from_id);
+    subscription->xWritten = xSemaphoreCreateBinary();
+    FRTOS_CHECK(subscription->cursor && subscription->xWritten, "Cannot create subscription from message %d", fail, from_id);
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+    subscription->next = fffs_head->subscriptions;
+    fffs_head->subscriptions = subscription;
+    xSemaphoreGive(fffs_head->xSemaphore);
+
+    return subscription;
+
+fail:
+    if (subscription->cursor != NULL)
+        fffs_cursor_close(subscription->cursor);
+    if (subscription->xWritten != NULL)
+        vSemaphoreDelete(subscription->xWritten);
+    free(subscription);
+
+err:
+    return NULL;
+}
+
+/*
+ * A write landing between fffs_cursor_next coming back empty and the wait leaves xWritten given, so it is never
+ * missed. A give left over from messages already read only costs one more pass.
+ */
+esp_err_t fffs_rt_subscription_next(fffs_rt_subscription_t *subscription, uint8_t *message, int *size, uint32_t *message_id, TickType_t wait)
+{
+    TimeOut_t timeout;
+    esp_err_t err;
+
+    FRTOS_CHECK(subscription, "Subscription cannot be NULL.", fail);
+
+    vTaskSetTimeOutState(&timeout);
+    while ((err = fffs_cursor_next(subscription->cursor, message, size, message_id)) == ESP_ERR_NOT_FOUND)
+    {
+        if (xTaskCheckForTimeOut(&timeout, &wait) == pdTRUE || xSemaphoreTake(subscription->xWritten, wait) != pdTRUE)
+            return ESP_ERR_TIMEOUT;
+    }
+
+    return err;
+
+fail:
+    return ESP_FAIL;
+}
+
+esp_err_t fffs_rt_unsubscribe(fffs_rt_subscription_t *subscription)
+{
+    FRTOS_CHECK(subscription, "Subscription cannot be NULL.", err);
+
+    fffs_head_t *fffs_head = subscription->head;
+    fffs_rt_subscription_t **link = &fffs_head->subscriptions;
+
+obtain_semaphore:
+    FRTOS_CHECK((xSemaphoreTake(fffs_head->xSemaphore, pdMS_TO_TICKS(200)) == pdTRUE), "Cannot obtain semaphore.", obtain_semaphore);
+    while (*link != subscription)
+        link = &(*link)->next;
+    *link = subscription->next;
+    xSemaphoreGive(fffs_head->xSemaphore);
+
+    fffs_cursor_close(subscription->cursor);
+    vSemaphoreDelete(subscription->xWritten);
+    free(subscription);
     return ESP_OK;
 
 err:
     return ESP_FAIL;
-}
\ No newline at end of file
+}
+
+typedef struct
+{
+    fffs_bdev_t *bdev;                //<Device doing the work
+    TaskHandle_t task;
+    SemaphoreHandle_t xDone;          //<Held while a write is under way, waiters take it and give it back
+    const void *src;
+    size_t start_block;
+    size_t block_count;
+    esp_err_t err;                    //<Result of the last write
+    volatile bool stop;
+} fffs_rt_bdev_ctx_t;
+
+static void fffs_rt_bdev_task(void *arg)
+{
+    fffs_rt_bdev_ctx_t *ctx = arg;
+
+    while (1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (ctx->stop)
+            break;
+
+        ctx->err = fffs_bdev_write(ctx->bdev, ctx->src, ctx->start_block, ctx->block_count);
+        xSemaphoreGive(ctx->xDone);
+    }
+
+    xSemaphoreGive(ctx->xDone);
+    vTaskDelete(NULL);
+}
+
+/*
+ * Waits for the write under way, if any. The volume learns its result from write_wait, the other operations only
+ * wait for it to be done.
+ */
+static fffs_rt_bdev_ctx_t *fffs_rt_bdev_idle(fffs_bdev_t *bdev)
+{
+    fffs_rt_bdev_ctx_t *ctx = bdev->ctx;
+
+    xSemaphoreTake(ctx->xDone, portMAX_DELAY);
+    xSemaphoreGive(ctx->xDone); //Free for the other waiters
+    return ctx;
+}
+
+static esp_err_t fffs_rt_bdev_write_wait(fffs_bdev_t *bdev)
+{
+    return fffs_rt_bdev_idle(bdev)->err;
+}
+
+static esp_err_t fffs_rt_bdev_write_start(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    fffs_rt_bdev_ctx_t *ctx = bdev->ctx;
+
+    xSemaphoreTake(ctx->xDone, portMAX_DELAY); //Given back by the task once this write is done
+    ctx->src = src;
+    ctx->start_block = start_block;
+    ctx->block_count = block_count;
+    xTaskNotifyGive(ctx->task);
+    return ESP_OK;
+}
+
+/*
+ * Reads come from other tasks than the writer, so they hold xDone for as long as they take: a read waits for the
+ * write under way and no write starts until it is done.
+ */
+static esp_err_t fffs_rt_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    fffs_rt_bdev_ctx_t *ctx = bdev->ctx;
+    esp_err_t err;
+
+    xSemaphoreTake(ctx->xDone, portMAX_DELAY);
+    err = fffs_bdev_read(ctx->bdev, dst, start_block, block_count);
+    xSemaphoreGive(ctx->xDone);
+    return err;
+}
+
+static esp_err_t fffs_rt_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    return fffs_bdev_write(fffs_rt_bdev_idle(bdev)->bdev, src, start_block, block_count);
+}
+
+static esp_err_t fffs_rt_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    return fffs_bdev_erase(fffs_rt_bdev_idle(bdev)->bdev, start_block, block_count);
+}
+
+static esp_err_t fffs_rt_bdev_flush(fffs_bdev_t *bdev)
+{
+    return fffs_bdev_flush(fffs_rt_bdev_idle(bdev)->bdev);
+}
+
+static esp_err_t fffs_rt_bdev_deinit(fffs_bdev_t *bdev)
+{
+    fffs_rt_bdev_ctx_t *ctx = bdev->ctx;
+
+    xSemaphoreTake(ctx->xDone, portMAX_DELAY);
+    ctx->stop = true;
+    xTaskNotifyGive(ctx->task);
+    xSemaphoreTake(ctx->xDone, portMAX_DELAY);
+
+    fffs_bdev_delete(ctx->bdev);
+    vSemaphoreDelete(ctx->xDone);
+    free(ctx);
+    free(bdev);
+    return ESP_OK;
+}
+
+fffs_bdev_t *fffs_rt_bdev_async_create(fffs_bdev_t *bdev, UBaseType_t priority, uint32_t stack_size)
+{
+    fffs_bdev_t *async_bdev = NULL;
+    fffs_rt_bdev_ctx_t *ctx = NULL;
+
+    FRTOS_CHECK(bdev, "Device cannot be NULL.", err);
+
+    async_bdev = calloc(1, sizeof(fffs_bdev_t));
+    ctx = calloc(1, sizeof(fffs_rt_bdev_ctx_t));
+    FRTOS_CHECK(async_bdev && ctx, "Cannot allocate device", fail);
+
+    ctx->bdev = bdev;
+    ctx->xDone = xSemaphoreCreateBinary();
+    FRTOS_CHECK(ctx->xDone, "Cannot allocate device", fail);
+    xSemaphoreGive(ctx->xDone); //No write under way
+    FRTOS_CHECK(xTaskCreate(fffs_rt_bdev_task, "fffs_bdev", stack_size, ctx, priority, &ctx->task) == pdPASS, "Cannot create device task", fail);
+
+    async_bdev->read = fffs_rt_bdev_read;
+    async_bdev->write = fffs_rt_bdev_write;
+    async_bdev->erase = fffs_rt_bdev_erase;
+    async_bdev->flush = fffs_rt_bdev_flush;
+    async_bdev->deinit = fffs_rt_bdev_deinit;
+    async_bdev->write_start = fffs_rt_bdev_write_start;
+    async_bdev->write_wait = fffs_rt_bdev_write_wait;
+    async_bdev->capacity = bdev->capacity;
+    async_bdev->block_size = bdev->block_size;
+    async_bdev->ctx = ctx;
+    return async_bdev;
+
+fail:
+    if (ctx != NULL && ctx->xDone != NULL)
+        vSemaphoreDelete(ctx->xDone);
+    free(ctx);
+    free(async_bdev);
+
+err:
+    return NULL;
+}
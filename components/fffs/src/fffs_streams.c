@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+
+#include "fffs.h"
+#include "fffs_bdev.h"
+#include "fffs_streams.h"
+
+#define STREAMS_CHECK(a, str, goto_tag, ...)                                      \
+    do                                                                            \
+    {                                                                             \
+        if (!(a))                                                                 \
+        {                                                                         \
+            ESP_LOGE(TAG, "%s(%d): " str, __FUNCTION__, __LINE__, ##__VA_ARGS__); \
+            goto goto_tag;                                                        \
+        }                                                                         \
+    } while (0)
+
+_Static_assert(sizeof(fffs_stream_directory_t) <= SD_BLOCK_SIZE, "A stream directory must fit in a block");
+
+static const char *TAG = "FFFS_STREAMS";
+
+typedef struct
+{
+    fffs_bdev_t *parent;
+    uint32_t start; //<Block of the parent mapped to block 0
+} slice_bdev_ctx_t;
+
+static esp_err_t slice_bdev_read(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    slice_bdev_ctx_t *ctx = bdev->ctx;
+    STREAMS_CHECK(start_block + block_count <= bdev->capacity, "Read past end of stream (block %u)", fail, (unsigned)start_block);
+    return fffs_bdev_read(ctx->parent, dst, ctx->start + start_block, block_count);
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t slice_bdev_write(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    slice_bdev_ctx_t *ctx = bdev->ctx;
+    STREAMS_CHECK(start_block + block_count <= bdev->capacity, "Write past end of stream (block %u)", fail, (unsigned)start_block);
+    return fffs_bdev_write(ctx->parent, src, ctx->start + start_block, block_count);
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t slice_bdev_write_start(fffs_bdev_t *bdev, const void *src, size_t start_block, size_t block_count)
+{
+    slice_bdev_ctx_t *ctx = bdev->ctx;
+    STREAMS_CHECK(start_block + block_count <= bdev->capacity, "Write past end of stream (block %u)", fail, (unsigned)start_block);
+    return fffs_bdev_write_start(ctx->parent, src, ctx->start + start_block, block_count);
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t slice_bdev_write_wait(fffs_bdev_t *bdev)
+{
+    return fffs_bdev_write_wait(((slice_bdev_ctx_t *)bdev->ctx)->parent);
+}
+
+static esp_err_t slice_bdev_erase(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    slice_bdev_ctx_t *ctx = bdev->ctx;
+    STREAMS_CHECK(start_block + block_count <= bdev->capacity, "Erase past end of stream (block %u)", fail, (unsigned)start_block);
+    return fffs_bdev_erase(ctx->parent, ctx->start + start_block, block_count);
+
+fail:
+    return ESP_ERR_INVALID_ARG;
+}
+
+static esp_err_t slice_bdev_flush(fffs_bdev_t *bdev)
+{
+    return fffs_bdev_flush(((slice_bdev_ctx_t *)bdev->ctx)->parent);
+}
+
+static esp_err_t slice_bdev_deinit(fffs_bdev_t *bdev)
+{
+    free(bdev->ctx);
+    free(bdev);
+    return ESP_OK;
+}
+
+/*
+ * Maps blocks start to start + blocks of parent as a device of its own. Deleting it leaves parent open.
+ */
+static fffs_bdev_t *slice_bdev_create(fffs_bdev_t *parent, uint32_t start, uint32_t blocks)
+{
+    fffs_bdev_t *bdev = calloc(1, sizeof(fffs_bdev_t));
+    slice_bdev_ctx_t *ctx = calloc(1, sizeof(slice_bdev_ctx_t));
+    STREAMS_CHECK(bdev && ctx, "Cannot allocate stream device.", fail);
+
+    ctx->parent = parent;
+    ctx->start = start;
+
+    bdev->read = slice_bdev_read;
+    bdev->write = slice_bdev_write;
+    bdev->erase = slice_bdev_erase;
+    bdev->flush = slice_bdev_flush;
+    bdev->deinit = slice_bdev_deinit;
+    if (parent->write_start != NULL)
+    {
+        bdev->write_start = slice_bdev_write_start;
+        bdev->write_wait = slice_bdev_write_wait;
+    }
+    bdev->capacity = blocks;
+    bdev->block_size = parent->block_size;
+    bdev->ctx = ctx;
+    return bdev;
+
+fail:
+    free(ctx);
+    free(bdev);
+    return NULL;
+}
+
+static esp_err_t fffs_streams_write(fffs_streams_t *streams)
+{
+    STREAMS_CHECK(fffs_bdev_write(streams->bdev, streams->directory, 0, 1) == ESP_OK, "Cannot write stream directory", fail);
+    return fffs_bdev_flush(streams->bdev);
+
+fail:
+    return ESP_FAIL;
+}
+
+static int fffs_stream_find(const fffs_streams_t *streams, const char *name)
+{
+    for (uint32_t i = 0; i < streams->directory->count; i++)
+    {
+        if (streams->directory->entries[i].name[0] != '\0' && strncmp(streams->directory->entries[i].name, name, FFFS_STREAM_NAME - 1) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/*
+ * Gives blocks to a new entry, from the smallest free extent that holds them or else from the blocks not given out
+ * yet. What a free extent has left over stays free in an entry of its own if there is one.
+ */
+static int fffs_stream_alloc(fffs_streams_t *streams, uint32_t blocks)
+{
+    fffs_stream_directory_t *directory = streams->directory;
+    fffs_stream_entry_t *entry = NULL;
+
+    for (uint32_t i = 0; i < directory->count; i++)
+    {
+        fffs_stream_entry_t *extent = &directory->entries[i];
+
+        if (extent->name[0] == '\0' && extent->blocks >= blocks && (entry == NULL || extent->blocks < entry->blocks))
+            entry = extent;
+    }
+
+    if (entry != NULL)
+    {
+        if (entry->blocks > blocks && directory->count < FFFS_STREAMS_MAX)
+        {
+            fffs_stream_entry_t *rest = &directory->entries[directory->count++];
+
+            memset(rest, 0, sizeof(fffs_stream_entry_t));
+            rest->start = entry->start + blocks;
+            rest->blocks = entry->blocks - blocks;
+            entry->blocks = blocks;
+        }
+        return entry - directory->entries;
+    }
+
+    if (directory->count == FFFS_STREAMS_MAX || blocks > streams->bdev->capacity - directory->next_free)
+        return -1;
+
+    entry = &directory->entries[directory->count++];
+    memset(entry, 0, sizeof(fffs_stream_entry_t));
+    entry->start = directory->next_free;
+    entry->blocks = blocks;
+    directory->next_free += blocks;
+    return entry - directory->entries;
+}
+
+fffs_streams_t *fffs_streams_open(fffs_bdev_t *bdev, bool format)
+{
+    fffs_streams_t *streams = NULL;
+
+    STREAMS_CHECK(bdev, "Block device is NULL.", fail);
+    STREAMS_CHECK(bdev->block_size == SD_BLOCK_SIZE, "Block size %d is not supported", fail, bdev->block_size);
+    STREAMS_CHECK(bdev->capacity > SECTOR_SIZE, "Card is too small for streams", fail);
+
+    streams = calloc(1, sizeof(fffs_streams_t));
+    STREAMS_CHECK(streams, "Cannot allocate streams", fail);
+    streams->bdev = bdev;
+    streams->directory = heap_caps_malloc(SD_BLOCK_SIZE, MALLOC_CAP_DMA);
+    STREAMS_CHECK(streams->directory, "Cannot allocate stream directory", fail);
+
+    STREAMS_CHECK(fffs_bdev_read(bdev, streams->directory, 0, 1) == ESP_OK, "Cannot read stream directory", fail);
+    if (streams->directory->magic_number == FFFS_STREAMS_MAGIC && streams->directory->count <= FFFS_STREAMS_MAX &&
+        streams->directory->next_free >= SECTOR_SIZE && streams->directory->next_free <= bdev->capacity)
+        return streams;
+
+    STREAMS_CHECK(format, "Card holds no stream directory.", fail);
+    memset(streams->directory, 0, SD_BLOCK_SIZE);
+    streams->directory->magic_number = FFFS_STREAMS_MAGIC;
+    streams->directory->next_free = SECTOR_SIZE;
+    STREAMS_CHECK(fffs_streams_write(streams) == ESP_OK, "Cannot create stream directory", fail);
+    ESP_LOGI(TAG, "Created stream directory, %d blocks free.", bdev->capacity - SECTOR_SIZE);
+    return streams;
+
+fail:
+    if (streams != NULL)
+        heap_caps_free(streams->directory);
+    free(streams);
+    return NULL;
+}
+
+/*
+ * Closes the stream of entry i if it is open.
+ */
+static void fffs_stream_close(fffs_streams_t *streams, int i)
+{
+    if (streams->volumes[i] == NULL)
+        return;
+
+    fffs_deinit(streams->volumes[i]);
+    fffs_bdev_delete(streams->slices[i]);
+    streams->volumes[i] = NULL;
+    streams->slices[i] = NULL;
+}
+
+esp_err_t fffs_streams_close(fffs_streams_t *streams)
+{
+    if (streams == NULL)
+        return ESP_OK;
+
+    for (uint32_t i = 0; i < FFFS_STREAMS_MAX; i++)
+        fffs_stream_close(streams, i);
+
+    heap_caps_free(streams->directory);
+    free(streams);
+    return ESP_OK;
+}
+
+fffs_volume_t *fffs_stream_open(fffs_streams_t *streams, const char *name, uint32_t blocks, const fffs_config_t *config)
+{
+    fffs_config_t default_config = FFFS_CONFIG_DEFAULT();
+    fffs_stream_entry_t *entry;
+    bool created = false;
+    int i;
+
+    STREAMS_CHECK(streams && name && name[0] != '\0', "Invalid arguments.", fail);
+    if (config == NULL)
+        config = &default_config;
+
+    i = fffs_stream_find(streams, name);
+    if (i >= 0 && streams->volumes[i] != NULL)
+        return streams->volumes[i];
+
+    if (i < 0)
+    {
+        STREAMS_CHECK(blocks > 0, "No stream %s", fail, name);
+        blocks = (blocks + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+        i = fffs_stream_alloc(streams, blocks);
+        STREAMS_CHECK(i >= 0, "No room for stream %s of %d blocks", fail, name, blocks);
+        strncpy(streams->directory->entries[i].name, name, FFFS_STREAM_NAME - 1);
+        STREAMS_CHECK(fffs_streams_write(streams) == ESP_OK, "Cannot write stream directory", fail);
+        ESP_LOGI(TAG, "Created stream %s at block %d, %d blocks.", name, streams->directory->entries[i].start, blocks);
+        created = true;
+    }
+
+    entry = &streams->directory->entries[i];
+    streams->slices[i] = slice_bdev_create(streams->bdev, entry->start, entry->blocks);
+    STREAMS_CHECK(streams->slices[i], "Cannot map stream %s", fail, name);
+
+    streams->volumes[i] = fffs_init_with_config(streams->slices[i], created, config); //Only a new stream is formatted, a failed mount must not wipe an existing one
+    if (streams->volumes[i] == NULL)
+    {
+        fffs_bdev_delete(streams->slices[i]);
+        streams->slices[i] = NULL;
+        STREAMS_CHECK(false, "Cannot mount stream %s", fail, name);
+    }
+
+    return streams->volumes[i];
+
+fail:
+    return NULL;
+}
+
+esp_err_t fffs_stream_delete(fffs_streams_t *streams, const char *name)
+{
+    fffs_stream_entry_t *entry;
+    char entry_name[FFFS_STREAM_NAME];
+    esp_err_t err;
+    int i;
+
+    STREAMS_CHECK(streams && name, "Invalid arguments.", invalid);
+    i = fffs_stream_find(streams, name);
+    if (i < 0)
+        return ESP_ERR_NOT_FOUND;
+
+    fffs_stream_close(streams, i);
+    entry = &streams->directory->entries[i];
+    err = fffs_bdev_erase(streams->bdev, entry->start, entry->blocks); //The extent is only given back once it is empty
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(TAG, "Cannot discard stream %s", name);
+        return err;
+    }
+
+    memcpy(entry_name, entry->name, FFFS_STREAM_NAME);
+    memset(entry->name, 0, FFFS_STREAM_NAME);
+    err = fffs_streams_write(streams);
+    if (err != ESP_OK)
+    {
+        memcpy(entry->name, entry_name, FFFS_STREAM_NAME); //The entry stays as the card has it
+        return err;
+    }
+    return ESP_OK;
+
+invalid:
+    return ESP_ERR_INVALID_ARG;
+}
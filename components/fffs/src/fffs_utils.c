@@ -5,7 +5,7 @@
 #include <time.h>
 #include <ctype.h>
 #include <string.h>
-#include "sdmmc_cmd.h"
+#include "fffs_bdev.h"
 
 void print_Message2HEX(const unsigned char *message, size_t msgLength)
 {
@@ -34,7 +34,7 @@ void print_Message2ASC(const unsigned char *message, size_t msgLength)
 esp_err_t print_vol_block(fffs_volume_t *fffs_volume, size_t block_num, const char *type)
 {
     esp_err_t err;
-    err = sdmmc_read_sectors(fffs_volume->sd_card, fffs_volume->read_buf, block_num, 1);
+    err = fffs_read_block(fffs_volume, block_num);
     if (err != ESP_OK)
         return ESP_FAIL;
     if (strcmp(type, "asc") == 0)
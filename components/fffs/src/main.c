@@ -35,17 +35,15 @@ void read_blocks(void *fffs_head, int blocks)
 
 void read_messages(void *fffs_head)
 {
-    int message_num;
-    uint8_t *message;
-    while (1)
+    int message_size;
+    uint8_t message[SD_BLOCK_SIZE];
+    fffs_rt_subscription_t *subscription = fffs_rt_subscribe((fffs_head_t *)fffs_head, ((fffs_head_t *)fffs_head)->vol->message_id); //Woken by the writer, no polling
+
+    while (subscription != NULL)
     {
-        srand(esp_timer_get_time());
-        message_num = rand() % ((((fffs_head_t *)fffs_head)->vol->message_id) - 1);
-        //printf("%d\n", message_num);
-        message = calloc(fffs_rt_read_binary((fffs_head_t *)fffs_head, message_num, NULL), 1);
-        print_Message2ASC(message, fffs_rt_read_binary((fffs_head_t *)fffs_head, message_num, message));
+        if (fffs_rt_subscription_next(subscription, message, &message_size, NULL, portMAX_DELAY) == ESP_OK)
+            print_Message2ASC(message, message_size);
 
-        free(message);
         fflush(stdout);
     }
     vTaskDelete(0);
@@ -77,6 +75,7 @@ suffered the cursed tongue of the orator";
         fffs_rt_write_binary((fffs_head_t *)fffs_head, (uint8_t *)message, message_size);
         vTaskDelay(10);
     }
+    fffs_rt_flush((fffs_head_t *)fffs_head);
     printf("Ready writing.\n");
     vTaskDelete(0);
 }
@@ -87,10 +86,14 @@ void app_main(void)
     if (s_card == NULL)
         goto err;
 
-    fffs_volume_t *fffs_vol = fffs_init(s_card, true);
-    if (fffs_vol == NULL)
+    fffs_bdev_t *s_bdev = sd_card_bdev_create(s_card);
+    if (s_bdev == NULL)
         goto err;
 
+    fffs_volume_t *fffs_vol = fffs_init(s_bdev, true);
+    if (fffs_vol == NULL)
+        goto err_bdev;
+
     fffs_head_t *sas_log = fffs_rt_Init(fffs_vol);
 
     ESP_LOGI(TAG, "Partitions size (%d) %d bytes.", fffs_vol->partition_size, fffs_vol->partition_size * (PARTITION_SIZE)*SD_BLOCK_SIZE);
@@ -108,9 +111,10 @@ void app_main(void)
     //write_messages(sas_log);
     //fffs_rt_erase(sas_log, 10);
 /*
-    uint8_t *message = malloc(512);
-    uint8_t size = fffs_rt_read_binary(sas_log, 11, message);
-    uint8_t  s[510];
+    static uint8_t message[FFFS_MESSAGE_MAX];
+    int size = 0;
+    fffs_rt_read_into(sas_log, 11, message, sizeof(message), &size);
+    uint8_t  s[FFFS_MESSAGE_MAX];
 
     for (int i = 0; i < size; i++)
     {
@@ -119,7 +123,8 @@ void app_main(void)
    
     fffs_rt_update(sas_log, 11, s);
 
-    print_Message2ASC(message, fffs_rt_read_binary(sas_log, 11, message));
+    if (fffs_rt_read_into(sas_log, 11, message, sizeof(message), &size) == ESP_OK)
+        print_Message2ASC(message, size);
 */
     xTaskCreate(read_messages, "sas_log", 4096, sas_log, 5, NULL);
     xTaskCreate(write_messages, "mqtt_log", 4096, sas_log, 6, NULL);
@@ -130,6 +135,8 @@ void app_main(void)
         //ESP_LOGI(TAG,"Time: %d", esp_timer_get_time());
     }
 
+err_bdev:
+    fffs_bdev_delete(s_bdev);
 err:
     sd_card_deinit(s_card);
 }
\ No newline at end of file
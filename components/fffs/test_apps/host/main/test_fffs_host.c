@@ -0,0 +1,1336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unity.h"
+
+#include "fffs.h"
+#include "fffs_bdev.h"
+#include "fffs_streams.h"
+
+#define IMAGE_PATH "/tmp/fffs_host_test.img"
+#define CRASH_PATH "/tmp/fffs_host_test_crash.img"
+#define STRIPE_PATH "/tmp/fffs_host_test_stripe.img"
+#define IMAGE_BLOCKS 8192
+#define MESSAGE_MAX 8192
+
+static uint8_t message[MESSAGE_MAX];
+static uint8_t expected[MESSAGE_MAX];
+
+/*
+ * Content and size of message id, so that any message can be checked without keeping it.
+ */
+static int message_size(uint32_t id)
+{
+    return 1 + (id * 2654435761u >> 9) % 300;
+}
+
+static void message_fill(uint8_t *buf, uint32_t id, int size)
+{
+    for (int i = 0; i < size; i++)
+        buf[i] = 'a' + (id * 7 + i) % 26;
+}
+
+static fffs_bdev_t *image_create(const char *path, uint32_t blocks)
+{
+    unlink(path);
+    fffs_bdev_t *bdev = fffs_bdev_file_open(path, blocks);
+    TEST_ASSERT_NOT_NULL(bdev);
+    return bdev;
+}
+
+/*
+ * Copies what bdev holds right now to an image of its own, as the card would be found after a power cut.
+ */
+static fffs_bdev_t *image_crash(fffs_bdev_t *bdev)
+{
+    fffs_bdev_t *crash = image_create(CRASH_PATH, bdev->capacity);
+
+    for (uint32_t block = 0; block < bdev->capacity; block += 64)
+    {
+        uint32_t count = bdev->capacity - block < 64 ? bdev->capacity - block : 64;
+        static uint8_t buf[64 * SD_BLOCK_SIZE];
+
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_bdev_read(bdev, buf, block, count));
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_bdev_write(crash, buf, block, count));
+    }
+
+    return crash;
+}
+
+static void write_messages(fffs_volume_t *vol, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t id = vol->message_id;
+
+        message_fill(message, id, message_size(id));
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, message_size(id)));
+    }
+}
+
+/*
+ * Reads every message from first up to the write head and checks its content.
+ */
+static void check_messages(fffs_volume_t *vol, uint32_t first)
+{
+    int size;
+
+    for (uint32_t id = first; id < vol->message_id; id++)
+    {
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read(vol, id, message, &size));
+        TEST_ASSERT_EQUAL(message_size(id), size);
+        message_fill(expected, id, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+}
+
+static fffs_config_t test_config(void)
+{
+    fffs_config_t config = FFFS_CONFIG_DEFAULT();
+
+    config.message_max = MESSAGE_MAX;
+    config.commit_interval_ms = 0; //Only spanning messages and full blocks reach the card on their own
+    return config;
+}
+
+static void test_remount_unflushed(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, 5000);
+    uint32_t written = vol->message_id;
+    uint32_t committed = vol->tail_first_message; //Every block before the tail is on the card
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    TEST_ASSERT_GREATER_OR_EQUAL(committed, recovered->message_id);
+    TEST_ASSERT_LESS_OR_EQUAL(written, recovered->message_id);
+    check_messages(recovered, 0);
+
+    write_messages(recovered, 500); //The recovered volume carries on from its own head
+    check_messages(recovered, 0);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_messages(vol, 0);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * A message spanning blocks is on the card once fffs_write returns, whatever the number of blocks it takes
+ * compared to batch_blocks.
+ */
+static void test_spanning_message_survives_power_cut(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    for (int size = FFFS_MESSAGE_MAX; size <= MESSAGE_MAX; size += 97)
+    {
+        uint32_t id = vol->message_id;
+        int read_size;
+
+        message_fill(message, id, 20);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, 20)); //Left in the tail, so the next message starts mid-block
+        message_fill(message, id + 1, size);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, size));
+
+        fffs_bdev_t *crash = image_crash(bdev);
+        fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+        TEST_ASSERT_NOT_NULL(recovered);
+        TEST_ASSERT_EQUAL(id + 2, recovered->message_id);
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read(recovered, id + 1, message, &read_size));
+        TEST_ASSERT_EQUAL(size, read_size);
+        message_fill(expected, id + 1, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+        fffs_deinit(recovered);
+        fffs_bdev_delete(crash);
+    }
+
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * A volume striped over two images keeps one id space, writes to both and mounts again from them.
+ */
+static void test_stripe_remount(void)
+{
+    fffs_bdev_t *members[2] = {image_create(IMAGE_PATH, IMAGE_BLOCKS / 2), image_create(STRIPE_PATH, IMAGE_BLOCKS / 2)};
+    fffs_bdev_t *bdev = fffs_bdev_stripe_create(members, 2, 8);
+    fffs_config_t config = test_config();
+    fffs_message_t batch[64];
+    static uint8_t buf[64][300];
+    uint8_t block[SD_BLOCK_SIZE];
+    TEST_ASSERT_NOT_NULL(bdev);
+    TEST_ASSERT_EQUAL(IMAGE_BLOCKS, bdev->capacity);
+
+    config.batch_blocks = 16;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    for (int round = 0; round < 100; round++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            uint32_t id = vol->message_id + i;
+
+            message_fill(buf[i], id, message_size(id));
+            batch[i].data = buf[i];
+            batch[i].size = message_size(id);
+        }
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write_batch(vol, batch, 64, NULL));
+    }
+    check_messages(vol, 0);
+
+    for (int unit = 0; unit < 2; unit++) //The second stripe unit of each member is written
+    {
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_bdev_read(members[unit], block, 8 + 1, 1));
+        TEST_ASSERT_TRUE(memcmp(block, (uint8_t[SD_BLOCK_SIZE]){0}, SD_BLOCK_SIZE) != 0);
+    }
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(6400, vol->message_id);
+    check_messages(vol, 0);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * A ring written round several times keeps the last lap readable, refuses what it wrote over, and mounts again with
+ * the same oldest message, cleanly or after a power cut.
+ */
+static void test_ring_wrap_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    int laps = 0, size;
+
+    config.message_rotate = true;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    while (laps < 3 || vol->current_sector < 5 * SECTOR_SIZE) //Stops part way into the fourth lap
+    {
+        uint32_t sector = vol->current_sector;
+
+        write_messages(vol, 100);
+        if (vol->current_sector < sector)
+            laps++;
+    }
+    write_messages(vol, 7); //Left in the tail
+    uint32_t written = vol->message_id;
+    uint32_t committed = vol->tail_first_message;
+    uint32_t oldest = vol->oldest_message_id;
+    TEST_ASSERT_GREATER_THAN(0, oldest);
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_read(vol, oldest - 1, message, &size));
+    check_messages(vol, oldest);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    TEST_ASSERT_EQUAL(oldest, recovered->oldest_message_id);
+    TEST_ASSERT_GREATER_OR_EQUAL(committed, recovered->message_id);
+    TEST_ASSERT_LESS_OR_EQUAL(written, recovered->message_id);
+    check_messages(recovered, oldest);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    TEST_ASSERT_EQUAL(oldest, vol->oldest_message_id);
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_read(vol, oldest - 1, message, &size));
+    check_messages(vol, oldest);
+
+    while (vol->oldest_message_id == oldest) //The remounted ring goes on writing over its oldest sector
+        write_messages(vol, 100);
+    TEST_ASSERT_GREATER_THAN(oldest, vol->oldest_message_id);
+    check_messages(vol, vol->oldest_message_id);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * Writes head_sector into the boot block, as a pointer left stale by a power cut or damaged would read.
+ */
+static void boot_head_set(fffs_bdev_t *bdev, uint32_t head_sector)
+{
+    static fffs_sector_table_t boot;
+
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_bdev_read(bdev, &boot, 0, 1));
+    boot.head_sector = head_sector;
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_bdev_write(bdev, &boot, 0, 1));
+}
+
+/*
+ * Mount finds the write head from any head pointer, stale by up to the whole card, past the head or garbage, and
+ * with head_sectors changed since the card was written.
+ */
+static void test_remount_stale_head_pointer(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, 4 * IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    while (vol->current_sector < 36 * SECTOR_SIZE)
+        write_messages(vol, 1000);
+    uint32_t written = vol->message_id;
+    uint32_t head = vol->current_sector / SECTOR_SIZE;
+    fffs_deinit(vol);
+
+    uint32_t garbage[] = {0xFFFFFFFF, 0x7FFFFF00, 12345, (head + 1) * SECTOR_SIZE, (head + 40) * SECTOR_SIZE};
+    uint32_t head_sectors[] = {16, 1, 0};
+
+    for (int h = 0; h < sizeof(head_sectors) / sizeof(head_sectors[0]); h++)
+    {
+        config.head_sectors = head_sectors[h];
+        for (uint32_t hint = 0; hint < head + 1 + sizeof(garbage) / sizeof(garbage[0]); hint++)
+        {
+            boot_head_set(bdev, hint <= head ? hint * SECTOR_SIZE : garbage[hint - head - 1]);
+            vol = fffs_init_with_config(bdev, false, &config);
+            TEST_ASSERT_NOT_NULL(vol);
+            TEST_ASSERT_EQUAL(head * SECTOR_SIZE, vol->current_sector);
+            TEST_ASSERT_EQUAL(written, vol->message_id);
+            fffs_deinit(vol);
+        }
+    }
+
+    boot_head_set(bdev, 0);
+    vol = fffs_init_with_config(bdev, true, &config); //Formatting must not be the way out
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_messages(vol, 0);
+    write_messages(vol, 100);
+    check_messages(vol, 0);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+#define STAMPED_MESSAGES 8000
+
+static uint32_t now;
+static uint32_t stamps[STAMPED_MESSAGES]; //<Clock each message was written at
+
+static uint32_t test_clock(void)
+{
+    return now;
+}
+
+static void write_stamped(fffs_volume_t *vol, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (vol->message_id % 16 == 0)
+            now++;
+        stamps[vol->message_id] = now;
+        write_messages(vol, 1);
+    }
+}
+
+/*
+ * Checks every message below the write head: those from first up to the ranges dropped[] are read back, those in
+ * them are not found.
+ */
+static void check_dropped(fffs_volume_t *vol, uint32_t first, const fffs_erased_range_t *dropped, int count)
+{
+    int size;
+
+    for (uint32_t id = 0; id < vol->message_id; id++)
+    {
+        bool gone = id < first;
+
+        for (int i = 0; i < count; i++)
+            gone = gone || (id >= dropped[i].from && id < dropped[i].to);
+
+        if (gone)
+        {
+            TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_read(vol, id, message, &size));
+            continue;
+        }
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read(vol, id, message, &size));
+        TEST_ASSERT_EQUAL(message_size(id), size);
+        message_fill(expected, id, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+}
+
+static esp_err_t (*image_read)(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count);
+
+static esp_err_t read_failing(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    return start_block == 0 ? image_read(bdev, dst, start_block, block_count) : ESP_FAIL;
+}
+
+/*
+ * Truncated and erased ranges stay dropped over a clean remount and a power cut, and a range that cannot be
+ * located leaves the ones recorded before it alone. fffs_seek_time finds the live blocks around a discarded run.
+ */
+static void test_erase_range_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, 4 * IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_erased_range_t dropped[] = {{.from = 9000, .to = 9500}, {.from = 20000, .to = 21000}};
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, 40000);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_truncate_before(vol, 3000));
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_erase_range(vol, 9000, 9200));
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_erase_range(vol, 9100, 9500)); //Merged with the range it overlaps
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_erase_range(vol, 20000, 21000));
+    TEST_ASSERT_EQUAL(ESP_ERR_NO_MEM, fffs_erase_range(vol, 30000, 30010));
+    check_dropped(vol, 3000, dropped, 2);
+
+    write_messages(vol, 100); //Left in the tail
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    TEST_ASSERT_EQUAL(3000, recovered->oldest_message_id);
+    check_dropped(recovered, 3000, dropped, 2);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    uint32_t written = vol->message_id;
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_dropped(vol, 3000, dropped, 2);
+
+    fffs_sector_table_t table = *vol->sector_table;
+    image_read = bdev->read;
+    bdev->read = read_failing;
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, fffs_erase_range(vol, 9400, 12000));
+    bdev->read = image_read;
+    TEST_ASSERT_EQUAL_MEMORY(table.erased, vol->sector_table->erased, sizeof(table.erased));
+    check_dropped(vol, 3000, dropped, 2);
+
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_truncate_before(vol, 9300)); //Swallows the first range
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_erase_range(vol, 30000, 30010));
+    dropped[0] = (fffs_erased_range_t){.from = 30000, .to = 30010};
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(9500, vol->oldest_message_id);
+    check_dropped(vol, 9500, dropped, 2);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+
+    bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS); //Blocks discarded mid-sector, between live ones
+    config.clock = test_clock;
+    vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    for (uint32_t id = 0; id < 200; id++)
+    {
+        stamps[id] = ++now;
+        write_messages(vol, 1);
+    }
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_erase_range(vol, 30, 150));
+    dropped[0] = (fffs_erased_range_t){.from = 30, .to = 150};
+    for (int mount = 0; mount < 2; mount++)
+    {
+        check_dropped(vol, 0, dropped, 1);
+        for (uint32_t id = 0; id < 200; id++)
+        {
+            uint32_t found;
+
+            TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_seek_time(vol, stamps[id], &found));
+            TEST_ASSERT_LESS_OR_EQUAL(id < 30 || id >= 150 ? id : 150, found);
+            for (uint32_t older = 0; older < found; older++)
+            {
+                if (older < 30 || older >= 150)
+                    TEST_ASSERT_LESS_THAN(stamps[id], stamps[older]);
+            }
+        }
+        fffs_deinit(vol);
+        vol = fffs_init_with_config(bdev, false, &config);
+        TEST_ASSERT_NOT_NULL(vol);
+    }
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * fffs_seek_time lands on the block holding the first message written at or after each time: no message before
+ * the id returned is that recent.
+ */
+static void check_seek_time(fffs_volume_t *vol)
+{
+    uint32_t id, first = 0;
+
+    for (uint32_t time = stamps[0]; time <= stamps[vol->message_id - 1]; time++)
+    {
+        while (stamps[first] < time)
+            first++;
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_seek_time(vol, time, &id));
+        TEST_ASSERT_LESS_OR_EQUAL(first, id);
+        if (id > 0)
+            TEST_ASSERT_LESS_THAN(time, stamps[id - 1]);
+    }
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_seek_time(vol, stamps[vol->message_id - 1] + 1, &id));
+    TEST_ASSERT_EQUAL(vol->message_id, id);
+}
+
+/*
+ * Block stamps keep fffs_seek_time working over a clean remount and a power cut, and stay in order when the clock
+ * goes back after the remount.
+ */
+static void test_seek_time_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+
+    now = 1000;
+    config.clock = test_clock;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_stamped(vol, 5000);
+    check_seek_time(vol);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    check_seek_time(recovered);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    check_seek_time(vol);
+
+    now -= 100; //A clock set back is held at the newest stamp on the card
+    for (uint32_t id = vol->message_id; id < vol->message_id + 1000; id++)
+        stamps[id] = stamps[vol->message_id - 1];
+    uint32_t held = vol->message_id + 1000;
+    write_messages(vol, 1000);
+    now += 200;
+    write_stamped(vol, 1000);
+    TEST_ASSERT_EQUAL(held + 1000, vol->message_id);
+    check_seek_time(vol);
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    check_seek_time(vol);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+#define KEYED_MESSAGES 3000
+#define KEYS 97
+
+static struct
+{
+    uint32_t ids[KEYED_MESSAGES];
+    int count;
+} lookup;
+
+static bool lookup_found(uint32_t message_id, void *ctx)
+{
+    TEST_ASSERT_LESS_THAN(KEYED_MESSAGES, lookup.count);
+    lookup.ids[lookup.count++] = message_id;
+    return true;
+}
+
+static uint64_t message_key(uint32_t id)
+{
+    return (id % KEYS) * 0x9E3779B97F4A7C15ULL;
+}
+
+/*
+ * Looks every key up and checks that it finds its messages newest first, down to its first one, and nothing else.
+ * With exact unset, as after a power cut, the newest ones may be missing.
+ */
+static void check_keys(fffs_volume_t *vol, bool exact)
+{
+    int size;
+
+    for (uint32_t k = 0; k < KEYS; k++)
+    {
+        uint32_t newest = (vol->message_id - 1 - k) / KEYS * KEYS + k;
+
+        lookup.count = 0;
+        esp_err_t err = fffs_lookup_key(vol, message_key(k), lookup_found, NULL);
+        if (!exact && err == ESP_ERR_NOT_FOUND)
+            continue;
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, err);
+        TEST_ASSERT_EQUAL(k, lookup.ids[lookup.count - 1]);
+        if (exact)
+            TEST_ASSERT_EQUAL(newest, lookup.ids[0]);
+
+        for (int i = 0; i < lookup.count; i++)
+        {
+            uint32_t id = lookup.ids[i];
+
+            TEST_ASSERT_EQUAL(lookup.ids[0] - i * KEYS, id);
+            TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read(vol, id, message, &size));
+            TEST_ASSERT_EQUAL(message_size(id), size);
+            message_fill(expected, id, size);
+            TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+        }
+    }
+}
+
+/*
+ * Keys spread over more buckets than are cached find all their messages over a clean remount, and only their own
+ * messages after a power cut.
+ */
+static void test_keys_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+
+    config.key_index_blocks = 32;
+    config.key_cache_buckets = 2;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    for (uint32_t id = 0; id < KEYED_MESSAGES; id++)
+    {
+        message_fill(message, id, message_size(id));
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write_key(vol, message, message_size(id), message_key(id)));
+    }
+    check_keys(vol, true);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    write_messages(recovered, 100); //Takes the ids lost with the tail, a key still pointing at one would find no link
+    check_keys(recovered, false);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(KEYED_MESSAGES, vol->message_id);
+    check_keys(vol, true);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+#define COMPACT_MESSAGES 5000
+
+static struct
+{
+    uint32_t seed; //<Id the content was filled from
+    int size;      //<0 when erased
+} contents[COMPACT_MESSAGES];
+
+static void replace_message(fffs_volume_t *vol, uint32_t id, int size)
+{
+    message_fill(message, id + COMPACT_MESSAGES, size);
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_replace(vol, id, message, size));
+    contents[id].seed = id + COMPACT_MESSAGES;
+    contents[id].size = size;
+}
+
+/*
+ * Checks the messages written by test_compact_replace_remount against contents, and that the copies made above
+ * them read as not found.
+ */
+static void check_contents(fffs_volume_t *vol)
+{
+    int size;
+
+    for (uint32_t id = 0; id < vol->message_id; id++)
+    {
+        if (id >= COMPACT_MESSAGES || contents[id].size == 0)
+        {
+            TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_read(vol, id, message, &size));
+            continue;
+        }
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read(vol, id, message, &size));
+        TEST_ASSERT_EQUAL(contents[id].size, size);
+        message_fill(expected, contents[id].seed, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+}
+
+/*
+ * Messages replaced with other sizes and those moved by compaction keep their ids and content over a clean remount
+ * and a power cut.
+ */
+static void test_compact_replace_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    uint32_t moved = 0;
+
+    config.forward_blocks = 16;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, COMPACT_MESSAGES);
+    for (uint32_t id = 0; id < COMPACT_MESSAGES; id++)
+    {
+        contents[id].seed = id;
+        contents[id].size = message_size(id);
+    }
+    uint32_t first = vol->sector_table->first_message; //First message of the write head, the sectors before it are sealed
+
+    for (uint32_t id = 0; id < first; id++)
+    {
+        if (id % 8 != 0) //Leaves every sector mostly dead
+        {
+            TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, id));
+            contents[id].size = 0;
+        }
+    }
+    replace_message(vol, 8, message_size(8)); //In place
+    replace_message(vol, 16, 400);
+    replace_message(vol, 24, 1);
+    replace_message(vol, first + 3, 2000); //Spans blocks
+    check_contents(vol);
+
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_compact(vol, 50, &moved));
+    TEST_ASSERT_GREATER_THAN(0, moved);
+    replace_message(vol, 16, 250); //Replaced again once forwarded
+    check_contents(vol);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    check_contents(recovered);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    uint32_t written = vol->message_id;
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_contents(vol);
+
+    replace_message(vol, 32, 77);
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, 40));
+    contents[40].size = 0;
+    check_contents(vol);
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    check_contents(vol);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+static esp_err_t (*image_erase)(fffs_bdev_t *bdev, size_t start_block, size_t block_count);
+
+static esp_err_t erase_failing(fffs_bdev_t *bdev, size_t start_block, size_t block_count)
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+/*
+ * A stream whose extent cannot be erased stays in the directory, on the card too, with its messages.
+ */
+static void test_stream_delete_erase_failure(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_streams_t *streams = fffs_streams_open(bdev, true);
+    TEST_ASSERT_NOT_NULL(streams);
+
+    fffs_volume_t *vol = fffs_stream_open(streams, "log", 4 * SECTOR_SIZE, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    write_messages(vol, 1000);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_flush(vol));
+
+    image_erase = bdev->erase;
+    bdev->erase = erase_failing;
+    TEST_ASSERT_EQUAL(ESP_ERR_TIMEOUT, fffs_stream_delete(streams, "log"));
+    bdev->erase = image_erase;
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_streams_close(streams));
+
+    streams = fffs_streams_open(bdev, false);
+    TEST_ASSERT_NOT_NULL(streams);
+    vol = fffs_stream_open(streams, "log", 0, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(1000, vol->message_id);
+    check_messages(vol, 0);
+
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_stream_delete(streams, "log"));
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_streams_close(streams));
+    streams = fffs_streams_open(bdev, false);
+    TEST_ASSERT_NOT_NULL(streams);
+    TEST_ASSERT_NULL(fffs_stream_open(streams, "log", 0, &config));
+    fffs_streams_close(streams);
+    fffs_bdev_delete(bdev);
+}
+
+static int reads_failing; //<Reads read_failing_once refuses before passing them on again
+
+static esp_err_t read_failing_once(fffs_bdev_t *bdev, void *dst, size_t start_block, size_t block_count)
+{
+    if (reads_failing > 0)
+    {
+        reads_failing--;
+        return ESP_FAIL;
+    }
+    return image_read(bdev, dst, start_block, block_count);
+}
+
+/*
+ * A stream that cannot be mounted is reported, never formatted over.
+ */
+static void test_stream_reopen_read_failure(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    fffs_streams_t *streams = fffs_streams_open(bdev, true);
+    TEST_ASSERT_NOT_NULL(streams);
+
+    fffs_volume_t *vol = fffs_stream_open(streams, "log", 4 * SECTOR_SIZE, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    write_messages(vol, 500);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_streams_close(streams));
+
+    streams = fffs_streams_open(bdev, false);
+    TEST_ASSERT_NOT_NULL(streams);
+    image_read = bdev->read;
+    bdev->read = read_failing_once;
+    reads_failing = 1;
+    TEST_ASSERT_NULL(fffs_stream_open(streams, "log", 0, &config));
+    bdev->read = image_read;
+
+    vol = fffs_stream_open(streams, "log", 0, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(500, vol->message_id);
+    check_messages(vol, 0);
+    fffs_streams_close(streams);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * Walks a cursor from first up to the write head and checks that it returns what fffs_read does, in order, passing
+ * over the messages fffs_read does not find.
+ */
+static void check_cursor(fffs_volume_t *vol, uint32_t first)
+{
+    fffs_cursor_t *cursor = fffs_cursor_open(vol, first);
+    uint32_t read_id;
+    int size, expected_size;
+    TEST_ASSERT_NOT_NULL(cursor);
+
+    for (uint32_t id = first; id < vol->message_id; id++)
+    {
+        esp_err_t err = fffs_read(vol, id, expected, &expected_size);
+
+        if (err == ESP_ERR_NOT_FOUND)
+            continue;
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, err);
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_cursor_next(cursor, message, &size, &read_id));
+        TEST_ASSERT_EQUAL(id, read_id);
+        TEST_ASSERT_EQUAL(expected_size, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_cursor_next(cursor, message, &size, &read_id));
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_cursor_close(cursor));
+}
+
+/*
+ * Cursors return messages in order from any id, spanning ones included and erased ones passed over, carry on
+ * from the write head once more is written, and do the same over a power cut and a clean remount.
+ */
+static void test_cursor_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    uint32_t read_id;
+    int size;
+
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, 3000);
+    for (int i = 0; i < 5; i++)
+    {
+        uint32_t id = vol->message_id;
+
+        message_fill(message, id, 3000 + i * 1000);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, 3000 + i * 1000));
+    }
+    write_messages(vol, 3000);
+    for (uint32_t id = 100; id < 2000; id += 37)
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, id));
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, vol->message_id - 1)); //Still in the tail
+
+    check_cursor(vol, 0);
+    check_cursor(vol, 1234);
+    check_cursor(vol, 2998); //Runs into the spanning messages
+    check_cursor(vol, vol->message_id);
+
+    uint32_t head = vol->message_id;
+    fffs_cursor_t *cursor = fffs_cursor_open(vol, head);
+    TEST_ASSERT_NOT_NULL(cursor);
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_cursor_next(cursor, message, &size, &read_id));
+    write_messages(vol, 50);
+    for (uint32_t id = head; id < head + 50; id++)
+    {
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_cursor_next(cursor, message, &size, &read_id));
+        TEST_ASSERT_EQUAL(id, read_id);
+        TEST_ASSERT_EQUAL(message_size(id), size);
+        message_fill(expected, id, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_cursor_next(cursor, message, &size, &read_id));
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_cursor_close(cursor));
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    check_cursor(recovered, 0);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    uint32_t written = vol->message_id;
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_cursor(vol, 0);
+    check_cursor(vol, 2998);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * Reads every message from first up to the write head through reader and checks it against fffs_read.
+ */
+static void check_reader(fffs_reader_t *reader, fffs_volume_t *vol, uint32_t first)
+{
+    int size, expected_size;
+
+    for (uint32_t id = first; id < vol->message_id; id++)
+    {
+        esp_err_t err = fffs_read(vol, id, expected, &expected_size);
+
+        TEST_ASSERT_EQUAL_HEX(err, fffs_reader_read(reader, id, message, &size));
+        if (err != ESP_OK)
+            continue;
+        TEST_ASSERT_EQUAL(expected_size, size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+}
+
+/*
+ * A reader returns committed messages from the card and those of the tail from RAM, in any order, keeps up with
+ * writes made after it was created and reads the same after a power cut and a clean remount.
+ */
+static void test_reader_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    int size;
+
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    fffs_reader_t *reader = fffs_reader_create(vol);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    write_messages(vol, 4000);
+    check_messages(vol, 0);
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t id = vol->message_id;
+
+        message_fill(message, id, 2000 + i * 2500);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, 2000 + i * 2500));
+    }
+    write_messages(vol, 20); //Left in the tail
+    for (uint32_t id = 50; id < 3000; id += 101)
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, id));
+    check_reader(reader, vol, 0);
+
+    for (uint32_t id = vol->message_id; id-- > 0;) //Backwards, so every read of a sealed block goes to the card
+    {
+        int expected_size;
+        esp_err_t err = fffs_read(vol, id, expected, &expected_size);
+
+        TEST_ASSERT_EQUAL_HEX(err, fffs_reader_read(reader, id, message, &size));
+        if (err == ESP_OK)
+            TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, fffs_reader_read(reader, vol->message_id, message, &size));
+
+    uint32_t head = vol->message_id;
+    write_messages(vol, 500);
+    check_reader(reader, vol, head);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_reader_delete(reader));
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    reader = fffs_reader_create(recovered);
+    TEST_ASSERT_NOT_NULL(reader);
+    check_reader(reader, recovered, 0);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_reader_delete(reader));
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    reader = fffs_reader_create(vol);
+    TEST_ASSERT_NOT_NULL(reader);
+    check_reader(reader, vol, 0);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_reader_delete(reader));
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+#define SCAN_MESSAGES 15000
+#define SCAN_DEVICES 10
+
+/*
+ * Records of test_scan_remount: the id as value_key and the id range it falls in as filter_key, followed by filler.
+ * Every tenth message is too short to hold them.
+ */
+static int scan_size(uint32_t id)
+{
+    return id % 10 == 9 ? 4 : 8 + id % 200;
+}
+
+static void scan_fill(uint8_t *buf, uint32_t id)
+{
+    int32_t value = id;
+    uint32_t device = id * SCAN_DEVICES / SCAN_MESSAGES;
+
+    message_fill(buf, id, scan_size(id));
+    if (scan_size(id) < 8)
+        return;
+    memcpy(buf, &value, 4);
+    memcpy(buf + 4, &device, 4);
+}
+
+static bool scan_value(const void *message, int size, int32_t *value)
+{
+    if (size < 8)
+        return false;
+    memcpy(value, message, 4);
+    return true;
+}
+
+static bool scan_device(const void *message, int size, uint32_t *key)
+{
+    if (size < 8)
+        return false;
+    memcpy(key, (const uint8_t *)message + 4, 4);
+    return true;
+}
+
+static bool scan_match(const void *message, int size, void *ctx)
+{
+    const fffs_query_t *query = ctx;
+    int32_t value;
+    uint32_t device;
+
+    if (!scan_value(message, size, &value) || !scan_device(message, size, &device))
+        return false;
+    if (query->use_value && (value < query->value_min || value > query->value_max))
+        return false;
+    return !query->use_filter || device == query->filter_key;
+}
+
+/*
+ * Runs query from the first message and checks that it returns every message matching it, in order. Returns the
+ * sectors skipped on their summary.
+ */
+static uint32_t check_scan(fffs_volume_t *vol, fffs_query_t query)
+{
+    uint32_t read_id, skipped;
+    int size;
+
+    query.match = scan_match;
+    query.ctx = &query;
+    fffs_scan_t *scan = fffs_scan_open(vol, 0, &query);
+    TEST_ASSERT_NOT_NULL(scan);
+
+    for (uint32_t id = 0; id < vol->message_id; id++)
+    {
+        scan_fill(expected, id);
+        if (!scan_match(expected, scan_size(id), &query))
+            continue;
+        TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_scan_next(scan, message, &size, &read_id));
+        TEST_ASSERT_EQUAL(id, read_id);
+        TEST_ASSERT_EQUAL(scan_size(id), size);
+        TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    }
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_NOT_FOUND, fffs_scan_next(scan, message, &size, &read_id));
+
+    skipped = scan->skipped;
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_scan_close(scan));
+    return skipped;
+}
+
+/*
+ * Runs value range and Bloom filter queries. Each finds all of its messages and skips the sealed sectors that
+ * cannot hold any.
+ */
+static void check_scans(fffs_volume_t *vol)
+{
+    fffs_query_t query = {0};
+
+    query.use_value = true;
+    query.value_min = SCAN_MESSAGES / 2;
+    query.value_max = SCAN_MESSAGES / 2 + 100;
+    TEST_ASSERT_GREATER_THAN(2, check_scan(vol, query));
+
+    query.value_min = -100;
+    query.value_max = -1;
+    TEST_ASSERT_GREATER_THAN(2, check_scan(vol, query));
+
+    query.use_value = false;
+    query.use_filter = true;
+    for (uint32_t device = 0; device < SCAN_DEVICES; device++) //A Bloom filter never rules out a sector holding the key
+    {
+        query.filter_key = device;
+        TEST_ASSERT_GREATER_THAN(2, check_scan(vol, query));
+    }
+
+    query.use_value = true;
+    query.value_min = 0;
+    query.value_max = SCAN_MESSAGES / 2;
+    query.filter_key = 1;
+    TEST_ASSERT_GREATER_THAN(2, check_scan(vol, query));
+}
+
+/*
+ * Scans with value range and Bloom filter queries return the same messages as a full read, before and after a
+ * power cut and a clean remount, and skip sealed sectors on the summaries kept on the card.
+ */
+static void test_scan_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+
+    config.value_key = scan_value;
+    config.filter_key = scan_device;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    for (uint32_t id = 0; id < SCAN_MESSAGES; id++)
+    {
+        scan_fill(message, id);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, scan_size(id)));
+    }
+    check_scans(vol);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    check_scans(recovered);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(SCAN_MESSAGES, vol->message_id);
+    check_scans(vol);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * Reads message id with fffs_read_into into exactly its size, one byte less and no buffer at all, and checks the
+ * result against fffs_read. A buffer too small is left alone.
+ */
+static void check_read_into(fffs_volume_t *vol, uint32_t id)
+{
+    int size, expected_size;
+    esp_err_t err = fffs_read(vol, id, expected, &expected_size);
+
+    if (err != ESP_OK)
+    {
+        TEST_ASSERT_EQUAL_HEX(err, fffs_read_into(vol, id, message, MESSAGE_MAX, &size));
+        return;
+    }
+
+    memset(message, 0xa5, MESSAGE_MAX);
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_read_into(vol, id, message, expected_size, &size));
+    TEST_ASSERT_EQUAL(expected_size, size);
+    TEST_ASSERT_EQUAL_MEMORY(expected, message, size);
+    TEST_ASSERT_EQUAL_HEX8(0xa5, message[size]);
+
+    memset(message, 0xa5, MESSAGE_MAX);
+    size = 0;
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_INVALID_SIZE, fffs_read_into(vol, id, message, expected_size - 1, &size));
+    TEST_ASSERT_EQUAL(expected_size, size);
+    for (int i = 0; i < expected_size; i++)
+        TEST_ASSERT_EQUAL_HEX8(0xa5, message[i]);
+
+    size = 0;
+    TEST_ASSERT_EQUAL_HEX(ESP_ERR_INVALID_SIZE, fffs_read_into(vol, id, NULL, 0, &size));
+    TEST_ASSERT_EQUAL(expected_size, size);
+}
+
+/*
+ * fffs_read_into returns messages from the card, from the tail and spanning blocks into a buffer of their exact
+ * size, and reports the size needed when the buffer is too small, before and after a power cut.
+ */
+static void test_read_into_remount(void)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+    int size;
+
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, 3000);
+    for (int i = 0; i < 4; i++)
+    {
+        uint32_t id = vol->message_id;
+
+        message_fill(message, id, 1500 + i * 2000);
+        TEST_ASSERT_EQUAL(ESP_OK, fffs_write(vol, message, 1500 + i * 2000));
+    }
+    write_messages(vol, 10); //Left in the tail
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, 1000));
+    TEST_ASSERT_EQUAL_HEX(ESP_OK, fffs_erase(vol, vol->message_id - 2));
+
+    for (uint32_t id = 0; id < vol->message_id; id += id < 2990 ? 13 : 1)
+        check_read_into(vol, id);
+    check_read_into(vol, 1000);
+    TEST_ASSERT_NOT_EQUAL(ESP_OK, fffs_read_into(vol, vol->message_id, message, MESSAGE_MAX, &size));
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    for (uint32_t id = 0; id < recovered->message_id; id += id < 2990 ? 13 : 1)
+        check_read_into(recovered, id);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+/*
+ * Checks that some blocks of the sector being written hold compressed messages.
+ */
+static void check_compressed(fffs_volume_t *vol)
+{
+    int blocks = 0;
+
+    for (int i = 0; i < sizeof(vol->sector_table->compressed_blocks); i++)
+        blocks += __builtin_popcount(vol->sector_table->compressed_blocks[i]);
+    TEST_ASSERT_GREATER_THAN(0, blocks);
+}
+
+/*
+ * Reads every message of a compressed volume with fffs_read, a cursor, a reader and fffs_read_into.
+ */
+static void check_compressed_reads(fffs_volume_t *vol)
+{
+    fffs_reader_t *reader = fffs_reader_create(vol);
+    TEST_ASSERT_NOT_NULL(reader);
+
+    check_messages(vol, 0);
+    check_cursor(vol, 0);
+    check_cursor(vol, vol->message_id / 2);
+    check_reader(reader, vol, 0);
+    for (uint32_t id = 0; id < vol->message_id; id += 7)
+        check_read_into(vol, id);
+    TEST_ASSERT_EQUAL(ESP_OK, fffs_reader_delete(reader));
+}
+
+/*
+ * Messages compressed against the earlier ones of their block read back the same through every read path, after a
+ * power cut and a clean remount, and appends made after a remount compress against the tail rebuilt at mount.
+ */
+static void compressed_remount(bool pack_messages)
+{
+    fffs_bdev_t *bdev = image_create(IMAGE_PATH, IMAGE_BLOCKS);
+    fffs_config_t config = test_config();
+
+    config.compress = true;
+    config.pack_messages = pack_messages;
+    fffs_volume_t *vol = fffs_init_with_config(bdev, true, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+
+    write_messages(vol, 4000);
+    check_compressed(vol);
+    check_compressed_reads(vol);
+
+    fffs_bdev_t *crash = image_crash(bdev);
+    fffs_volume_t *recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    check_compressed_reads(recovered);
+    write_messages(recovered, 500);
+    check_compressed(recovered);
+    check_compressed_reads(recovered);
+    uint32_t written = recovered->message_id;
+    fffs_deinit(recovered);
+    recovered = fffs_init_with_config(crash, false, &config);
+    TEST_ASSERT_NOT_NULL(recovered);
+    TEST_ASSERT_EQUAL(written, recovered->message_id);
+    check_compressed_reads(recovered);
+    fffs_deinit(recovered);
+    fffs_bdev_delete(crash);
+
+    written = vol->message_id;
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_compressed_reads(vol);
+    write_messages(vol, 500);
+    check_compressed_reads(vol);
+    written = vol->message_id;
+    fffs_deinit(vol);
+    vol = fffs_init_with_config(bdev, false, &config);
+    TEST_ASSERT_NOT_NULL(vol);
+    TEST_ASSERT_EQUAL(written, vol->message_id);
+    check_compressed_reads(vol);
+    fffs_deinit(vol);
+    fffs_bdev_delete(bdev);
+}
+
+static void test_compressed_remount(void)
+{
+    compressed_remount(false);
+    compressed_remount(true);
+}
+
+void app_main(void)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_remount_unflushed);
+    RUN_TEST(test_spanning_message_survives_power_cut);
+    RUN_TEST(test_remount_stale_head_pointer);
+    RUN_TEST(test_ring_wrap_remount);
+    RUN_TEST(test_stripe_remount);
+    RUN_TEST(test_erase_range_remount);
+    RUN_TEST(test_compact_replace_remount);
+    RUN_TEST(test_seek_time_remount);
+    RUN_TEST(test_keys_remount);
+    RUN_TEST(test_stream_delete_erase_failure);
+    RUN_TEST(test_stream_reopen_read_failure);
+    RUN_TEST(test_cursor_remount);
+    RUN_TEST(test_reader_remount);
+    RUN_TEST(test_scan_remount);
+    RUN_TEST(test_read_into_remount);
+    RUN_TEST(test_compressed_remount);
+    exit(UNITY_END());
+}